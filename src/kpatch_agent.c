@@ -0,0 +1,428 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/user.h>
+
+#include "kpatch_process.h"
+#include "kpatch_common.h"
+#include "kpatch_ptrace.h"
+#include "kpatch_agent.h"
+#include "kpatch_log.h"
+
+/*
+ * The agent is a tiny command interpreter injected into the patient.
+ * Commands are queued by the doctor into a ring mapped shared by both
+ * processes, then a single remote execution runs all of them. This
+ * replaces a remote execution (or a pair of /proc/pid/mem accesses)
+ * per operation with one per batch.
+ *
+ * Called with %rdi pointing to the struct kpatch_agent_ring.
+ */
+static const unsigned char agent_code[] = {
+	0x48, 0x81, 0xec, 0x80, 0x00, 0x00, 0x00, /* sub $128, %rsp */
+	0x48, 0x83, 0xe4, 0xf0, /* and $-16, %rsp */
+	0xfc, /* cld */
+	0x4c, 0x8b, 0x27, /* mov (%rdi), %r12 */
+	0x48, 0x8d, 0x5f, 0x40, /* lea 64(%rdi), %rbx */
+	0x4d, 0x85, 0xe4, /* 1: test %r12, %r12 */
+	0x74, 0x63, /* je 9f */
+	0x48, 0x8b, 0x03, /* mov (%rbx), %rax */
+	0x48, 0x83, 0xf8, 0x01, /* cmp $KPATCH_AGENT_OP_MEMCPY, %rax */
+	0x74, 0x15, /* je 2f */
+	0x48, 0x83, 0xf8, 0x02, /* cmp $KPATCH_AGENT_OP_SYSCALL, %rax */
+	0x74, 0x21, /* je 3f */
+	0x48, 0x83, 0xf8, 0x03, /* cmp $KPATCH_AGENT_OP_CALL, %rax */
+	0x74, 0x3b, /* je 4f */
+	0x48, 0xc7, 0xc0, 0xea, 0xff, 0xff, 0xff, /* mov $-EINVAL, %rax */
+	0xeb, 0x38, /* jmp 8f */
+	0x48, 0x8b, 0x7b, 0x10, /* 2: mov 16(%rbx), %rdi */
+	0x48, 0x8b, 0x73, 0x18, /* mov 24(%rbx), %rsi */
+	0x48, 0x8b, 0x4b, 0x20, /* mov 32(%rbx), %rcx */
+	0xf3, 0xa4, /* rep movsb */
+	0x31, 0xc0, /* xor %eax, %eax */
+	0xeb, 0x26, /* jmp 8f */
+	0x48, 0x8b, 0x43, 0x10, /* 3: mov 16(%rbx), %rax */
+	0x48, 0x8b, 0x7b, 0x18, /* mov 24(%rbx), %rdi */
+	0x48, 0x8b, 0x73, 0x20, /* mov 32(%rbx), %rsi */
+	0x48, 0x8b, 0x53, 0x28, /* mov 40(%rbx), %rdx */
+	0x4c, 0x8b, 0x53, 0x30, /* mov 48(%rbx), %r10 */
+	0x4c, 0x8b, 0x43, 0x38, /* mov 56(%rbx), %r8 */
+	0x4c, 0x8b, 0x4b, 0x40, /* mov 64(%rbx), %r9 */
+	0x0f, 0x05, /* syscall */
+	0xeb, 0x06, /* jmp 8f */
+	0x48, 0x8b, 0x43, 0x10, /* 4: mov 16(%rbx), %rax */
+	0xff, 0xd0, /* call *%rax */
+	0x48, 0x89, 0x43, 0x08, /* 8: mov %rax, 8(%rbx) */
+	0x48, 0x83, 0xc3, 0x50, /* add $sizeof(struct kpatch_agent_cmd), %rbx */
+	0x49, 0xff, 0xcc, /* dec %r12 */
+	0xeb, 0x98, /* jmp 1b */
+	0xcc, /* 9: int3 */
+};
+
+#define AGENT_DATA_SIZE	(KPATCH_AGENT_RING_SIZE - \
+			 offsetof(struct kpatch_agent_ring, data))
+
+int kpatch_agent_inject(kpatch_process_t *proc)
+{
+	struct kpatch_ptrace_ctx *pctx = proc2pctx(proc);
+	struct kpatch_agent *agent;
+	char name[64], buf[256];
+	struct stat st;
+	unsigned long code = 0, remote = 0;
+	void *ring = MAP_FAILED;
+	int fd, rfd, ret = -1;
+	size_t len;
+
+	agent = calloc(1, sizeof(*agent));
+	if (agent == NULL)
+		return -1;
+
+	snprintf(name, sizeof(name), "/libcare-agent-%d", proc->pid);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		kplogerror("can't create agent ring '%s'\n", name);
+		free(agent);
+		return -1;
+	}
+
+	/* Patient can run as a different user, it must be able to open it */
+	snprintf(buf, sizeof(buf), "/proc/%d", proc->pid);
+	if (stat(buf, &st) < 0 || fchown(fd, st.st_uid, st.st_gid) < 0) {
+		kplogerror("can't chown agent ring\n");
+		goto out;
+	}
+
+	if (ftruncate(fd, KPATCH_AGENT_RING_SIZE) < 0) {
+		kplogerror("can't resize agent ring\n");
+		goto out;
+	}
+
+	ring = mmap(NULL, KPATCH_AGENT_RING_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
+		kplogerror("can't map agent ring\n");
+		goto out;
+	}
+
+	code = kpatch_mmap_remote(pctx, 0, getpagesize(),
+				  PROT_READ | PROT_EXEC,
+				  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == 0) {
+		kplogerror("can't allocate agent code\n");
+		goto out;
+	}
+
+	/* Agent's code is followed by the ring path for the open below */
+	memcpy(buf, agent_code, sizeof(agent_code));
+	len = sizeof(agent_code);
+	len += snprintf(buf + len, sizeof(buf) - len, "/dev/shm%s", name) + 1;
+
+	ret = kpatch_process_mem_write(proc, buf, code, len);
+	if (ret < 0) {
+		kplogerror("can't write agent code\n");
+		goto out;
+	}
+
+	ret = -1;
+	rfd = kpatch_open_remote(pctx, code + sizeof(agent_code), O_RDWR);
+	if (rfd < 0) {
+		kplogerror("patient can't open agent ring\n");
+		goto out;
+	}
+
+	remote = kpatch_mmap_remote(pctx, 0, KPATCH_AGENT_RING_SIZE,
+				    PROT_READ | PROT_WRITE, MAP_SHARED,
+				    rfd, 0);
+	kpatch_close_remote(pctx, rfd);
+	if (remote == 0) {
+		kplogerror("patient can't map agent ring\n");
+		goto out;
+	}
+
+	agent->code = code;
+	agent->remote = remote;
+	agent->ring = ring;
+	proc->agent = agent;
+
+	kpinfo("Injected agent at 0x%lx, ring at 0x%lx\n", code, remote);
+	ret = 0;
+
+out:
+	shm_unlink(name);
+	close(fd);
+	if (ret < 0) {
+		if (code)
+			kpatch_munmap_remote(pctx, code, getpagesize());
+		if (ring != MAP_FAILED)
+			munmap(ring, KPATCH_AGENT_RING_SIZE);
+		free(agent);
+	}
+	return ret;
+}
+
+void kpatch_agent_destroy(kpatch_process_t *proc)
+{
+	struct kpatch_agent *agent = proc->agent;
+	struct kpatch_ptrace_ctx *pctx = proc2pctx(proc);
+
+	if (agent == NULL)
+		return;
+
+	if (agent->ring->ncmds)
+		kpwarn("dropping %ld unflushed agent command(s)\n",
+		       agent->ring->ncmds);
+
+	/* Remote syscalls below must not go through the agent */
+	proc->agent = NULL;
+
+	if (kpatch_munmap_remote(pctx, agent->remote,
+				 KPATCH_AGENT_RING_SIZE) < 0 ||
+	    kpatch_munmap_remote(pctx, agent->code, getpagesize()) < 0)
+		kplogerror("can't unmap agent\n");
+
+	munmap(agent->ring, KPATCH_AGENT_RING_SIZE);
+	free(agent);
+}
+
+int kpatch_agent_flush(struct kpatch_ptrace_ctx *pctx)
+{
+	struct kpatch_agent *agent = pctx->proc->agent;
+	struct kpatch_agent_ring *ring;
+	struct user_regs_struct regs;
+	unsigned long i;
+	int ret;
+
+	if (agent == NULL || agent->ring->ncmds == 0)
+		return 0;
+
+	ring = agent->ring;
+
+	kpdebug("Executing %ld agent command(s) (pid %d)\n",
+		ring->ncmds, pctx->pid);
+	regs.rdi = agent->remote;
+	ret = kpatch_execute_remote_at(pctx, agent->code, &regs);
+
+	for (i = 0; i < ring->ncmds; i++) {
+		if (ret == 0 && agent->results[i])
+			*agent->results[i] = ring->cmds[i].ret;
+		agent->results[i] = NULL;
+	}
+	ring->ncmds = 0;
+	agent->datalen = 0;
+
+	return ret;
+}
+
+static struct kpatch_agent_cmd *
+agent_queue(kpatch_process_t *proc,
+	    unsigned long op,
+	    unsigned long *res)
+{
+	struct kpatch_agent *agent = proc->agent;
+	struct kpatch_agent_cmd *cmd;
+
+	if (agent->ring->ncmds == KPATCH_AGENT_MAX_CMDS &&
+	    kpatch_agent_flush(proc2pctx(proc)) < 0)
+		return NULL;
+
+	agent->results[agent->ring->ncmds] = res;
+	cmd = &agent->ring->cmds[agent->ring->ncmds++];
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->op = op;
+
+	return cmd;
+}
+
+static int
+agent_queue_mprotect(kpatch_process_t *proc,
+		     unsigned long start,
+		     unsigned long end,
+		     int prot)
+{
+	struct kpatch_agent_cmd *cmd;
+
+	cmd = agent_queue(proc, KPATCH_AGENT_OP_SYSCALL, NULL);
+	if (cmd == NULL)
+		return -1;
+
+	cmd->arg[0] = __NR_mprotect;
+	cmd->arg[1] = start;
+	cmd->arg[2] = end - start;
+	cmd->arg[3] = prot;
+
+	return 0;
+}
+
+/*
+ * Queue the agent's copy of `size` bytes from `src` to `dst`, both in the
+ * patient, or of `buf` staged in the ring's data if it is given. The
+ * agent copies with plain stores, so a target that is not writable, such
+ * as the original text, is made writable for the copy only, within the
+ * same batch. Returns 1 if the protection of the target is not known.
+ */
+static int
+agent_queue_memcpy(kpatch_process_t *proc,
+		   unsigned long dst,
+		   unsigned long src,
+		   size_t size,
+		   const void *buf)
+{
+	struct kpatch_agent *agent = proc->agent;
+	struct kpatch_agent_cmd *cmd;
+	unsigned long start, end;
+	int prot;
+
+	prot = kpatch_process_addr_prot(proc, dst, size);
+	if (prot < 0)
+		return 1;
+
+	start = ROUND_DOWN(dst, PAGE_SIZE);
+	end = ROUND_UP(dst + size, PAGE_SIZE);
+	if (!(prot & PROT_WRITE) &&
+	    agent_queue_mprotect(proc, start, end, prot | PROT_WRITE) < 0)
+		return -1;
+
+	cmd = agent_queue(proc, KPATCH_AGENT_OP_MEMCPY, NULL);
+	if (cmd == NULL)
+		return -1;
+
+	/* Stage the data now, the queue is flushed once it is full */
+	if (buf != NULL) {
+		src = agent->remote +
+			offsetof(struct kpatch_agent_ring, data) +
+			agent->datalen;
+		memcpy(agent->ring->data + agent->datalen, buf, size);
+		agent->datalen += size;
+	}
+	cmd->arg[0] = dst;
+	cmd->arg[1] = src;
+	cmd->arg[2] = size;
+
+	if (!(prot & PROT_WRITE) &&
+	    agent_queue_mprotect(proc, start, end, prot) < 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Write `size` bytes at `dst` in the patient. The data is staged in
+ * the ring and copied by the agent on the next flush.
+ * Falls back to the immediate write if there is no agent.
+ */
+int kpatch_agent_write(kpatch_process_t *proc,
+		       void *src,
+		       unsigned long dst,
+		       size_t size)
+{
+	struct kpatch_agent *agent = proc->agent;
+	size_t len;
+	int ret;
+
+	if (agent == NULL)
+		return kpatch_process_mem_write(proc, src, dst, size);
+
+	while (size) {
+		if (agent->datalen == AGENT_DATA_SIZE ||
+		    agent->ring->ncmds == KPATCH_AGENT_MAX_CMDS) {
+			if (kpatch_agent_flush(proc2pctx(proc)) < 0)
+				return -1;
+		}
+
+		len = AGENT_DATA_SIZE - agent->datalen;
+		if (len > size)
+			len = size;
+
+		ret = agent_queue_memcpy(proc, dst, 0, len, src);
+		if (ret < 0)
+			return -1;
+
+		/* Don't know if it's writable, write after what's queued */
+		if (ret > 0 &&
+		    (kpatch_agent_flush(proc2pctx(proc)) < 0 ||
+		     kpatch_process_mem_write(proc, src, dst, len) < 0))
+			return -1;
+
+		src += len;
+		dst += len;
+		size -= len;
+	}
+
+	return 0;
+}
+
+/*
+ * Copy `size` bytes from `src` to `dst`, both in the patient.
+ * Falls back to the immediate copy if there is no agent.
+ */
+int kpatch_agent_memcpy(kpatch_process_t *proc,
+			unsigned long dst,
+			unsigned long src,
+			size_t size)
+{
+	int ret;
+
+	if (proc->agent == NULL) {
+		ret = kpatch_process_memcpy(proc, dst, src, size);
+		return ret < 0 ? -1 : 0;
+	}
+
+	ret = agent_queue_memcpy(proc, dst, src, size, NULL);
+	if (ret <= 0)
+		return ret;
+
+	/* Don't know if it's writable, copy after what's queued */
+	if (kpatch_agent_flush(proc2pctx(proc)) < 0)
+		return -1;
+	ret = kpatch_process_memcpy(proc, dst, src, size);
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Call `func` in the patient, result is stored to `res` on flush.
+ */
+int kpatch_agent_call(kpatch_process_t *proc,
+		      unsigned long func,
+		      unsigned long *res)
+{
+	struct kpatch_agent_cmd *cmd;
+
+	cmd = agent_queue(proc, KPATCH_AGENT_OP_CALL, res);
+	if (cmd == NULL)
+		return -1;
+
+	cmd->arg[0] = func;
+
+	return 0;
+}
+
+int kpatch_agent_syscall(struct kpatch_ptrace_ctx *pctx, int nr,
+			 unsigned long arg1, unsigned long arg2,
+			 unsigned long arg3, unsigned long arg4,
+			 unsigned long arg5, unsigned long arg6,
+			 unsigned long *res)
+{
+	struct kpatch_agent_cmd *cmd;
+
+	kpdebug("Queueing syscall %d (pid %d)...\n", nr, pctx->pid);
+	cmd = agent_queue(pctx->proc, KPATCH_AGENT_OP_SYSCALL, res);
+	if (cmd == NULL)
+		return -1;
+
+	cmd->arg[0] = nr;
+	cmd->arg[1] = arg1;
+	cmd->arg[2] = arg2;
+	cmd->arg[3] = arg3;
+	cmd->arg[4] = arg4;
+	cmd->arg[5] = arg5;
+	cmd->arg[6] = arg6;
+
+	/* Callers want the result right away */
+	return kpatch_agent_flush(pctx);
+}
@@ -0,0 +1,70 @@
+#ifndef __KPATCH_AGENT__
+#define __KPATCH_AGENT__
+
+#include <stddef.h>
+
+struct kpatch_process;
+struct kpatch_ptrace_ctx;
+
+#define KPATCH_AGENT_OP_MEMCPY		1 /* memcpy(arg[0], arg[1], arg[2]) */
+#define KPATCH_AGENT_OP_SYSCALL		2 /* syscall arg[0] with arg[1..6] */
+#define KPATCH_AGENT_OP_CALL		3 /* call *arg[0] */
+
+struct kpatch_agent_cmd {
+	unsigned long op;
+	unsigned long ret;
+	unsigned long arg[7];
+	unsigned long pad;
+};
+
+#define KPATCH_AGENT_MAX_CMDS	256
+#define KPATCH_AGENT_RING_SIZE	(1024 * 1024)
+
+/* Command ring shared between the doctor and the patient */
+struct kpatch_agent_ring {
+	unsigned long ncmds;
+	unsigned long pad[7];
+	struct kpatch_agent_cmd cmds[KPATCH_AGENT_MAX_CMDS];
+	char data[];
+};
+
+struct kpatch_agent {
+	/* Agent's code in the patient */
+	unsigned long code;
+
+	/* Ring as seen by the patient */
+	unsigned long remote;
+
+	/* Ring as seen by us */
+	struct kpatch_agent_ring *ring;
+
+	/* Used bytes of ring->data */
+	size_t datalen;
+
+	/* Where to store results of the queued commands */
+	unsigned long *results[KPATCH_AGENT_MAX_CMDS];
+};
+
+int kpatch_agent_inject(struct kpatch_process *proc);
+void kpatch_agent_destroy(struct kpatch_process *proc);
+
+int kpatch_agent_flush(struct kpatch_ptrace_ctx *pctx);
+
+int kpatch_agent_write(struct kpatch_process *proc,
+		       void *src,
+		       unsigned long dst,
+		       size_t size);
+int kpatch_agent_memcpy(struct kpatch_process *proc,
+			unsigned long dst,
+			unsigned long src,
+			size_t size);
+int kpatch_agent_call(struct kpatch_process *proc,
+		      unsigned long func,
+		      unsigned long *res);
+int kpatch_agent_syscall(struct kpatch_ptrace_ctx *pctx, int nr,
+			 unsigned long arg1, unsigned long arg2,
+			 unsigned long arg3, unsigned long arg4,
+			 unsigned long arg5, unsigned long arg6,
+			 unsigned long *res);
+
+#endif
@@ -168,18 +168,18 @@ static const char *kpatch_path = NULL;
 static void kpccfatal(const char *fmt, ...)
 	__attribute__((__format__ (__printf__, 1, 0)));
 
-static int split_args(char **split, char *args)
+static int split_args(char **split, int max, char *args)
 {
 	char *tok;
 	int i = 0;
 
 	tok = strtok(args, ";");
-	while (tok && i < MAX_MODIFY_ARGS) {
+	while (tok && i < max) {
 		split[i++] = tok;
 		tok = strtok(NULL, ";");
 	}
 
-	if (tok && i == MAX_MODIFY_ARGS)
+	if (tok && i == max)
 		kpccfatal("Too many args modifiers\n");
 
 	return i;
@@ -307,7 +307,7 @@ static void init(int argc_, const char **argv_)
 
 	args = getenv("KPCC_REMOVE_ARGS");
 	if (args != NULL) {
-		nremove_args = split_args(remove_args, args);
+		nremove_args = split_args(remove_args, MAX_MODIFY_ARGS, args);
 
 		qsort(remove_args, nremove_args, sizeof(*remove_args),
 		      (int (*)(const void *, const void *))strcmp);
@@ -315,17 +315,25 @@ static void init(int argc_, const char **argv_)
 
 	args = getenv("KPCC_APPEND_ARGS");
 	if (args != NULL) {
-		nappend_args = split_args(append_args, args);
+		nappend_args = split_args(append_args, MAX_MODIFY_ARGS, args);
 	}
 
 	args = getenv("KPCC_DBGFILTER_ARGS");
 	if (args != NULL) {
-		ndbgfilter_args = split_args(dbgfilter_args, args);
+		ndbgfilter_args = split_args(dbgfilter_args, MAX_MODIFY_ARGS,
+					     args);
 	}
 
 	args = getenv("KPCC_PATCH_ARGS");
 	if (args != NULL) {
-		npatch_args = split_args(patch_args, args);
+		npatch_args = split_args(patch_args, MAX_MODIFY_ARGS, args);
+	}
+
+	/* Added to the patch args above, be they the default or given ones */
+	args = getenv("KPCC_PATCH_APPEND_ARGS");
+	if (args != NULL) {
+		npatch_args += split_args(patch_args + npatch_args,
+					  MAX_MODIFY_ARGS - npatch_args, args);
 	}
 
 	kpatch_gensrc_asm = getenv("KPATCH_GENSRC_ASM") != NULL;
@@ -47,6 +47,7 @@ int kpatch_open_fd(int fd, struct kp_file *kpatch)
 	}
 	kpdebug("OK\nMapping patch file...");
 	kpatch->size = st.st_size;
+	kpatch->tmpl = NULL;
 	kpatch->patch = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
 	if (kpatch->patch == MAP_FAILED) {
 		kpdebug("FAIL: %s\n", strerror(errno));
@@ -1,17 +1,22 @@
 #ifndef __KPATCH_COMMON__
 #define __KPATCH_COMMON__
 
+struct kpatch_reloc_tmpl;
+
 struct kp_file {
 	struct kpatch_file *patch;
 	ssize_t size;
+	/* Relocation template made by the doctor for the storage patches */
+	struct kpatch_reloc_tmpl *tmpl;
 };
 
-#define INIT_KP_FILE()	{ .patch = NULL, .size = 0 }
+#define INIT_KP_FILE()	{ .patch = NULL, .size = 0, .tmpl = NULL }
 static inline void
 init_kp_file(struct kp_file *kpf)
 {
 	kpf->patch = NULL;
 	kpf->size = 0;
+	kpf->tmpl = NULL;
 }
 
 #include <errno.h>	/* GNU has TLS errno */
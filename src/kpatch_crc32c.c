@@ -0,0 +1,59 @@
+#include <string.h>
+
+#include "kpatch_crc32c.h"
+
+#define CRC32C_POLY	0x82f63b78
+
+static uint32_t crc32c_table[256];
+
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	int i, j;
+
+	if (crc32c_table[1] == 0) {
+		for (i = 0; i < 256; i++) {
+			uint32_t c = i;
+
+			for (j = 0; j < 8; j++)
+				c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+			crc32c_table[i] = c;
+		}
+	}
+
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+/* SSE4.2 has an instruction computing CRC32C 8 bytes at a time */
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	unsigned long long c = crc;
+	unsigned long long v;
+
+	for (; len >= sizeof(v); len -= sizeof(v), p += sizeof(v)) {
+		memcpy(&v, p, sizeof(v));
+		c = __builtin_ia32_crc32di(c, v);
+	}
+	crc = c;
+	while (len--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+
+	return crc;
+}
+#endif
+
+uint32_t kpatch_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	crc = ~crc;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+		return ~crc32c_hw(crc, buf, len);
+#endif
+	return ~crc32c_sw(crc, buf, len);
+}
@@ -0,0 +1,10 @@
+#ifndef __KPATCH_CRC32C_H__
+#define __KPATCH_CRC32C_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC32C (Castagnoli) of `len` bytes at `buf` */
+uint32_t kpatch_crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
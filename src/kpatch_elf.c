@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <limits.h>
+#include <link.h>
 
 #include <gelf.h>
 
@@ -417,6 +418,40 @@ static char *secname(GElf_Ehdr *ehdr, GElf_Shdr *s)
 	return str + s->sh_name;
 }
 
+/*
+ * Indexes of the patch's `.kpatch.info` and symbol table. Version 2
+ * files have them in the header, older ones are searched through.
+ */
+static int kpatch_info_section(struct kpatch_file *kp)
+{
+	GElf_Ehdr *ehdr = (void *)kp + kp->kpatch_offset;
+	GElf_Shdr *shdr = (void *)ehdr + ehdr->e_shoff;
+	int i;
+
+	if (kp->version >= KPATCH_FILE_VERSION2)
+		return kp->sec_info;
+
+	for (i = 1; i < ehdr->e_shnum; i++)
+		if (!strcmp(secname(ehdr, shdr + i), ".kpatch.info"))
+			return i;
+	return 0;
+}
+
+static int kpatch_symtab_section(struct kpatch_file *kp)
+{
+	GElf_Ehdr *ehdr = (void *)kp + kp->kpatch_offset;
+	GElf_Shdr *shdr = (void *)ehdr + ehdr->e_shoff;
+	int i;
+
+	if (kp->version >= KPATCH_FILE_VERSION2)
+		return kp->sec_symtab;
+
+	for (i = 1; i < ehdr->e_shnum; i++)
+		if (shdr[i].sh_type == SHT_SYMTAB)
+			return i;
+	return 0;
+}
+
 static int kpatch_is_our_section(GElf_Shdr *s)
 {
 	// FIXME: is this enough???
@@ -465,14 +500,7 @@ int kpatch_count_undefined(struct object_file *o)
 
 	ehdr = (void *)o->kpfile.patch + o->kpfile.patch->kpatch_offset;
 	shdr = (void *)ehdr + ehdr->e_shoff;
-
-	for (i = 1; i < ehdr->e_shnum; i++) {
-		GElf_Shdr *s = shdr + i;
-		if (s->sh_type == SHT_SYMTAB) {
-			symidx = i;
-			break;
-		}
-	}
+	symidx = kpatch_symtab_section(o->kpfile.patch);
 
 	kpdebug("Counting undefined symbols:\n");
 	sym = (void *)ehdr + shdr[symidx].sh_offset;
@@ -491,6 +519,85 @@ int kpatch_count_undefined(struct object_file *o)
 	return count;
 }
 
+#define MOV_INSN	0x8b
+#define LEA_INSN	0x8d
+#define INDIRECT_INSN	0xff
+#define CALL_INSN	0xe8
+#define JMP_INSN	0xe9
+#define NOP_INSN	0x90
+#define ADDR32_PREFIX	0x67
+#define ADD_INSN	0x03
+#define ADD_IMM_INSN	0x81
+#define MOV_IMM_INSN	0xc7
+
+/*
+ * Return true if the GOTPCREL relocation at `loc` is used to load the address
+ * from GOT, i.e. it was left by `kpatch_strip --pic` as is, rather than
+ * turned into `lea` that takes the symbol's address directly.
+ */
+static int is_got_load(const unsigned char *loc)
+{
+	/* mov foo@GOTPCREL(%rip), %reg */
+	if (loc[-2] == MOV_INSN && (loc[-1] & 0xc7) == 0x05)
+		return 1;
+	/* call/jmp *foo@GOTPCREL(%rip) */
+	if (loc[-2] == INDIRECT_INSN && (loc[-1] == 0x15 || loc[-1] == 0x25))
+		return 1;
+	return 0;
+}
+
+static inline int
+is_gotpcrel(unsigned long type)
+{
+	return type == R_X86_64_GOTPCREL ||
+	       type == R_X86_64_REX_GOTPCRELX ||
+	       type == R_X86_64_GOTPCRELX;
+}
+
+/*
+ * Count GOT loads of the symbols defined in the original object or the
+ * patch itself. Position-independent patches reach these through the jump
+ * table entries too, so the code doesn't depend on where patch is placed.
+ */
+int kpatch_count_got_entries(struct object_file *o)
+{
+	GElf_Ehdr *ehdr;
+	GElf_Shdr *shdr;
+	int i, j, count = 0;
+
+	ehdr = (void *)o->kpfile.patch + o->kpfile.patch->kpatch_offset;
+	shdr = (void *)ehdr + ehdr->e_shoff;
+
+	for (i = 1; i < ehdr->e_shnum; i++) {
+		GElf_Shdr *s = shdr + i;
+		GElf_Rela *relocs = (void *)ehdr + s->sh_offset;
+		GElf_Sym *sym = (void *)ehdr + shdr[s->sh_link].sh_offset;
+		unsigned char *t = (void *)ehdr + shdr[s->sh_info].sh_offset;
+
+		if (s->sh_type != SHT_RELA)
+			continue;
+
+		for (j = 0; j < s->sh_size / sizeof(*relocs); j++) {
+			GElf_Rela *r = relocs + j;
+			GElf_Sym *rs = sym + GELF_R_SYM(r->r_info);
+
+			if (!is_gotpcrel(GELF_R_TYPE(r->r_info)) ||
+			    is_undef_symbol(rs) ||
+			    GELF_ST_TYPE(rs->st_info) == STT_TLS ||
+			    r->r_offset < 2 ||
+			    r->r_offset >= shdr[s->sh_info].sh_size)
+				continue;
+
+			if (is_got_load(t + r->r_offset))
+				count++;
+		}
+	}
+
+	if (count)
+		kpdebug("%d GOT loads of defined symbols\n", count);
+	return count;
+}
+
 static int
 sym_name_cmp(const void *a_, const void *b_, void *s_)
 {
@@ -516,75 +623,133 @@ sym_name_cmp(const void *a_, const void *b_, void *s_)
 	return strcmp(s + a->st_name, s + b->st_name);
 }
 
+/*
+ * ld.so relocates the pointers in the dynamic section in place,
+ * but not everyone does that.
+ */
+static unsigned long
+dynamic_ptr(struct object_file *o, unsigned long ptr)
+{
+	if (ptr && ptr < o->vma_start)
+		ptr += o->vma_start;
+	return ptr;
+}
+
 static int
-elf_object_load_dynsym(struct object_file *o)
+elf_object_load_dynamic(struct object_file *o)
 {
-	int rv;
+	struct process_mem_iter *iter;
+	Elf64_Dyn curdyn;
+	unsigned long dynamic = o->dynamic;
 	size_t i;
-	Elf64_Dyn *dynamics = NULL;
-	char *buffer = NULL;
-	Elf64_Phdr *phdr;
-	unsigned long symtab_addr, strtab_addr;
-	unsigned long symtab_sz, strtab_sz;
+	int rv;
 
-	if (o->dynsyms != NULL)
+	if (o->dynsymtab != 0)
 		return 0;
 
 	rv = elf_object_peek_phdr(o);
 	if (rv < 0)
 		return rv;
 
-	for (i = 0; i < o->ehdr.e_phnum; i++) {
-		if (o->phdr[i].p_type == PT_DYNAMIC)
-			break;
-	}
+	/* Unless link_map told us where it is, look into program header */
+	if (dynamic == 0) {
+		for (i = 0; i < o->ehdr.e_phnum; i++) {
+			if (o->phdr[i].p_type == PT_DYNAMIC)
+				break;
+		}
 
-	if (i == o->ehdr.e_phnum)
-		return -1;
+		if (i == o->ehdr.e_phnum)
+			return -1;
 
-	phdr = &o->phdr[i];
+		dynamic = o->vma_start + o->phdr[i].p_vaddr;
+	}
 
-	dynamics = malloc(phdr->p_memsz);
-	if (dynamics == NULL)
+	iter = kpatch_process_mem_iter_init(o->proc);
+	if (iter == NULL)
 		return -1;
 
-	rv = kpatch_process_mem_read(o->proc,
-				     o->vma_start + phdr->p_vaddr,
-				     dynamics,
-				     phdr->p_memsz);
-	if (rv < 0)
-		goto out_free;
+	rv = -1;
+	for (i = 0; ; i++) {
+		if (REMOTE_PEEK(iter, curdyn, dynamic + i * sizeof(curdyn)) < 0)
+			goto out_free;
+		if (curdyn.d_tag == DT_NULL)
+			break;
 
-	for (i = 0; i < phdr->p_memsz / sizeof(Elf64_Dyn); i++) {
-		Elf64_Dyn *curdyn = dynamics + i;
-		switch (curdyn->d_tag) {
+		switch (curdyn.d_tag) {
 		case DT_SYMTAB:
-			symtab_addr = curdyn->d_un.d_ptr;
+			o->dynsymtab = dynamic_ptr(o, curdyn.d_un.d_ptr);
 			break;
 		case DT_STRTAB:
-			strtab_addr = curdyn->d_un.d_ptr;
+			o->dynstrtab = dynamic_ptr(o, curdyn.d_un.d_ptr);
 			break;
 		case DT_STRSZ:
-			strtab_sz = curdyn->d_un.d_val;
+			o->dynstrsz = curdyn.d_un.d_val;
+			break;
+		case DT_GNU_HASH:
+			o->gnu_hash = dynamic_ptr(o, curdyn.d_un.d_ptr);
+			break;
+		case DT_HASH:
+			o->sysv_hash = dynamic_ptr(o, curdyn.d_un.d_ptr);
+			break;
+		case DT_VERSYM:
+			o->versym = dynamic_ptr(o, curdyn.d_un.d_ptr);
+			break;
+		case DT_VERDEF:
+			o->verdef = dynamic_ptr(o, curdyn.d_un.d_ptr);
+			break;
+		case DT_VERDEFNUM:
+			o->verdefnum = curdyn.d_un.d_val;
+			break;
+		case DT_DEBUG:
+			o->r_debug = curdyn.d_un.d_ptr;
 			break;
 		case DT_SYMENT:
-			if (sizeof(Elf64_Sym) != curdyn->d_un.d_val) {
+			if (sizeof(Elf64_Sym) != curdyn.d_un.d_val) {
 				kperr("Dynsym entry size is %ld expected %ld\n",
-				      curdyn->d_un.d_val, sizeof(Elf64_Sym));
+				      curdyn.d_un.d_val, sizeof(Elf64_Sym));
+				o->dynsymtab = 0;
 				goto out_free;
 			}
 			break;
 		}
 	}
 
-	symtab_sz = (strtab_addr - symtab_addr);
+	o->dynamic = dynamic;
+	if (o->dynsymtab != 0 && o->dynstrtab != 0)
+		rv = 0;
+	else
+		o->dynsymtab = 0;
+
+out_free:
+	kpatch_process_mem_iter_free(iter);
+
+	return rv;
+}
+
+static int
+elf_object_load_dynsym(struct object_file *o)
+{
+	int rv;
+	size_t i;
+	char *buffer = NULL;
+	unsigned long symtab_sz, strtab_sz;
+
+	if (o->dynsyms != NULL)
+		return 0;
+
+	rv = elf_object_load_dynamic(o);
+	if (rv < 0)
+		return rv;
+
+	symtab_sz = (o->dynstrtab - o->dynsymtab);
+	strtab_sz = o->dynstrsz;
 
 	buffer = malloc(strtab_sz + symtab_sz);
 	if (buffer == NULL)
-		goto out_free;
+		return -1;
 
 	rv = kpatch_process_mem_read(o->proc,
-				     symtab_addr,
+				     o->dynsymtab,
 				     buffer,
 				     strtab_sz + symtab_sz);
 	if (rv < 0)
@@ -608,7 +773,6 @@ elf_object_load_dynsym(struct object_file *o)
 out_free:
 	if (rv < 0)
 		free(buffer);
-	free(dynamics);
 
 	return rv;
 }
@@ -623,9 +787,11 @@ bsearch_strcmp(const void *a_, const void *b_)
 	return strcmp(a, b);
 }
 
-int kpatch_resolve_undefined_single_dynamic(struct object_file *o,
-					    const char *sname,
-					    unsigned long *addr)
+static int
+kpatch_resolve_undefined_single_sorted(struct object_file *o,
+				       const char *sname,
+				       unsigned long *addr,
+				       int *is_abs)
 {
 	int rv;
 	void *found;
@@ -644,149 +810,770 @@ int kpatch_resolve_undefined_single_dynamic(struct object_file *o,
 	n = (unsigned long)(found - (void *)o->dynsymnames) / sizeof(char *);
 
 	*addr = o->dynsyms[n].st_value;
+	if (is_abs)
+		*is_abs = o->dynsyms[n].st_shndx == SHN_ABS;
 	return GELF_ST_TYPE(o->dynsyms[n].st_info);
 }
 
-static unsigned long
-kpatch_resolve_undefined(struct object_file *obj,
-			 char *sname)
+static uint32_t gnu_hash(const char *s)
 {
-	struct object_file *o;
-	unsigned long addr = 0;
-	int type;
-	char *p;
+	uint32_t h = 5381;
 
-	/* TODO: versioned symbols which are ignored by now */
-	p = strchr(sname, '@');
-	if (p)
-		*p = 0;
+	for (; *s; s++)
+		h = h * 33 + (unsigned char)*s;
+	return h;
+}
 
-	/*
-	 * TODO: we should do this in the same order as linker does.
-	 * Otherwise we might end up picking up the wrong symbol!!!
-	 */
-	list_for_each_entry(o, &obj->proc->objs, list) {
-		if (!o->is_shared_lib)
-			continue;
+static uint32_t sysv_hash(const char *s)
+{
+	uint32_t h = 0, g;
+
+	for (; *s; s++) {
+		h = (h << 4) + (unsigned char)*s;
+		g = h & 0xf0000000;
+		if (g)
+			h ^= g >> 24;
+		h &= ~g;
+	}
+	return h;
+}
 
-		type = kpatch_resolve_undefined_single_dynamic(o, sname, &addr);
-		if (type == -1)
-			continue;
+#ifndef VERSYM_HIDDEN
+# define VERSYM_HIDDEN	0x8000
+#endif
+#ifndef VERSYM_VERSION
+# define VERSYM_VERSION	0x7fff
+#endif
+
+/* Check that version definition `ndx` of `o` is named `version` */
+static int
+verdef_name_match(struct process_mem_iter *iter,
+		  struct object_file *o,
+		  Elf64_Versym ndx,
+		  const char *version)
+{
+	Elf64_Verdef verdef;
+	Elf64_Verdaux verdaux;
+	unsigned long p;
+	size_t i, len;
 
-		addr = vaddr2addr(o, addr);
+	if (o->verdef == 0)
+		return 0;
 
-		if (type == STT_GNU_IFUNC)
-			if (kpatch_ptrace_resolve_ifunc(proc2pctx(obj->proc), &addr) < 0)
-				kpfatalerror("kpatch_ptrace_resolve_ifunc failed\n");
+	p = o->verdef;
+	for (i = 0; i < o->verdefnum; i++) {
+		if (REMOTE_PEEK(iter, verdef, p) < 0)
+			return -1;
 
-		break;
+		if (verdef.vd_ndx == ndx)
+			break;
+
+		if (verdef.vd_next == 0)
+			return 0;
+		p += verdef.vd_next;
 	}
+	if (i == o->verdefnum)
+		return 0;
 
-	return addr;
+	if (REMOTE_PEEK(iter, verdaux, p + verdef.vd_aux) < 0)
+		return -1;
+
+	len = strlen(version) + 1;
+	if (o->dynstrsz && verdaux.vda_name + len > o->dynstrsz)
+		return 0;
+
+	{
+		char name[len];
+
+		if (kpatch_process_mem_iter_peek(iter, name, len,
+						 o->dynstrtab + verdaux.vda_name) < 0)
+			return -1;
+
+		return memcmp(name, version, len) == 0;
+	}
 }
 
-#define JMP_TABLE_JUMP  0x90900000000225ff /* jmp [rip+2]; nop; nop */
-static unsigned long kpatch_add_jmp_entry(struct object_file *o, unsigned long addr)
+/*
+ * Check that version of symbol `idx` is `version` or, if no version is
+ * requested, that it is the default one, just as ld.so does. Like in
+ * ld.so, an unversioned or base definition that is not hidden does for
+ * any version, e.g. malloc of an LD_PRELOAD interposer.
+ */
+static int
+dynsym_version_match(struct process_mem_iter *iter,
+		     struct object_file *o,
+		     uint32_t idx,
+		     const char *version)
 {
-	struct kpatch_jmp_table_entry entry = {JMP_TABLE_JUMP, addr};
-	int e;
+	Elf64_Versym versym;
+	int ret;
 
-	if (o->jmp_table == NULL) {
-		kpfatalerror("JMP TABLE not found\n");
-		return 0;
-	}
+	if (o->versym == 0)
+		return 1;
 
-	if (o->jmp_table->cur_entry >= o->jmp_table->max_entry)
+	if (REMOTE_PEEK(iter, versym, o->versym + idx * sizeof(versym)) < 0)
+		return -1;
+
+	/* Local symbols are never bound to from other objects */
+	if ((versym & VERSYM_VERSION) == VER_NDX_LOCAL)
 		return 0;
-	e = o->jmp_table->cur_entry++;
-	o->jmp_table->entries[e] = entry;
-	return (unsigned long)(o->kpta + o->kpfile.patch->jmp_offset + \
-			((void *)&o->jmp_table->entries[e] - (void *)o->jmp_table));
+
+	if (version == NULL)
+		return !(versym & VERSYM_HIDDEN);
+
+	ret = verdef_name_match(iter, o, versym & VERSYM_VERSION, version);
+	if (ret != 0)
+		return ret;
+
+	/* Same cut-off as check_match of ld.so */
+	return (versym & VERSYM_VERSION) < 3 && !(versym & VERSYM_HIDDEN);
 }
 
-static inline int
-symbol_resolve(struct object_file *o,
-	       GElf_Shdr *shdr,
-	       GElf_Sym *s,
-	       char *symname)
+/*
+ * Check whether symbol `idx` is a definition of `sname` of `version`.
+ * Returns 1 and fills `sym` if it is, 0 if not and -1 on error.
+ */
+static int
+dynsym_match(struct process_mem_iter *iter,
+	     struct object_file *o,
+	     uint32_t idx,
+	     const char *sname,
+	     const char *version,
+	     Elf64_Sym *sym)
 {
-	unsigned long uaddr;
+	size_t len = strlen(sname) + 1;
+	char name[len];
 
-	switch(GELF_ST_TYPE(s->st_info)) {
-	case STT_SECTION:
-		s->st_value = shdr[s->st_shndx].sh_addr;
-		break;
+	if (REMOTE_PEEK(iter, *sym, o->dynsymtab + idx * sizeof(*sym)) < 0)
+		return -1;
 
-	case STT_FUNC:
-	case STT_OBJECT:
+	if (is_undef_symbol(sym))
+		return 0;
 
-		/* TODO(pboldin) this breaks rule for overriding
-		 * symbols via dynamic libraries. Fix it. */
-		if (s->st_shndx == SHN_UNDEF &&
-		    GELF_ST_BIND(s->st_info) == STB_GLOBAL) {
-			/* This is a reference to a symbol from
-			 * the dynamic library. Resolve it. */
+	if (o->dynstrsz && sym->st_name + len > o->dynstrsz)
+		return 0;
 
-			uaddr = kpatch_resolve_undefined(o, symname);
+	if (kpatch_process_mem_iter_peek(iter, name, len,
+					 o->dynstrtab + sym->st_name) < 0)
+		return -1;
 
-			if (!uaddr) {
-				kperr("Failed to resolve undefined symbol '%s'\n",
-				      symname);
-				return -1;
-			}
-			/* OK, we overuse st_size to store original offset */
-			s->st_size = uaddr;
-			s->st_value = kpatch_add_jmp_entry(o, uaddr);
+	if (memcmp(name, sname, len))
+		return 0;
 
-			kpdebug("symbol '%s' = 0x%lx\n",
-				symname, uaddr);
-			kpdebug("jmptable '%s' = 0x%lx\n",
-				symname, s->st_value);
-		} else {
-			/*
-			 * We retain all non-local (except for .LC*)
-			 * symbols to help us debugging.
-			 */
-			if (GELF_ST_BIND(s->st_info) == STB_GLOBAL)
-				kpwarn("symbol '%s' is defined and global, we don't check for overrition\n",
-				       symname);
+	return dynsym_version_match(iter, o, idx, version);
+}
 
-			s->st_value += shdr[s->st_shndx].sh_addr;
-			kpdebug("symbol '%s' = 0x%lx\n",
-				symname, s->st_value);
+#define PEEK_U32(p) ({							\
+	uint32_t v;							\
+	if (REMOTE_PEEK(iter, v, (p)) < 0)				\
+		goto out;						\
+	v;								\
+})
+
+/*
+ * Look `sname` up via DT_GNU_HASH, reading only the bloom filter word,
+ * the bucket and the chain entries needed.
+ */
+static int
+dynsym_lookup_gnu_hash(struct process_mem_iter *iter,
+		       struct object_file *o,
+		       const char *sname,
+		       const char *version,
+		       Elf64_Sym *sym)
+{
+	uint32_t h = gnu_hash(sname), h2;
+	uint32_t nbuckets, symoffset, bloom_size, bloom_shift, idx;
+	unsigned long bloom, buckets, chain, word, mask;
+	int rv = -1;
+
+	nbuckets = PEEK_U32(o->gnu_hash);
+	symoffset = PEEK_U32(o->gnu_hash + 4);
+	bloom_size = PEEK_U32(o->gnu_hash + 8);
+	bloom_shift = PEEK_U32(o->gnu_hash + 12);
+
+	if (nbuckets == 0 || bloom_size == 0)
+		return 0;
+
+	bloom = o->gnu_hash + 16;
+	buckets = bloom + bloom_size * sizeof(unsigned long);
+	chain = buckets + nbuckets * sizeof(uint32_t);
+
+	word = PEEK_ULONG(bloom + ((h / 64) % bloom_size) * sizeof(word));
+	mask = (1UL << (h % 64)) | (1UL << ((h >> bloom_shift) % 64));
+	if ((word & mask) != mask)
+		return 0;
+
+	idx = PEEK_U32(buckets + (h % nbuckets) * sizeof(uint32_t));
+	if (idx < symoffset)
+		return 0;
+
+	do {
+		h2 = PEEK_U32(chain + (idx - symoffset) * sizeof(uint32_t));
+		if ((h | 1) == (h2 | 1)) {
+			rv = dynsym_match(iter, o, idx, sname, version, sym);
+			if (rv != 0)
+				return rv;
 		}
+		idx++;
+	} while (!(h2 & 1));
 
-		break;
+	return 0;
+out:
+	return rv;
+}
 
-	case STT_TLS:
-		break;
+static int
+dynsym_lookup_sysv_hash(struct process_mem_iter *iter,
+			struct object_file *o,
+			const char *sname,
+			const char *version,
+			Elf64_Sym *sym)
+{
+	uint32_t h = sysv_hash(sname);
+	uint32_t nbucket, nchain, idx;
+	unsigned long bucket, chain;
+	int rv = -1;
 
-	default:
-		kperr("Unsupported symbol type: %d\n", GELF_ST_TYPE(s->st_info));
-		return -1;
+	nbucket = PEEK_U32(o->sysv_hash);
+	nchain = PEEK_U32(o->sysv_hash + 4);
+
+	if (nbucket == 0)
+		return 0;
+
+	bucket = o->sysv_hash + 8;
+	chain = bucket + nbucket * sizeof(uint32_t);
+
+	idx = PEEK_U32(bucket + (h % nbucket) * sizeof(uint32_t));
+	while (idx != STN_UNDEF && idx < nchain) {
+		rv = dynsym_match(iter, o, idx, sname, version, sym);
+		if (rv != 0)
+			return rv;
+		idx = PEEK_U32(chain + idx * sizeof(uint32_t));
 	}
 
 	return 0;
+out:
+	return rv;
 }
-
-int kpatch_resolve(struct object_file *o)
+#undef PEEK_U32
+
+/*
+ * Look up definition of `sname` of `version` (or the default one if NULL)
+ * in the object's dynamic symbols. `is_abs` is set if the value is an
+ * absolute one, not relative to the object's base. Returns symbol type
+ * or -1.
+ */
+static int
+dynsym_lookup(struct object_file *o,
+	      const char *sname,
+	      const char *version,
+	      unsigned long *addr,
+	      int *is_abs)
 {
-	GElf_Ehdr *ehdr;
-	GElf_Shdr *shdr;
-	GElf_Sym *sym;
-	int i, symidx, rv;
-	char *strsym;
+	struct process_mem_iter *iter;
+	Elf64_Sym sym;
+	int rv;
 
-	ehdr = (void *)o->kpfile.patch + o->kpfile.patch->kpatch_offset;
-	shdr = (void *)ehdr + ehdr->e_shoff;
+	rv = elf_object_load_dynamic(o);
+	if (rv < 0)
+		return rv;
 
-	kpdebug("Resolving sections' addresses for '%s'\n", o->name);
-	for (i = 1; i < ehdr->e_shnum; i++) {
-		GElf_Shdr *s = shdr + i;
-		if (s->sh_type == SHT_SYMTAB)
-			symidx = i;
+	/* No hash tables, copy and sort the whole dynsym */
+	if (o->gnu_hash == 0 && o->sysv_hash == 0)
+		return kpatch_resolve_undefined_single_sorted(o, sname, addr,
+							      is_abs);
 
-		if (kpatch_is_our_section(s)) {
+	iter = kpatch_process_mem_iter_init(o->proc);
+	if (iter == NULL)
+		return -1;
+
+	if (o->gnu_hash)
+		rv = dynsym_lookup_gnu_hash(iter, o, sname, version, &sym);
+	else
+		rv = dynsym_lookup_sysv_hash(iter, o, sname, version, &sym);
+
+	kpatch_process_mem_iter_free(iter);
+
+	if (rv <= 0)
+		return -1;
+
+	*addr = sym.st_value;
+	if (is_abs)
+		*is_abs = sym.st_shndx == SHN_ABS;
+	return GELF_ST_TYPE(sym.st_info);
+}
+
+int kpatch_resolve_undefined_single_dynamic(struct object_file *o,
+					    const char *sname,
+					    unsigned long *addr)
+{
+	return dynsym_lookup(o, sname, NULL, addr, NULL);
+}
+
+static struct object_file *
+process_find_object_by_addr(kpatch_process_t *proc, unsigned long addr)
+{
+	struct object_file *o;
+	struct obj_vm_area *ovma;
+
+	list_for_each_entry(o, &proc->objs, list) {
+		if (!o->is_elf || o->is_patch)
+			continue;
+		list_for_each_entry(ovma, &o->vma, list) {
+			if (addr >= ovma->inmem.start &&
+			    addr < ovma->inmem.end)
+				return o;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Find the address of the dynamic linker's `struct r_debug` via DT_DEBUG
+ * of the executable. Returns 0 if there is none (e.g. static binary).
+ */
+unsigned long
+kpatch_elf_find_r_debug(kpatch_process_t *proc)
+{
+	struct object_file *o;
+
+	list_for_each_entry(o, &proc->objs, list) {
+		if (!o->is_elf || o->is_patch || o->is_shared_lib)
+			continue;
+		if (elf_object_load_dynamic(o) < 0 || o->r_debug == 0)
+			continue;
+		return o->r_debug;
+	}
+
+	return 0;
+}
+
+#define MAX_LINK_MAP_ENTRIES	4096
+
+/*
+ * Read the dynamic linker's list of loaded objects (`r_debug->r_map`)
+ * from the patient so we can look symbols up in the same order the
+ * linker does. Returns number of objects in the scope, or -1 if
+ * there is no link_map (e.g. static binary).
+ */
+static int
+process_load_scope(kpatch_process_t *proc)
+{
+	struct process_mem_iter *iter;
+	struct object_file *o;
+	struct r_debug r_debug;
+	struct link_map lm;
+	unsigned long p, r_debug_addr;
+	int n = 0, nalloc = 0;
+
+	if (proc->nscope)
+		return proc->nscope;
+
+	proc->nscope = -1;
+
+	r_debug_addr = kpatch_elf_find_r_debug(proc);
+	if (r_debug_addr == 0) {
+		kpdebug("No DT_DEBUG found, using maps order\n");
+		return -1;
+	}
+
+	iter = kpatch_process_mem_iter_init(proc);
+	if (iter == NULL)
+		return -1;
+
+	if (REMOTE_PEEK(iter, r_debug, r_debug_addr) < 0)
+		goto out;
+
+	for (p = (unsigned long)r_debug.r_map;
+	     p && n < MAX_LINK_MAP_ENTRIES;
+	     p = (unsigned long)lm.l_next) {
+		void *t;
+
+		if (REMOTE_PEEK(iter, lm, p) < 0)
+			goto out;
+
+		o = process_find_object_by_addr(proc, (unsigned long)lm.l_ld);
+		if (o == NULL) {
+			kpdebug("link_map entry 0x%lx has no object, skipping\n",
+				p);
+			continue;
+		}
+
+		if (n == nalloc) {
+			nalloc = nalloc ? nalloc * 2 : 16;
+			t = realloc(proc->scope, nalloc * sizeof(*proc->scope));
+			if (t == NULL)
+				goto out;
+			proc->scope = t;
+		}
+
+		/* Avoid scanning program header, we know where dynamic is */
+		if (o->dynamic == 0)
+			o->dynamic = (unsigned long)lm.l_ld;
+
+		proc->scope[n].obj = o;
+		proc->scope[n].l_addr = lm.l_addr;
+		kpdebug("scope[%d] = %s, l_addr = 0x%lx\n",
+			n, o->name, lm.l_addr);
+		n++;
+	}
+
+	if (n)
+		proc->nscope = n;
+
+out:
+	kpatch_process_mem_iter_free(iter);
+	return proc->nscope;
+}
+
+static unsigned long
+kpatch_resolve_undefined(struct object_file *obj,
+			 char *sname,
+			 int *is_ifunc)
+{
+	kpatch_process_t *proc = obj->proc;
+	struct object_file *o;
+	unsigned long addr = 0;
+	char *version = NULL;
+	int i, type = -1, is_abs = 0;
+
+	/* Split "name@VERSION" and "name@@VERSION" */
+	version = strchr(sname, '@');
+	if (version) {
+		*version++ = 0;
+		if (*version == '@')
+			version++;
+	}
+
+	if (process_load_scope(proc) > 0) {
+		for (i = 0; i < proc->nscope; i++) {
+			o = proc->scope[i].obj;
+
+			type = dynsym_lookup(o, sname, version, &addr,
+					     &is_abs);
+			if (type == -1)
+				continue;
+
+			if (addr && !is_abs)
+				addr += proc->scope[i].l_addr;
+			break;
+		}
+	} else {
+		list_for_each_entry(o, &proc->objs, list) {
+			if (!o->is_shared_lib)
+				continue;
+
+			type = dynsym_lookup(o, sname, version, &addr,
+					     &is_abs);
+			if (type == -1)
+				continue;
+
+			if (!is_abs)
+				addr = vaddr2addr(o, addr);
+			break;
+		}
+	}
+
+	/*
+	 * IFUNC resolvers are called later by the
+	 * kpatch_resolve_ifuncs all at once
+	 */
+	*is_ifunc = (type == STT_GNU_IFUNC);
+
+	return addr;
+}
+
+#define JMP_TABLE_JUMP  0x90900000000225ff /* jmp [rip+2]; nop; nop */
+static unsigned long kpatch_add_jmp_entry(struct object_file *o, unsigned long addr)
+{
+	struct kpatch_jmp_table_entry entry = {JMP_TABLE_JUMP, addr};
+	int e;
+
+	if (o->jmp_table == NULL) {
+		kpfatalerror("JMP TABLE not found\n");
+		return 0;
+	}
+
+	if (o->jmp_table->cur_entry >= o->jmp_table->max_entry)
+		return 0;
+	e = o->jmp_table->cur_entry++;
+	o->jmp_table->entries[e] = entry;
+	return (unsigned long)(o->kpta + o->kpfile.patch->jmp_offset + \
+			((void *)&o->jmp_table->entries[e] - (void *)o->jmp_table));
+}
+
+/* Reuse the entry if the same address is loaded from GOT several times */
+static unsigned long kpatch_add_got_entry(struct object_file *o, unsigned long addr)
+{
+	int e;
+
+	if (o->jmp_table == NULL)
+		return 0;
+
+	for (e = 0; e < o->jmp_table->cur_entry; e++)
+		if (o->jmp_table->entries[e].addr == addr)
+			return (unsigned long)(o->kpta + o->kpfile.patch->jmp_offset +
+				((void *)&o->jmp_table->entries[e] - (void *)o->jmp_table));
+
+	return kpatch_add_jmp_entry(o, addr);
+}
+
+static inline int
+symbol_resolve(struct object_file *o,
+	       GElf_Shdr *shdr,
+	       GElf_Sym *s,
+	       char *symname,
+	       GElf_Sym **ifuncs,
+	       size_t *nifuncs)
+{
+	unsigned long uaddr;
+	int is_ifunc = 0;
+
+	switch(GELF_ST_TYPE(s->st_info)) {
+	case STT_SECTION:
+		s->st_value = shdr[s->st_shndx].sh_addr;
+		break;
+
+	case STT_FUNC:
+	case STT_OBJECT:
+
+		/* TODO(pboldin) this breaks rule for overriding
+		 * symbols via dynamic libraries. Fix it. */
+		if (s->st_shndx == SHN_UNDEF &&
+		    GELF_ST_BIND(s->st_info) == STB_GLOBAL) {
+			/* This is a reference to a symbol from
+			 * the dynamic library. Resolve it. */
+
+			uaddr = kpatch_resolve_undefined(o, symname, &is_ifunc);
+
+			if (!uaddr) {
+				kperr("Failed to resolve undefined symbol '%s'\n",
+				      symname);
+				return -1;
+			}
+			/* OK, we overuse st_size to store original offset */
+			s->st_size = uaddr;
+			s->st_value = kpatch_add_jmp_entry(o, uaddr);
+			if (!s->st_value) {
+				kperr("no jump table entry left for '%s'\n",
+				      symname);
+				return -1;
+			}
+
+			/* Both are fixed up once the resolver is called */
+			if (is_ifunc)
+				ifuncs[(*nifuncs)++] = s;
+
+			kpdebug("symbol '%s' = 0x%lx%s\n",
+				symname, uaddr, is_ifunc ? " (IFUNC)" : "");
+			kpdebug("jmptable '%s' = 0x%lx\n",
+				symname, s->st_value);
+		} else {
+			/*
+			 * We retain all non-local (except for .LC*)
+			 * symbols to help us debugging.
+			 */
+			if (GELF_ST_BIND(s->st_info) == STB_GLOBAL)
+				kpwarn("symbol '%s' is defined and global, we don't check for overrition\n",
+				       symname);
+
+			s->st_value += shdr[s->st_shndx].sh_addr;
+			kpdebug("symbol '%s' = 0x%lx\n",
+				symname, s->st_value);
+		}
+
+		break;
+
+	case STT_TLS:
+		break;
+
+	default:
+		kperr("Unsupported symbol type: %d\n", GELF_ST_TYPE(s->st_info));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Symbols symbol_resolve puts into the jump table */
+static int is_jmp_table_symbol(GElf_Sym *s)
+{
+	return s->st_shndx == SHN_UNDEF &&
+	       GELF_ST_BIND(s->st_info) == STB_GLOBAL &&
+	       (GELF_ST_TYPE(s->st_info) == STT_FUNC ||
+		GELF_ST_TYPE(s->st_info) == STT_OBJECT);
+}
+
+static int in_rel32_reach(unsigned long target, unsigned long loc)
+{
+	long disp = target - loc;
+
+	return disp == (int)disp;
+}
+
+/*
+ * Calls and jumps to other objects go through the jump table and the
+ * addresses of the symbols are loaded from it, which costs an indirect
+ * branch or a memory load each. If `target` is within a 32-bit
+ * displacement from `loc2`, the location in the patient, check that the
+ * reference at `loc` can be made direct and relax the GOT load there as
+ * the linker does. The code of patches mapped from files is left as is,
+ * so that it stays the same in all the patients.
+ */
+static int
+kpatch_relax(struct object_file *o,
+	     unsigned char *loc,
+	     unsigned long loc2,
+	     unsigned long target,
+	     int got_load)
+{
+	if (o->proc->map_patches || !in_rel32_reach(target, loc2))
+		return 0;
+	if (!got_load)
+		return 1;
+
+	if (loc[-2] == MOV_INSN) {
+		/* lea foo(%rip), %reg */
+		loc[-2] = LEA_INSN;
+	} else if (loc[-1] == 0x15) {
+		/* addr32 call foo */
+		loc[-2] = ADDR32_PREFIX;
+		loc[-1] = CALL_INSN;
+	} else {
+		/* nop; jmp foo */
+		loc[-2] = NOP_INSN;
+		loc[-1] = JMP_INSN;
+	}
+	return 1;
+}
+
+/*
+ * Turn the initial-exec access of a TLS variable at `loc`, whose offset
+ * from the thread pointer is in the GOT entry at `got` in the patient,
+ * into a local-exec one, as the linker does for executables:
+ *
+ *	movq foo@gottpoff(%rip), %reg	->	movq $foo@tpoff, %reg
+ *	addq foo@gottpoff(%rip), %reg	->	addq $foo@tpoff, %reg
+ *
+ * The offset is fixed once the object is loaded, so it is read from the
+ * patient's GOT. The displacement becomes the immediate in place.
+ */
+static int
+kpatch_relax_tls(struct object_file *o,
+		 unsigned char *loc,
+		 unsigned long got)
+{
+	unsigned char *insn = loc - 3;
+	unsigned long tpoff;
+	int reg;
+
+	if (o->proc->map_patches)
+		return 0;
+	if ((insn[0] != 0x48 && insn[0] != 0x4c) ||
+	    (insn[1] != MOV_INSN && insn[1] != ADD_INSN) ||
+	    (insn[2] & 0xc7) != 0x05)
+		return 0;
+
+	if (kpatch_process_mem_read(o->proc, got, &tpoff, sizeof(tpoff)) < 0) {
+		kplogerror("can't read TLS offset at 0x%lx\n", got);
+		return 0;
+	}
+	if ((long)tpoff != (int)tpoff)
+		return 0;
+
+	/* REX.R of the register operand becomes REX.B */
+	reg = (insn[2] >> 3) & 7;
+	if (insn[0] == 0x4c)
+		insn[0] = 0x49;
+	insn[1] = insn[1] == MOV_INSN ? MOV_IMM_INSN : ADD_IMM_INSN;
+	insn[2] = 0xc0 | reg;
+	*(unsigned int *)loc = tpoff;
+	return 1;
+}
+
+/* Address of the symbol loaded from GOT, the jump table's `addr` for some */
+static unsigned long got_load_target(GElf_Sym *s)
+{
+	return is_jmp_table_symbol(s) ? s->st_size : s->st_value;
+}
+
+static struct kpatch_jmp_table_entry *
+kpatch_jmp_entry(struct object_file *o, unsigned long addr)
+{
+	return (void *)o->jmp_table + addr -
+		(o->kpta + o->kpfile.patch->jmp_offset);
+}
+
+/*
+ * Call the IFUNC resolvers in the jump table `entries` in one remote
+ * execution and put the functions they return there instead. The patch
+ * region is not written yet, so use it as a scratch buffer for the
+ * resolvers addresses and results.
+ */
+static int
+kpatch_resolve_ifuncs(struct object_file *o,
+		      struct kpatch_jmp_table_entry **entries,
+		      size_t nifuncs)
+{
+	unsigned long *addrs;
+	size_t i, j, n, max = getpagesize() / sizeof(*addrs);
+	int rv = 0;
+
+	if (nifuncs == 0)
+		return 0;
+
+	addrs = malloc(sizeof(*addrs) * max);
+	if (addrs == NULL)
+		return -1;
+
+	kpdebug("Calling %ld IFUNC resolvers for '%s'\n", nifuncs, o->name);
+	for (i = 0; i < nifuncs; i += n) {
+		n = nifuncs - i;
+		if (n > max)
+			n = max;
+
+		for (j = 0; j < n; j++)
+			addrs[j] = entries[i + j]->addr;
+
+		rv = kpatch_ptrace_resolve_ifuncs(proc2pctx(o->proc),
+						  o->kpta, addrs, n);
+		if (rv < 0) {
+			kperr("kpatch_ptrace_resolve_ifuncs failed\n");
+			break;
+		}
+
+		for (j = 0; j < n; j++) {
+			kpdebug("IFUNC 0x%lx resolved to 0x%lx\n",
+				entries[i + j]->addr, addrs[j]);
+			entries[i + j]->addr = addrs[j];
+		}
+	}
+
+	free(addrs);
+	return rv;
+}
+
+int kpatch_resolve(struct object_file *o)
+{
+	GElf_Ehdr *ehdr;
+	GElf_Shdr *shdr;
+	GElf_Sym *sym, **ifuncs = NULL;
+	struct kpatch_jmp_table_entry **entries;
+	size_t nifuncs = 0;
+	int i, symidx, rv;
+	char *strsym;
+
+	ehdr = (void *)o->kpfile.patch + o->kpfile.patch->kpatch_offset;
+	shdr = (void *)ehdr + ehdr->e_shoff;
+
+	symidx = kpatch_symtab_section(o->kpfile.patch);
+
+	kpdebug("Resolving sections' addresses for '%s'\n", o->name);
+	for (i = 1; i < ehdr->e_shnum; i++) {
+		GElf_Shdr *s = shdr + i;
+
+		if (kpatch_is_our_section(s)) {
 			/*
 			 * For our own sections, we just point sh_addr to
 			 * proper offet in *target process* region of memory
@@ -805,6 +1592,12 @@ int kpatch_resolve(struct object_file *o)
 		kpdebug("section '%s' = 0x%lx\n", secname(ehdr, s), s->sh_addr);
 	}
 
+	if (o->jmp_table) {
+		ifuncs = malloc(sizeof(*ifuncs) * o->jmp_table->max_entry);
+		if (ifuncs == NULL)
+			return -1;
+	}
+
 	kpdebug("Resolving symbols for '%s'\n", o->name);
 	sym = (void *)ehdr + shdr[symidx].sh_offset;
 	strsym = (void *)ehdr + shdr[shdr[symidx].sh_link].sh_offset;
@@ -812,19 +1605,34 @@ int kpatch_resolve(struct object_file *o)
 		GElf_Sym *s = sym + i;
 		char *symname = strsym + s->st_name;
 
-		rv = symbol_resolve(o, shdr, s, symname);
+		rv = symbol_resolve(o, shdr, s, symname, ifuncs, &nifuncs);
 		if (rv < 0)
-			return rv;
+			goto out;
 	}
 
-	return 0;
+	/* Symbols of IFUNCs are fixed up once the resolvers are called */
+	entries = malloc(sizeof(*entries) * (nifuncs + 1));
+	if (entries == NULL) {
+		rv = -1;
+		goto out;
+	}
+	for (i = 0; i < nifuncs; i++)
+		entries[i] = kpatch_jmp_entry(o, ifuncs[i]->st_value);
+	rv = kpatch_resolve_ifuncs(o, entries, nifuncs);
+	for (i = 0; rv == 0 && i < nifuncs; i++)
+		ifuncs[i]->st_size = entries[i]->addr;
+	free(entries);
+out:
+	free(ifuncs);
+	return rv;
 }
 
 static int kpatch_apply_relocate_add(struct object_file *o, GElf_Shdr *relsec)
 {
 	struct kpatch_file *kp = o->kpfile.patch;
 	GElf_Ehdr *ehdr = (void *)kp + kp->kpatch_offset;
-	GElf_Shdr *shdr = (void *)ehdr + ehdr->e_shoff, *symhdr;
+	GElf_Shdr *shdr = (void *)ehdr + ehdr->e_shoff;
+	GElf_Shdr *symhdr = shdr + kpatch_symtab_section(kp);
 	GElf_Rela *relocs = (void *)ehdr + relsec->sh_offset;
 	GElf_Shdr *tshdr = shdr + relsec->sh_info;
 	void *t = (void *)ehdr + shdr[relsec->sh_info].sh_offset;
@@ -832,14 +1640,9 @@ static int kpatch_apply_relocate_add(struct object_file *o, GElf_Shdr *relsec)
 	int i, is_kpatch_info;
 	const char *scnname;
 
-	for (i = 1; i < ehdr->e_shnum; i++) {
-		if (shdr[i].sh_type == SHT_SYMTAB)
-			symhdr = &shdr[i];
-	}
-
 	scnname = secname(ehdr, shdr + relsec->sh_info);
 	kpdebug("applying relocations to '%s'\n", scnname);
-	is_kpatch_info = strcmp(scnname, ".kpatch.info") == 0;
+	is_kpatch_info = relsec->sh_info == kpatch_info_section(kp);
 
 	for (i = 0; i < relsec->sh_size / sizeof(*relocs); i++) {
 		GElf_Rela *r = relocs + i;
@@ -879,19 +1682,48 @@ static int kpatch_apply_relocate_add(struct object_file *o, GElf_Shdr *relsec)
 		case R_X86_64_GOTPCREL:
 		case R_X86_64_REX_GOTPCRELX:
 		case R_X86_64_GOTPCRELX:
-			if (is_undef_symbol(s)) {
+			if (is_gotpcrel(GELF_R_TYPE(r->r_info)) &&
+			    GELF_ST_TYPE(s->st_info) != STT_TLS &&
+			    r->r_offset >= 2 && is_got_load(loc) &&
+			    (is_jmp_table_symbol(s) || !is_undef_symbol(s)) &&
+			    kpatch_relax(o, loc, (unsigned long)loc2,
+					 got_load_target(s) + r->r_addend, 1)) {
+				/* The GOT load is a direct reference now */
+				val = got_load_target(s) + r->r_addend;
+			} else if (is_undef_symbol(s)) {
 				/* This is an undefined symbol,
 				 * use jmp table as the GOT */
 				val += sizeof(unsigned long);
+			} else if (is_gotpcrel(GELF_R_TYPE(r->r_info)) &&
+				   GELF_ST_TYPE(s->st_info) != STT_TLS &&
+				   r->r_offset >= 2 && is_got_load(loc)) {
+				/* Position-independent load of a defined
+				 * symbol, add an entry to the jmp table */
+				val = kpatch_add_got_entry(o, s->st_value);
+				if (!val) {
+					kperr("no GOT entry left for '%s'\n",
+					      scnname);
+					return -1;
+				}
+				val += sizeof(unsigned long) + r->r_addend;
 			} else if (GELF_ST_TYPE(s->st_info) == STT_TLS) {
 				/* This is GOTTPOFF that already points
 				 * to an appropriate GOT entry in the
 				 * patient's memory.
 				 */
+				if (r->r_offset >= 3 &&
+				    kpatch_relax_tls(o, loc, r->r_addend +
+						     o->load_offset))
+					break;
 				val = r->r_addend + o->load_offset - 4;
 			}
 			/* FALLTHROUGH */
 		case R_X86_64_PC32:
+			if (GELF_R_TYPE(r->r_info) == R_X86_64_PC32 &&
+			    !is_kpatch_info && is_jmp_table_symbol(s) &&
+			    kpatch_relax(o, loc, (unsigned long)loc2,
+					 s->st_size + r->r_addend, 0))
+				val = s->st_size + r->r_addend;
 			val -= (unsigned long)loc2;
 			*(unsigned int *)loc = val;
 			break;
@@ -934,31 +1766,717 @@ int kpatch_relocate(struct object_file *o)
 	return 0;
 }
 
+/*
+ * Relocation templates.
+ *
+ * The value of each field relocated in a patch is
+ *
+ *	cst + kpta * kpta_coef + load_offset * load_coef [+ undefined symbol]
+ *
+ * where the constant and the coefficients are the same in all the patients.
+ * The template keeps them grouped by the coefficients, so a patient gets
+ * its patch relocated with one addition per field, without resolving the
+ * symbols and walking the relocation sections again. Only the undefined
+ * symbols are looked up in each patient.
+ */
+struct kpatch_reloc_value {
+	int kpta;
+	int load;
+	long undef;		/* index of the undefined symbol or -1 */
+	long cst;
+};
+
+#define RELOC_GROUP(kpta, load, width, undef)	\
+	((((kpta) + 1) * 3 + (load) + 1) * 4 + ((width) == 8) * 2 + !!(undef))
+#define RELOC_MAX_GROUPS	(RELOC_GROUP(1, 1, 8, 1) + 1)
+
+struct kpatch_reloc_group {
+	size_t nslots, maxslots;
+	unsigned long *off;	/* offsets in the patch image */
+	long *cst;
+	long *undef;		/* only for groups that add undefined symbols */
+};
+
+enum {
+	RELAX_DIRECT,		/* PC32 to the jump table */
+	RELAX_GOT_LOAD,		/* GOTPCREL load */
+	RELAX_TLS,		/* GOTTPOFF load */
+};
+
+struct kpatch_reloc_tmpl {
+	int usable;
+	unsigned long jmp_offset;
+
+	size_t nundef;
+	const char **undef;	/* names of undefined symbols */
+
+	size_t ngot;
+	struct kpatch_reloc_value *got;	/* defined symbols loaded from GOT */
+
+	/* References through the jump table or GOT, relaxed if possible */
+	size_t ndirect;
+	struct kpatch_reloc_direct {
+		unsigned long off;
+		int kind;
+		struct kpatch_reloc_value target;
+	} *direct;
+
+	struct kpatch_reloc_group groups[RELOC_MAX_GROUPS];
+};
+
+static int
+reloc_tmpl_add_slot(struct kpatch_reloc_tmpl *tmpl,
+		    struct kpatch_reloc_value *v,
+		    int width,
+		    unsigned long off)
+{
+	struct kpatch_reloc_group *g;
+	size_t n;
+
+	if (v->kpta < -1 || v->kpta > 1 || v->load < -1 || v->load > 1)
+		return -1;
+
+	g = &tmpl->groups[RELOC_GROUP(v->kpta, v->load, width, v->undef >= 0)];
+	if (g->nslots == g->maxslots) {
+		n = g->maxslots ? g->maxslots * 2 : 16;
+		g->off = realloc(g->off, n * sizeof(*g->off));
+		g->cst = realloc(g->cst, n * sizeof(*g->cst));
+		g->undef = realloc(g->undef, n * sizeof(*g->undef));
+		if (g->off == NULL || g->cst == NULL || g->undef == NULL)
+			return -1;
+		g->maxslots = n;
+	}
+
+	g->off[g->nslots] = off;
+	g->cst[g->nslots] = v->cst;
+	g->undef[g->nslots] = v->undef;
+	g->nslots++;
+	return 0;
+}
+
+static long
+reloc_tmpl_add_got(struct kpatch_reloc_tmpl *tmpl,
+		   struct kpatch_reloc_value *v)
+{
+	size_t i;
+
+	for (i = 0; i < tmpl->ngot; i++)
+		if (!memcmp(&tmpl->got[i], v, sizeof(*v)))
+			return tmpl->nundef + i;
+
+	tmpl->got = realloc(tmpl->got, (tmpl->ngot + 1) * sizeof(*v));
+	if (tmpl->got == NULL)
+		return -1;
+	tmpl->got[tmpl->ngot] = *v;
+	return tmpl->nundef + tmpl->ngot++;
+}
+
+static int
+reloc_tmpl_add_direct(struct kpatch_reloc_tmpl *tmpl,
+		      unsigned long off,
+		      struct kpatch_reloc_value *target,
+		      long addend,
+		      int kind)
+{
+	struct kpatch_reloc_direct *d;
+
+	d = realloc(tmpl->direct, (tmpl->ndirect + 1) * sizeof(*d));
+	if (d == NULL)
+		return -1;
+	tmpl->direct = d;
+
+	d += tmpl->ndirect++;
+	d->off = off;
+	d->kind = kind;
+	d->target = *target;
+	d->target.cst += addend;
+	return 0;
+}
+
+/* Symbols' values as symbol_resolve would give in a patient */
+static int
+reloc_tmpl_symbols(struct kpatch_reloc_tmpl *tmpl,
+		   struct kpatch_file *kp,
+		   GElf_Shdr *symhdr,
+		   struct kpatch_reloc_value *vals,
+		   struct kpatch_reloc_value *sizes)
+{
+	GElf_Ehdr *ehdr = (void *)kp + kp->kpatch_offset;
+	GElf_Shdr *shdr = (void *)ehdr + ehdr->e_shoff, *sec;
+	GElf_Sym *sym = (void *)ehdr + symhdr->sh_offset;
+	char *strsym = (void *)ehdr + shdr[symhdr->sh_link].sh_offset;
+	size_t i, nsyms = symhdr->sh_size / sizeof(GElf_Sym);
+	struct kpatch_reloc_value *v;
+
+	tmpl->undef = malloc(nsyms * sizeof(*tmpl->undef));
+	if (tmpl->undef == NULL)
+		return -1;
+
+	for (i = 1; i < nsyms; i++) {
+		GElf_Sym *s = sym + i;
+
+		v = &vals[i];
+		memset(v, 0, sizeof(*v));
+		v->undef = -1;
+		sizes[i] = *v;
+		sizes[i].cst = s->st_size;
+
+		switch (GELF_ST_TYPE(s->st_info)) {
+		case STT_SECTION:
+		case STT_FUNC:
+		case STT_OBJECT:
+			break;
+		case STT_TLS:
+			v->cst = s->st_value;
+			continue;
+		default:
+			return -1;
+		}
+
+		if (s->st_shndx == SHN_UNDEF &&
+		    GELF_ST_BIND(s->st_info) == STB_GLOBAL &&
+		    GELF_ST_TYPE(s->st_info) != STT_SECTION) {
+			/* Jump table entry, the symbol is in its `addr` */
+			v->kpta = 1;
+			v->cst = tmpl->jmp_offset +
+				tmpl->nundef * sizeof(struct kpatch_jmp_table_entry);
+			sizes[i].cst = 0;
+			sizes[i].undef = tmpl->nundef;
+			tmpl->undef[tmpl->nundef++] = strsym + s->st_name;
+			continue;
+		}
+
+		if (s->st_shndx >= ehdr->e_shnum)
+			return -1;
+
+		sec = shdr + s->st_shndx;
+		if (s->st_shndx == SHN_UNDEF) {
+			v->cst = 0;
+		} else if (kpatch_is_our_section(sec)) {
+			v->kpta = 1;
+			v->cst = kp->kpatch_offset + sec->sh_offset;
+		} else if (sec->sh_addr) {
+			v->load = 1;
+			v->cst = sec->sh_addr;
+		}
+
+		if (GELF_ST_TYPE(s->st_info) != STT_SECTION)
+			v->cst += s->st_value;
+	}
+
+	return 0;
+}
+
+/* Relocations as kpatch_apply_relocate_add would do in a patient */
+static int
+reloc_tmpl_relocations(struct kpatch_reloc_tmpl *tmpl,
+		       struct kpatch_file *kp,
+		       GElf_Shdr *relsec,
+		       struct kpatch_reloc_value *vals,
+		       struct kpatch_reloc_value *sizes)
+{
+	GElf_Ehdr *ehdr = (void *)kp + kp->kpatch_offset;
+	GElf_Shdr *shdr = (void *)ehdr + ehdr->e_shoff;
+	GElf_Shdr *tshdr = shdr + relsec->sh_info;
+	GElf_Rela *relocs = (void *)ehdr + relsec->sh_offset;
+	GElf_Sym *sym = (void *)ehdr + shdr[relsec->sh_link].sh_offset;
+	unsigned char *t = (void *)ehdr + tshdr->sh_offset;
+	unsigned long base = kp->kpatch_offset + tshdr->sh_offset;
+	struct kpatch_reloc_value v, got;
+	int is_kpatch_info, width;
+	size_t i;
+	long e;
+
+	if (relsec->sh_info >= ehdr->e_shnum || !kpatch_is_our_section(tshdr))
+		return -1;
+	is_kpatch_info = relsec->sh_info == kpatch_info_section(kp);
+
+	for (i = 0; i < relsec->sh_size / sizeof(*relocs); i++) {
+		GElf_Rela *r = relocs + i;
+		unsigned long type = GELF_R_TYPE(r->r_info);
+		GElf_Sym *s = sym + GELF_R_SYM(r->r_info);
+
+		if (r->r_offset >= tshdr->sh_size)
+			return -1;
+
+		v = vals[GELF_R_SYM(r->r_info)];
+		v.cst += r->r_addend;
+		if (is_kpatch_info && is_undef_symbol(s))
+			v = sizes[GELF_R_SYM(r->r_info)];
+
+		width = sizeof(unsigned int);
+		switch (type) {
+		case R_X86_64_NONE:
+			continue;
+		case R_X86_64_64:
+			width = sizeof(unsigned long);
+			break;
+		case R_X86_64_32:
+		case R_X86_64_32S:
+			break;
+		case R_X86_64_GOTTPOFF:
+		case R_X86_64_GOTPCREL:
+		case R_X86_64_REX_GOTPCRELX:
+		case R_X86_64_GOTPCRELX:
+			if (is_gotpcrel(type) &&
+			    GELF_ST_TYPE(s->st_info) != STT_TLS &&
+			    r->r_offset >= 2 &&
+			    is_got_load(t + r->r_offset) &&
+			    (sizes[GELF_R_SYM(r->r_info)].undef >= 0 ||
+			     !is_undef_symbol(s)) &&
+			    reloc_tmpl_add_direct(tmpl, base + r->r_offset,
+				sizes[GELF_R_SYM(r->r_info)].undef >= 0 ?
+				&sizes[GELF_R_SYM(r->r_info)] :
+				&vals[GELF_R_SYM(r->r_info)],
+				r->r_addend, RELAX_GOT_LOAD) < 0)
+				return -1;
+
+			if (is_undef_symbol(s)) {
+				v.cst += sizeof(unsigned long);
+			} else if (is_gotpcrel(type) &&
+				   GELF_ST_TYPE(s->st_info) != STT_TLS &&
+				   r->r_offset >= 2 &&
+				   is_got_load(t + r->r_offset)) {
+				got = vals[GELF_R_SYM(r->r_info)];
+				e = reloc_tmpl_add_got(tmpl, &got);
+				if (e < 0)
+					return -1;
+				memset(&v, 0, sizeof(v));
+				v.undef = -1;
+				v.kpta = 1;
+				v.cst = tmpl->jmp_offset + sizeof(unsigned long) +
+					e * sizeof(struct kpatch_jmp_table_entry) +
+					r->r_addend;
+			} else if (GELF_ST_TYPE(s->st_info) == STT_TLS) {
+				memset(&v, 0, sizeof(v));
+				v.undef = -1;
+				v.load = 1;
+				if (r->r_offset >= 3 &&
+				    reloc_tmpl_add_direct(tmpl, base + r->r_offset,
+							  &v, r->r_addend,
+							  RELAX_TLS) < 0)
+					return -1;
+				v.cst = r->r_addend - 4;
+			}
+			/* FALLTHROUGH */
+		case R_X86_64_PC32:
+			if (type == R_X86_64_PC32 && !is_kpatch_info &&
+			    sizes[GELF_R_SYM(r->r_info)].undef >= 0 &&
+			    reloc_tmpl_add_direct(tmpl, base + r->r_offset,
+				&sizes[GELF_R_SYM(r->r_info)],
+				r->r_addend, RELAX_DIRECT) < 0)
+				return -1;
+			v.kpta -= 1;
+			v.cst -= base + r->r_offset;
+			break;
+		case R_X86_64_TPOFF64:
+		case R_X86_64_TPOFF32:
+			kperr("TPOFF32/TPOFF64 should not be present\n");
+			continue;
+		default:
+			return -1;
+		}
+
+		if (reloc_tmpl_add_slot(tmpl, &v, width, base + r->r_offset))
+			return -1;
+	}
+
+	return 0;
+}
+
+void kpatch_reloc_tmpl_free(struct kpatch_reloc_tmpl *tmpl)
+{
+	int i;
+
+	if (tmpl == NULL)
+		return;
+
+	for (i = 0; i < RELOC_MAX_GROUPS; i++) {
+		free(tmpl->groups[i].off);
+		free(tmpl->groups[i].cst);
+		free(tmpl->groups[i].undef);
+	}
+	free(tmpl->got);
+	free(tmpl->direct);
+	free(tmpl->undef);
+	free(tmpl);
+}
+
+/*
+ * Make the relocation template of the storage patch `kpfile` for the jump
+ * table placed at `jmp_offset`. The patch must not be relocated. If some of
+ * the relocations can't be put into the template, it is marked unusable and
+ * patients are relocated the usual way.
+ */
+struct kpatch_reloc_tmpl *
+kpatch_reloc_tmpl_new(struct kp_file *kpfile, unsigned long jmp_offset)
+{
+	struct kpatch_file *kp = kpfile->patch;
+	struct kpatch_reloc_value *vals = NULL, *sizes = NULL;
+	struct kpatch_reloc_tmpl *tmpl;
+	GElf_Ehdr *ehdr = (void *)kp + kp->kpatch_offset;
+	GElf_Shdr *shdr = (void *)ehdr + ehdr->e_shoff, *symhdr = NULL;
+	size_t nsyms;
+	int i;
+
+	tmpl = calloc(1, sizeof(*tmpl));
+	if (tmpl == NULL)
+		return NULL;
+	tmpl->jmp_offset = jmp_offset;
+
+	for (i = 1; i < ehdr->e_shnum; i++) {
+		if (shdr[i].sh_type == SHT_REL)
+			goto out;
+	}
+	i = kpatch_symtab_section(kp);
+	if (i == 0)
+		goto out;
+	symhdr = shdr + i;
+
+	nsyms = symhdr->sh_size / sizeof(GElf_Sym);
+	vals = calloc(nsyms, sizeof(*vals));
+	sizes = calloc(nsyms, sizeof(*sizes));
+	if (vals == NULL || sizes == NULL)
+		goto out;
+
+	if (reloc_tmpl_symbols(tmpl, kp, symhdr, vals, sizes) < 0)
+		goto out;
+
+	for (i = 1; i < ehdr->e_shnum; i++) {
+		if (shdr[i].sh_type != SHT_RELA)
+			continue;
+		if (&shdr[shdr[i].sh_link] != symhdr ||
+		    reloc_tmpl_relocations(tmpl, kp, &shdr[i], vals, sizes) < 0)
+			goto out;
+	}
+
+	tmpl->usable = 1;
+out:
+	if (!tmpl->usable)
+		kpinfo("can't make relocation template for %.*s, will relocate as usual\n",
+		       KPATCH_UNAME_LEN, kp->uname);
+	free(vals);
+	free(sizes);
+	return tmpl;
+}
+
+int kpatch_reloc_tmpl_usable(struct kpatch_reloc_tmpl *tmpl,
+			     unsigned long jmp_offset)
+{
+	return tmpl->usable && tmpl->jmp_offset == jmp_offset;
+}
+
+/* Number of jump table entries the patch relocated by `tmpl` needs */
+size_t kpatch_reloc_tmpl_entries(struct kpatch_reloc_tmpl *tmpl)
+{
+	return tmpl->nundef + tmpl->ngot;
+}
+
+/*
+ * Relocate the patch of `o` as kpatch_resolve and kpatch_relocate would do,
+ * but using the template `tmpl`.
+ */
+int kpatch_reloc_tmpl_apply(struct object_file *o,
+			    struct kpatch_reloc_tmpl *tmpl)
+{
+	struct kpatch_jmp_table_entry **ifuncs = NULL;
+	unsigned char *image = (void *)o->kpfile.patch;
+	unsigned long *addrs, base;
+	char *name;
+	size_t i, j, nifuncs = 0;
+	int kpta, load, width, is_ifunc, rv = -1;
+
+	addrs = malloc((tmpl->nundef + 1) * sizeof(*addrs));
+	ifuncs = malloc((tmpl->nundef + 1) * sizeof(*ifuncs));
+	if (addrs == NULL || ifuncs == NULL)
+		goto out;
+
+	for (i = 0; i < tmpl->nundef; i++) {
+		/* The name is split at '@' in place */
+		name = strdup(tmpl->undef[i]);
+		if (name == NULL)
+			goto out;
+		addrs[i] = kpatch_resolve_undefined(o, name, &is_ifunc);
+		free(name);
+		if (!addrs[i]) {
+			kperr("Failed to resolve undefined symbol '%s'\n",
+			      tmpl->undef[i]);
+			goto out;
+		}
+		if (!kpatch_add_jmp_entry(o, addrs[i]))
+			goto out;
+		if (is_ifunc)
+			ifuncs[nifuncs++] = &o->jmp_table->entries[i];
+	}
+
+	if (kpatch_resolve_ifuncs(o, ifuncs, nifuncs) < 0)
+		goto out;
+	for (i = 0; i < tmpl->nundef; i++)
+		addrs[i] = o->jmp_table->entries[i].addr;
+
+	for (i = 0; i < tmpl->ngot; i++) {
+		struct kpatch_reloc_value *v = &tmpl->got[i];
+
+		if (!kpatch_add_jmp_entry(o, v->cst + v->kpta * o->kpta +
+					  v->load * o->load_offset))
+			goto out;
+	}
+
+	for (i = 0; i < RELOC_MAX_GROUPS; i++) {
+		struct kpatch_reloc_group *g = &tmpl->groups[i];
+
+		if (g->nslots == 0)
+			continue;
+
+		/* See RELOC_GROUP */
+		kpta = (int)(i / 12) - 1;
+		load = (int)(i / 4 % 3) - 1;
+		width = i & 2 ? 8 : 4;
+		base = kpta * o->kpta + load * o->load_offset;
+
+		if (i & 1) {
+			for (j = 0; j < g->nslots; j++) {
+				unsigned long val = g->cst[j] + base +
+						    addrs[g->undef[j]];
+
+				if (width == 8)
+					*(unsigned long *)(image + g->off[j]) = val;
+				else
+					*(unsigned int *)(image + g->off[j]) = val;
+			}
+		} else if (width == 8) {
+			for (j = 0; j < g->nslots; j++)
+				*(unsigned long *)(image + g->off[j]) =
+					g->cst[j] + base;
+		} else {
+			for (j = 0; j < g->nslots; j++)
+				*(unsigned int *)(image + g->off[j]) =
+					g->cst[j] + base;
+		}
+	}
+
+	/* The slots above point to the jump table, bypass it if we can */
+	for (i = 0; i < tmpl->ndirect; i++) {
+		struct kpatch_reloc_direct *d = &tmpl->direct[i];
+		unsigned long target, loc2 = o->kpta + d->off;
+
+		target = d->target.cst + d->target.kpta * o->kpta +
+			 d->target.load * o->load_offset;
+		if (d->target.undef >= 0)
+			target += addrs[d->target.undef];
+
+		if (d->kind == RELAX_TLS)
+			kpatch_relax_tls(o, image + d->off, target);
+		else if (kpatch_relax(o, image + d->off, loc2, target,
+				      d->kind == RELAX_GOT_LOAD))
+			*(unsigned int *)(image + d->off) = target - loc2;
+	}
+
+	rv = 0;
+out:
+	free(addrs);
+	free(ifuncs);
+	return rv;
+}
+
 int kpatch_elf_load_kpatch_info(struct object_file *o)
 {
 	GElf_Ehdr *ehdr;
-	GElf_Shdr *shdr;
+	GElf_Shdr *s;
 	int i;
 
 	if (o->info != NULL)
 		return 0;
 
 	ehdr = (void *)o->kpfile.patch + o->kpfile.patch->kpatch_offset;
-	shdr = (void *)ehdr + ehdr->e_shoff;
 
 	kpdebug("Loading patch info '%s'...", o->name);
+	i = kpatch_info_section(o->kpfile.patch);
+	if (i == 0) {
+		kpdebug("failed\n");
+		return -1;
+	}
+
+	s = (GElf_Shdr *)((void *)ehdr + ehdr->e_shoff) + i;
+	o->info = (struct kpatch_info *)((void *)ehdr + s->sh_offset);
+	o->ninfo = s->sh_size / sizeof(struct kpatch_info);
+	kpdebug("successfully, %ld entries\n", o->ninfo);
+	return 0;
+}
+
+/*
+ * Direct calls of the patched functions found in the object by
+ * kpatch_strip, see `.kpatch.calls`.
+ */
+struct kpatch_call_site *
+kpatch_elf_call_sites(struct object_file *o, size_t *pncalls)
+{
+	struct kpatch_file *kp = o->kpfile.patch;
+	GElf_Ehdr *ehdr;
+	GElf_Shdr *shdr;
+	int i = 0;
+
+	*pncalls = 0;
+
+	ehdr = (void *)kp + kp->kpatch_offset;
+	shdr = (void *)ehdr + ehdr->e_shoff;
+
+	if (kp->version >= KPATCH_FILE_VERSION2) {
+		i = kp->sec_calls;
+	} else {
+		for (i = ehdr->e_shnum - 1; i > 0; i--)
+			if (!strcmp(secname(ehdr, shdr + i), ".kpatch.calls"))
+				break;
+	}
+	if (i == 0)
+		return NULL;
+
+	*pncalls = shdr[i].sh_size / sizeof(struct kpatch_call_site);
+	return (void *)ehdr + shdr[i].sh_offset;
+}
+
+/*
+ * Largest alignment required by the patch's own sections. The patch
+ * region must be aligned at least that much.
+ */
+unsigned long kpatch_elf_max_alignment(struct object_file *o)
+{
+	GElf_Ehdr *ehdr;
+	GElf_Shdr *shdr;
+	unsigned long align = 1;
+	int i;
+
+	ehdr = (void *)o->kpfile.patch + o->kpfile.patch->kpatch_offset;
+	shdr = (void *)ehdr + ehdr->e_shoff;
+
 	for (i = 1; i < ehdr->e_shnum; i++) {
 		GElf_Shdr *s = shdr + i;
 
-		if (!strcmp(secname(ehdr, s), ".kpatch.info")) {
-			o->info = (struct kpatch_info *)((void *)ehdr +
-							 s->sh_offset);
-			o->ninfo = s->sh_size / sizeof(struct kpatch_info);
-			kpdebug("successfully, %ld entries\n", o->ninfo);
-			return 0;
+		if (kpatch_is_our_section(s) && s->sh_addralign > align)
+			align = s->sh_addralign;
+	}
+
+	return align;
+}
+
+/*
+ * Offset of the end of the patch's code in the patch image. Everything
+ * before it is the same in all the patients if the patch is made
+ * position-independent.
+ */
+unsigned long kpatch_elf_text_end(struct object_file *o)
+{
+	GElf_Ehdr *ehdr;
+	GElf_Shdr *shdr;
+	unsigned long end = 0;
+	int i;
+
+	ehdr = (void *)o->kpfile.patch + o->kpfile.patch->kpatch_offset;
+	shdr = (void *)ehdr + ehdr->e_shoff;
+
+	for (i = 1; i < ehdr->e_shnum; i++) {
+		GElf_Shdr *s = shdr + i;
+
+		if (kpatch_is_our_section(s) && (s->sh_flags & SHF_EXECINSTR) &&
+		    s->sh_offset + s->sh_size > end)
+			end = s->sh_offset + s->sh_size;
+	}
+
+	return o->kpfile.patch->kpatch_offset + end;
+}
+
+/*
+ * Lay the patch out so that everything used at runtime comes first: the
+ * ELF header and the allocated sections, that is the code, the data and
+ * `.kpatch.info` with its strings. Symbols, relocations and section
+ * headers are only needed by us and are moved after them. Only the first
+ * `user_size` bytes of the image are written into the patients.
+ *
+ * The content is rearranged in place, the mapping must be writable.
+ */
+int kpatch_elf_compact_patch(struct kp_file *kpfile)
+{
+	struct kpatch_file *kp = kpfile->patch;
+	GElf_Ehdr *ehdr;
+	GElf_Shdr *shdr, *s;
+	unsigned char *copy;
+	unsigned long off, len, runtime = 0, *offs;
+	int i, pass, ret = -1;
+
+	kp->user_size = kp->total_size;
+
+	ehdr = (void *)kp + kp->kpatch_offset;
+	len = kp->total_size - kp->kpatch_offset;
+	if (ehdr->e_shoff + ehdr->e_shnum * sizeof(*shdr) > len) {
+		kperr("'%s' patch is invalid: section headers out of image\n",
+		      kp->modulename);
+		return -1;
+	}
+
+	copy = malloc(len);
+	offs = calloc(ehdr->e_shnum, sizeof(*offs));
+	if (copy == NULL || offs == NULL) {
+		kplogerror("can't allocate memory to compact patch\n");
+		goto out;
+	}
+	memcpy(copy, ehdr, len);
+	shdr = (void *)copy + ehdr->e_shoff;
+
+	off = sizeof(*ehdr);
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 1; i < ehdr->e_shnum; i++) {
+			s = shdr + i;
+
+			if (s->sh_type == SHT_NOBITS ||
+			    !!(s->sh_flags & SHF_ALLOC) == pass)
+				continue;
+			if (s->sh_offset + s->sh_size > len) {
+				kperr("'%s' patch is invalid: section %d out of image\n",
+				      kp->modulename, i);
+				goto out;
+			}
+			/*
+			 * Align the section where it is in the patient, that
+			 * is counting the patch header too. Otherwise code
+			 * aligned to cache lines by the compiler isn't.
+			 */
+			if (s->sh_addralign > 1)
+				off = ROUND_UP(kp->kpatch_offset + off,
+					       s->sh_addralign) - kp->kpatch_offset;
+			offs[i] = off;
+			off += s->sh_size;
 		}
+		if (pass == 0)
+			runtime = off;
 	}
 
-	kpdebug("failed\n");
-	return -1;
+	off = ROUND_UP(off, 8);
+	if (off + ehdr->e_shnum * sizeof(*shdr) > len) {
+		/* Padding doesn't fit, use the image as is */
+		kpdebug("Can't compact patch for '%s'\n", kp->modulename);
+		ret = 0;
+		goto out;
+	}
+
+	memset((void *)ehdr + sizeof(*ehdr), 0, len - sizeof(*ehdr));
+	for (i = 1; i < ehdr->e_shnum; i++) {
+		s = shdr + i;
+
+		if (offs[i] == 0)
+			continue;
+		memcpy((void *)ehdr + offs[i], copy + s->sh_offset, s->sh_size);
+		s->sh_offset = offs[i];
+	}
+	memcpy((void *)ehdr + off, shdr, ehdr->e_shnum * sizeof(*shdr));
+	ehdr->e_shoff = off;
+
+	kp->user_size = kp->kpatch_offset + runtime;
+	kpdebug("Patch for '%s' is %u bytes at runtime out of %u\n",
+		kp->modulename, kp->user_size, kp->total_size);
+	ret = 0;
+
+out:
+	free(offs);
+	free(copy);
+	return ret;
 }
@@ -17,18 +17,34 @@ kpatch_elf_object_set_ehdr(struct object_file *o,
 int kpatch_elf_object_is_shared_lib(struct object_file *o);
 int kpatch_elf_parse_program_header(struct object_file *o);
 int kpatch_elf_load_kpatch_info(struct object_file *o);
+struct kpatch_call_site *
+kpatch_elf_call_sites(struct object_file *o, size_t *pncalls);
+unsigned long kpatch_elf_max_alignment(struct object_file *o);
+unsigned long kpatch_elf_text_end(struct object_file *o);
+int kpatch_elf_compact_patch(struct kp_file *kpfile);
 
 int kpatch_resolve(struct object_file *o);
 int kpatch_relocate(struct object_file *o);
 
+struct kpatch_reloc_tmpl *
+kpatch_reloc_tmpl_new(struct kp_file *kpfile, unsigned long jmp_offset);
+void kpatch_reloc_tmpl_free(struct kpatch_reloc_tmpl *tmpl);
+int kpatch_reloc_tmpl_usable(struct kpatch_reloc_tmpl *tmpl,
+			     unsigned long jmp_offset);
+size_t kpatch_reloc_tmpl_entries(struct kpatch_reloc_tmpl *tmpl);
+int kpatch_reloc_tmpl_apply(struct object_file *o,
+			    struct kpatch_reloc_tmpl *tmpl);
+
 struct kpatch_jmp_table *kpatch_new_jmp_table(int entries);
 int kpatch_count_undefined(struct object_file *o);
+int kpatch_count_got_entries(struct object_file *o);
 
 int kpatch_resolve_undefined_single_dynamic(struct object_file *o,
 					    const char *sname,
 					    unsigned long *addr);
 
 unsigned long vaddr2addr(struct object_file *o, unsigned long vaddr);
+unsigned long kpatch_elf_find_r_debug(kpatch_process_t *proc);
 
 struct kpatch_jmp_table_entry {
 	unsigned long jmp;
@@ -91,6 +91,11 @@ typedef int (*kpatch_undo_patch)(struct kpatch_data *);
 #define TEST_BIT(r,b) ((r) & (1<<(b)))
 
 #define KPATCH_FILE_MAGIC1	"KPATCH1"
+/*
+ * Version 2 files have the section directory filled and the CRC32C of
+ * the content in csum. Older ones have both zeroed.
+ */
+#define KPATCH_FILE_VERSION2	2
 #define KPATCH_MAX_NR_ENTRIES	16
 #define KPATCH_UNAME_LEN	256
 
@@ -115,7 +120,8 @@ struct kpatch_file {
 	char magic[8];			/* magic string */
 	unsigned char flags;
 	unsigned char safety_method;
-	char pad[6];
+	unsigned char version;		/* KPATCH_FILE_VERSION* */
+	char pad[5];
 	char modulename[64];		/* "vmlinux" or module name */
 	char uname[KPATCH_UNAME_LEN];	/* /proc/version of the kernel */
 
@@ -148,11 +154,20 @@ struct kpatch_file {
 			kpatch_offset_t user_undo;	/* undo information for userspace */
 			kpatch_offset_t user_info;	/* patch information */
 			kpatch_offset_t user_level;	/* FIXME(pboldin) */
+			kpatch_offset_t user_size;	/* runtime part of the image */
+			kpatch_offset_t user_calls;	/* redirected call sites */
 		};
 	};
 
 	char srcversion[25]; /* srcversion of module or zeros */
-	char pad2[231];
+	char pad2[7];
+
+	/* section indexes in the ELF, since KPATCH_FILE_VERSION2 */
+	uint16_t sec_info;		/* .kpatch.info */
+	uint16_t sec_symtab;		/* symbol table */
+	uint16_t sec_text;		/* .kpatch.text */
+	uint16_t sec_calls;		/* .kpatch.calls */
+	char pad3[216];
 
 	/* relocations */
 	/* content */
@@ -186,6 +201,15 @@ struct kpatch_info {
 	char     pad[4];
 };
 
+/*
+ * Direct call to a patched function in the original code, found by
+ * `kpatch_strip --strip` in the `.kpatch.calls` section
+ */
+struct kpatch_call_site {
+	uint64_t site;			/* address of the call instruction */
+	uint64_t daddr;			/* function it calls */
+};
+
 struct kpatch_undo_entry {
 	#define UNDO_ENTRY_ALLOCATED	(1 << 0)
 	#define UNDO_ENTRY_PATCHED	(1 << 1)
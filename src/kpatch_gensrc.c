@@ -20,8 +20,9 @@ static int arch = ARCH_X86_64, arch_bits = 64;
 #define FLAG_PUSH_SECTION	0x01
 #define FLAG_RENAME		0x10
 #define FLAG_GOTPCREL		0x20
+#define FLAG_PIC		0x40
 
-#define MAX_SYM_LIST		32
+#define MAX_SYM_LIST		256
 struct sym_desc {
 	char *filename;
 	char *sym;
@@ -35,9 +36,17 @@ static int nr_unlink_syms;
 static struct sym_desc must_adapt_syms[MAX_SYM_LIST];
 static int nr_must_adapt_syms;
 
+static struct sym_desc hot_syms[MAX_SYM_LIST];
+static int nr_hot_syms;
+
+/* position of the function being written in hot_syms, 0 if it isn't there */
+static int hot_rank;
+
 static int force_gotpcrel;
 static int force_global;
+static int force_pic;
 
+/* returns 1-based index of the symbol in the list or 0 if it's not there */
 static inline int in_syms_list(char *filename, kpstr_t *sym, const struct sym_desc *sym_arr, int nr_syms)
 {
 	int i, len;
@@ -48,7 +57,7 @@ static inline int in_syms_list(char *filename, kpstr_t *sym, const struct sym_de
 				continue;
 		}
 		if (!kpstrcmpz(sym, sym_arr[i].sym))
-			return 1;
+			return i + 1;
 	}
 	return 0;
 }
@@ -226,6 +235,13 @@ static int is_rax_reference(kpstr_t *t)
 	return (t->l > 2 && t->s[0] == '%' && t->s[t->l - 2] == 'a');
 }
 
+/* %rbx, %ebx, %bx, %bl or %bh */
+static int is_rbx_reference(kpstr_t *t)
+{
+	return (t->l > 2 && t->s[0] == '%' && t->s[t->l - 2] == 'b' &&
+		strchr("xlh", t->s[t->l - 1]));
+}
+
 #define	RIP_SUFFIX	"(%rip)"
 #define	RIP_LENGTH	(sizeof(RIP_SUFFIX) - 1)
 
@@ -326,6 +342,222 @@ out:
 	return;
 }
 
+#define	PLT_SUFFIX	"@PLT"
+#define	PLT_LENGTH	(sizeof(PLT_SUFFIX) - 1)
+
+#define	MAX_OPERANDS	2
+
+/* Return true if token is a plain symbol, not a local label or register */
+static int is_pic_symbol(kpstr_t *t)
+{
+	if (t->l == 0 || t->s[0] == '*' || t->s[0] == '%' || isdigit(t->s[0]))
+		return 0;
+	return t->s[0] != '.' || t->l < 2 || t->s[1] != 'L';
+}
+
+/* Return true if token references the stack pointer */
+static int is_rsp_reference(kpstr_t *t)
+{
+	return t->l >= 3 && t->s[0] == '%' && t->s[t->l - 2] == 's' &&
+	       t->s[t->l - 1] == 'p';
+}
+
+/*
+ * Split operands of an instruction by the commas outside of parenthesis.
+ * Returns the number of operands or -1 if there are too many of them.
+ */
+static int split_operands(char *s, kpstr_t *ops)
+{
+	int i, n = 0, depth = 0;
+
+	if (!*s || *s == '\n')
+		return 0;
+
+	kpstrset(&ops[0], s, 0);
+	for (; *s && *s != '\n'; s++) {
+		if (*s == '(')
+			depth++;
+		else if (*s == ')')
+			depth--;
+		else if (*s == ',' && depth == 0) {
+			if (++n == MAX_OPERANDS)
+				return -1;
+			kpstrset(&ops[n], s + 1, 0);
+			continue;
+		}
+		ops[n].l++;
+	}
+
+	for (i = 0; i <= n; i++) {
+		while (ops[i].l && isblank(ops[i].s[0])) {
+			ops[i].s++;
+			ops[i].l--;
+		}
+		while (ops[i].l && isblank(ops[i].s[ops[i].l - 1]))
+			ops[i].l--;
+	}
+
+	return n + 1;
+}
+
+/*
+ * Split `symbol+disp(%rip)` or `disp+symbol(%rip)` into the symbol and
+ * the displacement. Returns 0 if there is something else than a symbol.
+ */
+static int split_rip_reference(kpstr_t *t, kpstr_t *sym, kpstr_t *disp)
+{
+	int i, l = t->l - (int)RIP_LENGTH;
+
+	if (isdigit(t->s[0]) || t->s[0] == '-') {
+		for (i = 1; i < l && isdigit(t->s[i]); i++)
+			;
+		if (i == l || t->s[i] != '+')
+			return 0;
+		kpstrset(disp, t->s, i);
+		kpstrset(sym, t->s + i + 1, l - i - 1);
+		return is_pic_symbol(sym) &&
+		       !memchr(sym->s, '+', sym->l) &&
+		       !memchr(sym->s, '-', sym->l);
+	}
+
+	for (i = 0; i < l; i++)
+		if (t->s[i] == '+' || t->s[i] == '-')
+			break;
+
+	kpstrset(sym, t->s, i);
+	kpstrset(disp, t->s + i, l - i);
+	return is_pic_symbol(sym);
+}
+
+/*
+ * Make patch code reach everything it doesn't define through GOT entries
+ * only:
+ *
+ *	call	symbol		->	call	*symbol@GOTPCREL(%rip)
+ *	jmp	symbol		->	jmp	*symbol@GOTPCREL(%rip)
+ *	leaq	symbol(%rip), %reg ->	movq	symbol@GOTPCREL(%rip), %reg
+ *	addl	symbol(%rip), %eax ->	leaq	-128(%rsp), %rsp
+ *					pushq	%rbx
+ *					movq	symbol@GOTPCREL(%rip), %rbx
+ *					addl	(%rbx), %eax
+ *					popq	%rbx
+ *					leaq	128(%rsp), %rsp
+ *
+ * The red zone is skipped since leaf functions can keep their data there.
+ * Moves are done by str_do_gotpcrel. The code is then the same wherever
+ * the patch is loaded, the doctor only fills the GOT.
+ */
+static void str_do_pic(struct kp_file *f, char *dst, char *src)
+{
+	kpstr_t insn, prefix, ops[MAX_OPERANDS], sym, disp;
+	char *s = src, *d = dst, *aux;
+	int i, n, rip = -1, implicit;
+
+	get_token(&s, &insn);
+	kpstrset(&prefix, "", 0);
+	if (!kpstrcmpz(&insn, "lock")) {
+		prefix = insn;
+		get_token(&s, &insn);
+	}
+	if (!s)
+		goto out;
+
+	if (!kpstrcmpz(&insn, "call") || !kpstrcmpz(&insn, "callq") ||
+	    !kpstrcmpz(&insn, "jmp") || !kpstrcmpz(&insn, "jmpq")) {
+		get_token(&s, &sym);
+		/* Indirect already or not a plain symbol */
+		if (s != NULL || prefix.l || !is_pic_symbol(&sym))
+			goto out;
+
+		if (sym.l > PLT_LENGTH &&
+		    !strncasecmp(sym.s + sym.l - PLT_LENGTH, PLT_SUFFIX,
+				 PLT_LENGTH))
+			sym.l -= PLT_LENGTH;
+
+		sprintf(dst, "\t%.*s\t*%.*s%s", insn.l, insn.s,
+			sym.l, sym.s, GOTPCREL_SUFFIX);
+		return;
+	}
+
+	/* Moves are str_do_gotpcrel's, stack operations can't be moved */
+	if (!kpstrncmpz(&insn, "mov") || !kpstrncmpz(&insn, "push") ||
+	    !kpstrncmpz(&insn, "pop"))
+		goto out;
+
+	n = split_operands(s, ops);
+	if (n <= 0)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		if (!is_global_rip_reference(&ops[i]))
+			continue;
+		if (rip != -1)
+			goto out;
+		rip = i;
+	}
+	if (rip == -1 || is_gotpcrel_or_gottpoff(&ops[rip]) ||
+	    !split_rip_reference(&ops[rip], &sym, &disp))
+		goto out;
+
+	if (!kpstrcmpz(&insn, "lea") || !kpstrcmpz(&insn, "leaq")) {
+		/* Only full 64-bit registers, as in %rax or %r8 */
+		if (n != 2 || prefix.l || ops[1].l < 3 || ops[1].s[1] != 'r' ||
+		    strchr("dwb", ops[1].s[ops[1].l - 1]))
+			goto out;
+
+		d += sprintf(d, "\tmovq\t%.*s%s, %.*s", sym.l, sym.s,
+			     GOTPCREL_SUFFIX, ops[1].l, ops[1].s);
+		if (disp.l)
+			sprintf(d, "\n\tleaq\t%.*s(%.*s), %.*s",
+				disp.l, disp.s, ops[1].l, ops[1].s,
+				ops[1].l, ops[1].s);
+		return;
+	}
+
+	/* These use %rbx and %rcx too */
+	if (!kpstrncmpz(&insn, "cmpxchg8b") || !kpstrncmpz(&insn, "cmpxchg16b"))
+		goto out;
+
+	/* Compare with %rax or multiply and divide %rdx:%rax implicitly */
+	implicit = !kpstrncmpz(&insn, "cmpxchg") ||
+		   !kpstrncmpz(&insn, "mul") || !kpstrncmpz(&insn, "div") ||
+		   !kpstrncmpz(&insn, "idiv") ||
+		   (!kpstrncmpz(&insn, "imul") && n == 1);
+
+	aux = implicit ? "%rbx" : "%rax";
+	for (i = 0; i < n; i++) {
+		if (i == rip)
+			continue;
+		if (is_rsp_reference(&ops[i]))
+			goto out;
+		if (implicit && is_rbx_reference(&ops[i]))
+			goto out;
+		if (is_rax_reference(&ops[i]))
+			aux = "%rbx";
+	}
+
+	d += sprintf(d, "\tleaq\t-128(%%rsp), %%rsp\n");
+	d += sprintf(d, "\tpushq\t%s\n", aux);
+	d += sprintf(d, "\tmovq\t%.*s%s, %s\n", sym.l, sym.s,
+		     GOTPCREL_SUFFIX, aux);
+	d += sprintf(d, "\t%.*s%s%.*s\t", prefix.l, prefix.s,
+		     prefix.l ? " " : "", insn.l, insn.s);
+	for (i = 0; i < n; i++) {
+		if (i)
+			d += sprintf(d, ", ");
+		if (i == rip)
+			d += sprintf(d, "%.*s(%s)", disp.l, disp.s, aux);
+		else
+			d += sprintf(d, "%.*s", ops[i].l, ops[i].s);
+	}
+	d += sprintf(d, "\n\tpopq\t%s\n", aux);
+	sprintf(d, "\tleaq\t128(%%rsp), %%rsp");
+	return;
+
+out:
+	strcpy(dst, src);
+}
+
 /* ------------------------------------------ helpers -------------------------------------------- */
 
 static void change_section(struct kp_file *fout, struct section_desc *sect, int flags)
@@ -334,12 +566,18 @@ static void change_section(struct kp_file *fout, struct section_desc *sect, int
 
 	if (sect->outname)
 		s = sect->outname;
+	else if ((sect->type & SECTION_EXECUTABLE) && hot_rank)
+		s = ".kpatch.text.hot,\"ax\",@progbits";
 	else if (sect->type & SECTION_EXECUTABLE)
 		s = ".kpatch.text,\"ax\",@progbits";
 	else
 		s = ".kpatch.data,\"aw\",@progbits";
 
 	fprintf(fout->f, "\t.%ssection %s\n", (flags & FLAG_PUSH_SECTION) ? "push" : "", s);
+
+	/* hot functions go in the order they are listed in */
+	if (!sect->outname && (sect->type & SECTION_EXECUTABLE) && hot_rank)
+		fprintf(fout->f, "\t.subsection\t%d\n", hot_rank);
 }
 
 void get_comm_args(struct kp_file *f, int l, kpstr_t *xname, int *sz, int *align)
@@ -1114,7 +1352,7 @@ done:
 /* output of single block line with renames done if needed */
 static void cblock_write_line(struct kp_file *fout, struct cblock *b, int l, int flags)
 {
-	char buf[2*BUFSIZE], buf2[2*BUFSIZE], *s;
+	char buf[2*BUFSIZE], buf2[2*BUFSIZE], buf3[2*BUFSIZE], *s;
 
 	s = cline(b->f, l);
 	if (flags & FLAG_RENAME) {
@@ -1125,6 +1363,10 @@ static void cblock_write_line(struct kp_file *fout, struct cblock *b, int l, int
 		str_do_gotpcrel(b->f, buf2, s);
 		s = buf2;
 	}
+	if (flags & FLAG_PIC) {
+		str_do_pic(b->f, buf3, s);
+		s = buf3;
+	}
 
 	fprintf(fout->f, "%s", s);
 	if (clinenum(b->f, l) != clinenum(b->f, l + 1))
@@ -1234,7 +1476,11 @@ static void write_new_function(struct kp_file *fout, struct cblock *b)
 
 	if (force_gotpcrel)
 		cblock_flags |= FLAG_GOTPCREL;
+	if (force_pic)
+		cblock_flags |= FLAG_PIC;
+	hot_rank = in_syms_list(b->f->basename, &b->human_name, hot_syms, nr_hot_syms);
 	cblock_gen(fout, b, cblock_flags);
+	hot_rank = 0;
 	fprintf(fout->f, "\n");
 
 	/* patch info */
@@ -1393,6 +1639,8 @@ static void parse_sym_list(struct sym_desc *syms, int *nr_syms)
 	tok = strtok(optarg, ",");
 	while (tok) {
 		sym_idx = *nr_syms;
+		if (sym_idx >= MAX_SYM_LIST)
+			kpfatal("more than %d functions listed\n", MAX_SYM_LIST);
 		syms[sym_idx].sym = strchr(tok, ':');
 
 		if (syms[sym_idx].sym) {
@@ -1414,7 +1662,7 @@ static void usage(void)
 	kplog(LOG_ERR, "kpatch_gensrc [-d loglevel] [--os=rhel5|rhel6] --dbg-filter [--dbg-filter-eh-frame] -i <input1> -o <output-asm>");
 	kplog(LOG_ERR, "    to filter out debug information and commands from asm file");
 	kplog(LOG_ERR, "kpatch_gensrc [-d loglevel] [--arch=i686|x86_64] [--os=rhel5|rhel6] [--ignore-changes=FLIST] [--unlink-symbols=FLIST]");
-	kplog(LOG_ERR, "              [--must-adapt=FLIST] -i <input1> -i <input2> -o <output-asm>");
+	kplog(LOG_ERR, "              [--must-adapt=FLIST] [--hot-funcs=FLIST] -i <input1> -i <input2> -o <output-asm>");
 	kplog(LOG_ERR, "    to compare 2 asm files and generate a kpatch'ed resuling asm");
 	kplog(LOG_ERR, "Options:");
 	kplog(LOG_ERR, " --dbg-filter-eh-frame - on RHEL 5 GCC can place references to CFI data in .eh_frame section, which lead to");
@@ -1431,6 +1679,10 @@ static void usage(void)
 	kplog(LOG_ERR, "    but it always require adoptation, for example vmx_vcpu_run().");
 	kplog(LOG_ERR, " --force-gotpcrel - rewrites patch code to force use of the @GOTPCREL relocations so the patch can be loaded");
 	kplog(LOG_ERR, "    at a random 32-bit offset. Used in user-space patching.");
+	kplog(LOG_ERR, " --pic - like --force-gotpcrel, but also makes calls, jumps and taking addresses of symbols go through");
+	kplog(LOG_ERR, "    @GOTPCREL so the patch code doesn't depend on where it is loaded. Used for patches shared between processes.");
+	kplog(LOG_ERR, " --hot-funcs=FLIST - puts the listed functions into .kpatch.text.hot, in the order they are listed in, so");
+	kplog(LOG_ERR, "    that patched hot functions are packed together instead of being spread over the patch code.");
 	kplog(LOG_ERR, " --force-global - marks all function used in patch as global so the compiler will generate correct relocation");
 	kplog(LOG_ERR, "    for .kpatch.info section. Used in user-space patching.");
 	kplog(LOG_ERR, "FLIST format:");
@@ -1448,6 +1700,8 @@ enum {
 	MUST_ADAPT,
 	FORCE_GOTPCREL,
 	FORCE_GLOBAL,
+	FORCE_PIC,
+	HOT_FUNCS,
 };
 
 struct option long_opts[] = {
@@ -1466,6 +1720,8 @@ struct option long_opts[] = {
 	{"must-adapt",  1, 0, MUST_ADAPT},
 	{"force-gotpcrel", 0, 0, FORCE_GOTPCREL},
 	{"force-global", 0, 0, FORCE_GLOBAL},
+	{"pic", 0, 0, FORCE_PIC},
+	{"hot-funcs", 1, 0, HOT_FUNCS},
 	{}
 };
 
@@ -1529,12 +1785,21 @@ int main(int argc, char **argv)
 		case FORCE_GLOBAL:
 			force_global = 1;
 			break;
+		case FORCE_PIC:
+			force_gotpcrel = 1;
+			force_pic = 1;
+			break;
+		case HOT_FUNCS:
+			parse_sym_list(hot_syms, &nr_hot_syms);
+			break;
 		default:
 			usage();
 		}
 	}
 	if (optind != argc)
 		usage();
+	if (force_pic && arch_bits != 64)
+		kpfatal("--pic is supported for x86_64 only\n");
 
 	if (dbgfilter) {
 		if (k < 1)
@@ -8,8 +8,10 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <time.h>
+#include <elf.h>
 
 #include "kpatch_file.h"
+#include "kpatch_crc32c.h"
 
 #define ALIGN(x, align)	((x + align - 1) & (~(align - 1)))
 
@@ -26,7 +28,48 @@ static void xerror(const char *fmt, ...)
 	exit(1);
 }
 
-int make_file(int fdo, void *buf1, off_t size, const char *buildid)
+/*
+ * Fill the section directory so that the doctor doesn't have to look
+ * the sections up by their names.
+ */
+static void fill_sections(struct kpatch_file *khdr, void *buf, off_t size)
+{
+	Elf64_Ehdr *ehdr = buf;
+	Elf64_Shdr *shdr;
+	const char *shstrtab;
+	int i;
+
+	if (size < sizeof(*ehdr) ||
+	    memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+	    ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+	    ehdr->e_shoff + ehdr->e_shnum * sizeof(*shdr) > size ||
+	    ehdr->e_shstrndx >= ehdr->e_shnum)
+		xerror("Input is not a 64-bit ELF file");
+
+	shdr = buf + ehdr->e_shoff;
+	shstrtab = buf + shdr[ehdr->e_shstrndx].sh_offset;
+
+	for (i = 1; i < ehdr->e_shnum; i++) {
+		const char *name = shstrtab + shdr[i].sh_name;
+
+		if (shdr[i].sh_type == SHT_SYMTAB)
+			khdr->sec_symtab = i;
+		else if (!strcmp(name, ".kpatch.info"))
+			khdr->sec_info = i;
+		else if (!strcmp(name, ".kpatch.text"))
+			khdr->sec_text = i;
+		else if (!strcmp(name, ".kpatch.calls"))
+			khdr->sec_calls = i;
+	}
+
+	if (verbose)
+		fprintf(stderr, "info %d, symtab %d, text %d, calls %d\n",
+			khdr->sec_info, khdr->sec_symtab, khdr->sec_text,
+			khdr->sec_calls);
+}
+
+int make_file(int fdo, void *buf1, off_t size, const char *buildid,
+	      int safety_method)
 {
 	int res;
 	struct kpatch_file khdr;
@@ -35,14 +78,17 @@ int make_file(int fdo, void *buf1, off_t size, const char *buildid)
 
 	memcpy(khdr.magic, KPATCH_FILE_MAGIC1, sizeof(khdr.magic));
 	strncpy(khdr.uname, buildid, sizeof(khdr.uname));
+	khdr.safety_method = safety_method;
 	khdr.build_time = (uint64_t)time(NULL);
-	khdr.csum = 0;		/* FIXME */
+	khdr.version = KPATCH_FILE_VERSION2;
 	khdr.nr_reloc = 0;
+	fill_sections(&khdr, buf1, size);
 
 	khdr.rel_offset = sizeof(khdr);
 	khdr.kpatch_offset = khdr.rel_offset;
 	size = ALIGN(size, 16);
 	khdr.total_size = khdr.kpatch_offset + size;
+	khdr.csum = kpatch_crc32c(0, buf1, size);
 
 	res = write(fdo, &khdr, sizeof(khdr));
 	res += write(fdo, buf1, size);
@@ -58,6 +104,9 @@ static void usage(void)
 	printf("Usage: kpatch_make [-d] -n <modulename> [-v <version>] -e <entryaddr> [-o <output>] <input1> [input2]\n");
 	printf("   -b buildid = target buildid for patch\n");
 	printf("   -d debug (verbose)\n");
+	printf("   -s safety = how to apply the patch safely: 'freeze-all' (default),\n");
+	printf("               'freeze-none' (patch is safe to apply to running threads),\n");
+	printf("               'freeze-conflict' (only threads running patched code are held)\n");
 	printf("\n");
 	printf("   result is printed to output and is the following:\n");
 	printf("      header          - struct kpatch_file\n");
@@ -72,6 +121,7 @@ int main(int argc, char **argv)
 	void *buf;
 	struct stat st;
 	char *buildid = NULL, *outputname = NULL;
+	int safety_method = KPATCH_SAFETY_METHOD_DEFAULT;
 
 	while ((opt = getopt(argc, argv, "db:o:v:s:")) != -1) {
 		switch (opt) {
@@ -84,6 +134,16 @@ int main(int argc, char **argv)
 		case 'o':
 			outputname = strdup(optarg);
 			break;
+		case 's':
+			if (!strcmp(optarg, "freeze-all"))
+				safety_method = KPATCH_SAFETY_METHOD_FREEZE_ALL;
+			else if (!strcmp(optarg, "freeze-none"))
+				safety_method = KPATCH_SAFETY_METHOD_FREEZE_NONE;
+			else if (!strcmp(optarg, "freeze-conflict"))
+				safety_method = KPATCH_SAFETY_METHOD_FREEZE_CONFLICT;
+			else
+				usage();
+			break;
 		default: /* '?' */
 			usage();
 		}
@@ -109,5 +169,5 @@ int main(int argc, char **argv)
 			xerror("Can't open output file '%s'", outputname);
 	}
 
-	return make_file(fdo, buf, st.st_size, buildid);
+	return make_file(fdo, buf, st.st_size, buildid, safety_method);
 }
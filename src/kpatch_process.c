@@ -21,6 +21,7 @@
 #include "kpatch_common.h"
 #include "kpatch_elf.h"
 #include "kpatch_ptrace.h"
+#include "kpatch_agent.h"
 #include "list.h"
 #include "kpatch_log.h"
 
@@ -81,6 +82,58 @@ object_add_vm_area(struct object_file *o,
 	return 0;
 }
 
+/*
+ * Grow the last VM area of `o` by `vma` if it directly follows it.
+ * Returns 1 if it did.
+ */
+static int
+object_extend_vm_area(struct object_file *o,
+		      struct vm_area *vma)
+{
+	struct obj_vm_area *ovma;
+
+	if (list_empty(&o->vma))
+		return 0;
+
+	ovma = list_entry(o->vma.prev, struct obj_vm_area, list);
+	if (ovma->inmem.end != vma->start || ovma->inmem.prot != vma->prot)
+		return 0;
+
+	ovma->inmem.end = vma->end;
+	return 1;
+}
+
+/* Find the shared text range of `o` that ends at `end` */
+static struct obj_vm_area *
+object_find_shared_text(struct object_file *o,
+			unsigned long end)
+{
+	struct obj_vm_area *ovma;
+
+	list_for_each_entry(ovma, &o->shared_text, list)
+		if (ovma->inmem.end == end)
+			return ovma;
+
+	return NULL;
+}
+
+int
+kpatch_object_add_shared_text(struct object_file *o,
+			      unsigned long start,
+			      unsigned long end)
+{
+	struct obj_vm_area *ovma;
+
+	ovma = calloc(1, sizeof(*ovma));
+	if (ovma == NULL)
+		return -1;
+
+	ovma->inmem.start = start;
+	ovma->inmem.end = end;
+	list_add(&ovma->list, &o->shared_text);
+	return 0;
+}
+
 static struct object_file *
 process_new_object(kpatch_process_t *proc,
 		   dev_t dev, int inode,
@@ -98,6 +151,7 @@ process_new_object(kpatch_process_t *proc,
 	}
 	list_init(&o->list);
 	list_init(&o->vma);
+	list_init(&o->shared_text);
 	o->proc = proc;
 	o->skpfile = NULL;
 	o->dev = dev;
@@ -115,6 +169,7 @@ process_new_object(kpatch_process_t *proc,
 	o->name = strdup(name);
 	o->buildid[0] = '\0';
 	o->kpta = 0UL;
+	o->text_huge_kb = 0;
 	o->info = NULL;
 	o->ninfo = 0;
 	o->applied_patch = NULL;
@@ -126,6 +181,16 @@ process_new_object(kpatch_process_t *proc,
 	o->dynsyms = NULL;
 	o->ndynsyms = 0;
 	o->dynsymnames = NULL;
+	o->dynamic = 0;
+	o->dynsymtab = 0;
+	o->dynstrtab = 0;
+	o->dynstrsz = 0;
+	o->gnu_hash = 0;
+	o->sysv_hash = 0;
+	o->versym = 0;
+	o->verdef = 0;
+	o->verdefnum = 0;
+	o->r_debug = 0;
 	init_kp_file(&o->kpfile);
 	list_add(&o->list, &proc->objs);
 	proc->num_objs++;
@@ -136,6 +201,7 @@ process_new_object(kpatch_process_t *proc,
 #define OBJECT_UNKNOWN	0
 #define OBJECT_ELF	1
 #define OBJECT_KPATCH	2
+#define OBJECT_KPATCH_ARENA	3
 
 #define	ELFMAG		"\177ELF"
 #define SELFMAG		4
@@ -172,6 +238,11 @@ process_get_object_type(kpatch_process_t *proc,
 			sprintf(name, "[kpatch-%s]", pkpfile->uname);
 			return type;
 		}
+
+		if (!strcmp(pkpfile->magic, KPATCH_ARENA_MAGIC)) {
+			strcpy(name, "[kpatch-arena]");
+			return OBJECT_KPATCH_ARENA;
+		}
 	}
 
 	if (!memcmp(buf, ELFMAG, SELFMAG)) {
@@ -183,6 +254,97 @@ process_get_object_type(kpatch_process_t *proc,
 	return type;
 }
 
+static struct object_file *
+process_new_patch_object(kpatch_process_t *proc,
+			 const char *name, struct vm_area *vma,
+			 struct vm_hole *hole,
+			 unsigned char *header_buf,
+			 size_t bufsize)
+{
+	struct object_file *o;
+	struct kpatch_file *patch;
+
+	o = process_new_object(proc, 0, 0, name, vma, hole);
+	if (o == NULL)
+		return NULL;
+
+	patch = malloc(bufsize);
+	if (patch == NULL)
+		return NULL;
+
+	memcpy(patch, header_buf, bufsize);
+	o->kpfile.patch = patch;
+	o->kpfile.size = vma->end - vma->start;
+
+	o->is_patch = 1;
+
+	return o;
+}
+
+/*
+ * Read the arena's header and add an object for each patch found in it,
+ * just like for the patches that have a region of their own. Slots with
+ * no patch in them are left by a failed patching and are freed.
+ */
+static int
+process_add_arena(kpatch_process_t *proc,
+		  struct vm_area *vma,
+		  struct vm_hole *hole,
+		  unsigned char *header_buf)
+{
+	struct kpatch_arena *arena;
+	struct kpatch_file *pkpfile;
+	unsigned char buf[1024];
+	struct vm_area pvma;
+	char name[KPATCH_UNAME_LEN + 16];
+	int i;
+
+	arena = malloc(sizeof(*arena));
+	if (arena == NULL)
+		return -1;
+
+	memcpy(&arena->hdr, header_buf, sizeof(arena->hdr));
+	arena->start = vma->start;
+	/* Patches mapped from files split the arena into a few VMAs */
+	arena->end = vma->start + arena->hdr.size;
+	if (arena->end < vma->end)
+		arena->end = vma->end;
+	arena->huge = proc->huge_arenas &&
+		      !(arena->start & (KPATCH_HUGE_PAGE_SIZE - 1)) &&
+		      !(arena->end & (KPATCH_HUGE_PAGE_SIZE - 1));
+	list_add(&arena->list, &proc->arenas);
+
+	for (i = 0; i < KPATCH_ARENA_NSLOTS; i++) {
+		if (arena->hdr.slots[i].offset == 0)
+			continue;
+
+		pvma.start = arena->start + arena->hdr.slots[i].offset;
+		pvma.end = pvma.start + arena->hdr.slots[i].size;
+		pvma.offset = 0;
+		pvma.prot = vma->prot;
+
+		pkpfile = (struct kpatch_file *)buf;
+		if (pvma.end > arena->end ||
+		    kpatch_process_mem_read(proc, pvma.start,
+					    buf, sizeof(buf)) < 0 ||
+		    strcmp(pkpfile->magic, KPATCH_FILE_MAGIC1)) {
+			kpdebug("Dropping stale arena slot at 0x%lx\n",
+				pvma.start);
+			arena->hdr.slots[i].offset = 0;
+			arena->hdr.slots[i].size = 0;
+			continue;
+		}
+
+		snprintf(name, sizeof(name), "[kpatch-%.*s]",
+			 KPATCH_UNAME_LEN, pkpfile->uname);
+		if (process_new_patch_object(proc, name, &pvma, hole,
+					     buf, sizeof(buf)) == NULL)
+			return -1;
+	}
+
+	return 0;
+}
+
 /**
  * Returns: 0 if everything is ok, -1 on error.
  */
@@ -196,23 +358,49 @@ process_add_object_vma(kpatch_process_t *proc,
 	unsigned char header_buf[1024];
 	struct object_file *o;
 
+	/* The rest of an arena, patches in it are found via its header */
+	if (kpatch_process_find_arena(proc, vma->start))
+		return 0;
+
 	object_type = process_get_object_type(proc,
 					      vma,
 					      name,
 					      header_buf,
 					      sizeof(header_buf));
 
-	if (object_type != OBJECT_KPATCH) {
-		/* Is not a kpatch, look if this is a vm_area of an already
-		 * enlisted object.
-		 */
-		list_for_each_entry_reverse(o,
-					       &proc->objs, list) {
-			if ((dev && inode && o->dev == dev &&
-			     o->inode == inode) ||
-			    (dev == 0 && !strcmp(o->name, name))) {
-				return object_add_vm_area(o, vma, hole);
-			}
+	if (object_type == OBJECT_KPATCH_ARENA)
+		return process_add_arena(proc, vma, hole, header_buf);
+
+	if (object_type == OBJECT_KPATCH)
+		return process_new_patch_object(proc, name, vma, hole,
+						header_buf,
+						sizeof(header_buf)) ? 0 : -1;
+
+	/* Shared patched text belongs to the object it is mapped over */
+	if (!strncmp(name, KPATCH_SHARED_TEXT_PREFIX,
+		     strlen(KPATCH_SHARED_TEXT_PREFIX)) &&
+	    !list_empty(&proc->objs)) {
+		o = list_entry(proc->objs.prev, struct object_file, list);
+		if (kpatch_object_add_shared_text(o, vma->start, vma->end) < 0)
+			return -1;
+		if (object_extend_vm_area(o, vma))
+			return 0;
+		return object_add_vm_area(o, vma, hole);
+	}
+
+	/* Is not a kpatch, look if this is a vm_area of an already
+	 * enlisted object.
+	 */
+	list_for_each_entry_reverse(o,
+				       &proc->objs, list) {
+		if ((dev && inode && o->dev == dev &&
+		     o->inode == inode) ||
+		    (dev == 0 && !strcmp(o->name, name))) {
+			/* The rest of the text split by the shared one */
+			if (object_find_shared_text(o, vma->start) &&
+			    object_extend_vm_area(o, vma))
+				return 0;
+			return object_add_vm_area(o, vma, hole);
 		}
 	}
 
@@ -220,19 +408,7 @@ process_add_object_vma(kpatch_process_t *proc,
 	if (o == NULL)
 		return -1;
 
-	if (object_type == OBJECT_KPATCH) {
-		struct kpatch_file *patch;
-
-		patch = malloc(sizeof(header_buf));
-		if (patch == NULL)
-			return -1;
-
-		memcpy(patch, header_buf, sizeof(header_buf));
-		o->kpfile.patch = patch;
-		o->kpfile.size = vma->end - vma->start;
-
-		o->is_patch = 1;
-	} else if (object_type == OBJECT_ELF) {
+	if (object_type == OBJECT_ELF) {
 		o->is_elf = 1;
 		rv = kpatch_elf_object_set_ehdr(o,
 						header_buf,
@@ -287,6 +463,10 @@ object_destroy(struct object_file *o)
 		list_del(&ovma->list);
 		free(ovma);
 	}
+	list_for_each_entry_safe(ovma, tmp, &o->shared_text, list) {
+		list_del(&ovma->list);
+		free(ovma);
+	}
 	o->proc->num_objs--;
 	if (o->jmp_table)
 		free(o->jmp_table);
@@ -396,6 +576,7 @@ kpatch_process_associate_patches(kpatch_process_t *proc)
 						       struct obj_vm_area,
 						       list);
 			o->kpta = patchvma->inmem.start;
+			o->kpta_size = objpatch->kpfile.size;
 			o->kpfile = objpatch->kpfile;
 
 			found++;
@@ -522,6 +703,17 @@ kpatch_process_map_object_files(kpatch_process_t *proc)
 	return 0;
 }
 
+static void
+process_free_arenas(kpatch_process_t *proc)
+{
+	struct kpatch_arena *arena, *tmp;
+
+	list_for_each_entry_safe(arena, tmp, &proc->arenas, list) {
+		list_del(&arena->list);
+		free(arena);
+	}
+}
+
 static void
 process_destroy_object_files(kpatch_process_t *proc)
 {
@@ -531,11 +723,41 @@ process_destroy_object_files(kpatch_process_t *proc)
 		object_destroy(o);
 }
 
+/*
+ * Forget everything we know about the patient's memory and read it anew,
+ * e.g. after it loaded a new library. Patches we have applied are found
+ * again via their [kpatch-*] regions.
+ */
+int
+kpatch_process_remap_object_files(kpatch_process_t *proc)
+{
+	struct vm_hole *hole, *tmp;
+
+	list_for_each_entry_safe(hole, tmp,
+				 &proc->vmaholes, list) {
+		list_del(&hole->list);
+		free(hole);
+	}
+
+	process_free_arenas(proc);
+
+	free(proc->scope);
+	proc->scope = NULL;
+	proc->nscope = 0;
+
+	process_destroy_object_files(proc);
+
+	return kpatch_process_map_object_files(proc);
+}
+
 static void
 process_detach(kpatch_process_t *proc)
 {
 	struct kpatch_ptrace_ctx *p, *ptmp;
 
+	if (!list_empty(&proc->ptrace.pctxs))
+		kpatch_agent_destroy(proc);
+
 	if (proc->memfd >= 0 && close(proc->memfd) < 0)
 		kplogerror("can't close memfd");
 	proc->memfd = -1;
@@ -547,6 +769,14 @@ process_detach(kpatch_process_t *proc)
 		kpatch_ptrace_detach(p);
 		kpatch_ptrace_ctx_destroy(p);
 	}
+
+	/* Don't leave them stopped forever */
+	while (proc->nchildren) {
+		kpwarn("releasing child %d as is\n", proc->children[0].pid);
+		kpatch_ptrace_release_child(proc, proc->children[0].pid, 0);
+	}
+	free(proc->children);
+	proc->children = NULL;
 }
 
 static int
@@ -1017,35 +1247,815 @@ object_find_patch_region(struct object_file *obj,
 	return region_start;
 }
 
-int
-kpatch_object_allocate_patch(struct object_file *o,
-			     size_t sz)
+static int
+arena_in_reach(struct kpatch_arena *arena,
+	       unsigned long obj_start,
+	       unsigned long obj_end)
+{
+	unsigned long max_distance = 0x80000000;
+
+	if (arena->start >= obj_end)
+		return arena->end - obj_start <= max_distance;
+	if (arena->end <= obj_start)
+		return obj_end - arena->start <= max_distance;
+	return 0;
+}
+
+/*
+ * Find `sz` bytes aligned by `align` not used by any of the arena's slots
+ * and a free slot to describe them. Returns offset from the arena start or 0 if none.
+ */
+static unsigned long
+arena_find_space(struct kpatch_arena *arena,
+		 size_t sz,
+		 unsigned long align,
+		 int *nslot)
+{
+	unsigned long off = ROUND_UP(KPATCH_ARENA_HDR_SIZE, align), end;
+	int i;
+
+	*nslot = -1;
+	for (i = 0; i < KPATCH_ARENA_NSLOTS; i++) {
+		if (arena->hdr.slots[i].offset == 0) {
+			*nslot = i;
+			break;
+		}
+	}
+	if (*nslot < 0)
+		return 0;
+
+again:
+	for (i = 0; i < KPATCH_ARENA_NSLOTS; i++) {
+		if (arena->hdr.slots[i].offset == 0)
+			continue;
+
+		end = arena->hdr.slots[i].offset + arena->hdr.slots[i].size;
+		if (off < end && arena->hdr.slots[i].offset < off + sz) {
+			off = ROUND_UP(end, align);
+			goto again;
+		}
+	}
+
+	if (off + sz > arena->end - arena->start)
+		return 0;
+
+	return off;
+}
+
+static int
+arena_write_hdr(kpatch_process_t *proc,
+		struct kpatch_arena *arena)
+{
+	return kpatch_process_mem_write(proc, &arena->hdr,
+					arena->start, sizeof(arena->hdr));
+}
+
+/*
+ * Find a huge page aligned region for an arena of `size` bytes, that is
+ * rounded up to the huge page size. Returns -1UL if there is none.
+ */
+static unsigned long
+object_find_huge_arena_region(struct object_file *o,
+			      size_t *size,
+			      struct vm_hole **hole)
 {
 	unsigned long addr;
+	size_t hsize;
+
+	hsize = ROUND_UP(*size, KPATCH_HUGE_PAGE_SIZE);
+
+	/* Take a huge page more to align the arena inside the region */
+	addr = object_find_patch_region(o, hsize + KPATCH_HUGE_PAGE_SIZE,
+					hole);
+	if (addr == -1UL) {
+		kpwarn("no room for huge page arena for '%s'\n", o->name);
+		return -1UL;
+	}
+
+	*size = hsize;
+	return ROUND_UP(addr, KPATCH_HUGE_PAGE_SIZE);
+}
+
+/*
+ * Map a new arena that fits `sz` bytes close to `o`. Arenas are
+ * KPATCH_ARENA_SIZE long unless the patch doesn't fit there or there is
+ * no room for that much. With `huge_arenas` set for the process they are
+ * huge page aligned and backed by the transparent huge pages.
+ */
+static struct kpatch_arena *
+object_new_arena(struct object_file *o,
+		 size_t sz)
+{
+	struct kpatch_arena *arena;
 	struct vm_hole *hole = NULL;
+	unsigned long addr = -1UL;
+	size_t size;
+	int huge = 0;
 
+	size = ROUND_UP(KPATCH_ARENA_HDR_SIZE, PAGE_SIZE) +
+	       ROUND_UP(sz, PAGE_SIZE);
 
-	addr = object_find_patch_region(o, sz, &hole);
-	if (!addr)
-		return -1;
+	if (o->proc->huge_arenas) {
+		addr = object_find_huge_arena_region(o, &size, &hole);
+		huge = addr != -1UL;
+	}
+
+	if (!huge && size < KPATCH_ARENA_SIZE) {
+		addr = object_find_patch_region(o, KPATCH_ARENA_SIZE, &hole);
+		if (addr != -1UL)
+			size = KPATCH_ARENA_SIZE;
+	}
+	if (addr == -1UL)
+		addr = object_find_patch_region(o, size, &hole);
+	if (addr == -1UL)
+		return NULL;
 
 	addr = kpatch_mmap_remote(proc2pctx(o->proc),
-				  addr, sz,
+				  addr, size,
 				  PROT_READ | PROT_WRITE | PROT_EXEC,
 				  MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 	if (addr == 0) {
 		kplogerror("remote alloc of 0x%lx bytes failed\n",
+			   size);
+		return NULL;
+	}
+
+	kpinfo("allocated 0x%lx bytes arena at 0x%lx for '%s' patch\n",
+	       size, addr, o->name);
+
+	if (huge && kpatch_madvise_remote(proc2pctx(o->proc), addr, size,
+					  MADV_HUGEPAGE) < 0) {
+		kplogerror("can't madvise huge pages for arena at 0x%lx\n",
 			   addr);
+		huge = 0;
+	}
+
+	kpdebug("Marking this space as busy\n");
+	if (vm_hole_split(hole, addr, addr + size) < 0)
+		return NULL;
+
+	arena = malloc(sizeof(*arena));
+	if (arena == NULL)
+		return NULL;
+
+	arena->start = addr;
+	arena->end = addr + size;
+	memset(&arena->hdr, 0, sizeof(arena->hdr));
+	strcpy(arena->hdr.magic, KPATCH_ARENA_MAGIC);
+	arena->hdr.size = size;
+	arena->huge = huge;
+	list_add(&arena->list, &o->proc->arenas);
+
+	return arena;
+}
+
+/*
+ * Sum the huge pages mapped in the patient's VMAs overlapping
+ * [start, end), in kB, as /proc/pid/smaps reports them.
+ */
+long
+kpatch_process_huge_pages_kb(kpatch_process_t *proc,
+			     unsigned long start,
+			     unsigned long end)
+{
+	char path[128], line[1024];
+	unsigned long vstart, vend, kb;
+	long total = 0;
+	int in = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/smaps", proc->pid);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		kplogerror("can't open %s\n", path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx-%lx ", &vstart, &vend) == 2) {
+			in = vstart < end && vend > start;
+			continue;
+		}
+
+		if (!in)
+			continue;
+
+		if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 ||
+		    sscanf(line, "FilePmdMapped: %lu kB", &kb) == 1 ||
+		    sscanf(line, "ShmemPmdMapped: %lu kB", &kb) == 1)
+			total += kb;
+	}
+
+	fclose(f);
+	return total;
+}
+
+/*
+ * Map `length` bytes of the file open as `fd` in the doctor to `addr` in
+ * the patient. Returns the address mapped or 0 on error.
+ */
+unsigned long
+kpatch_process_map_file(kpatch_process_t *proc,
+			int fd,
+			unsigned long addr,
+			size_t length,
+			int prot,
+			int flags,
+			off_t offset)
+{
+	struct kpatch_ptrace_ctx *pctx = proc2pctx(proc);
+	unsigned long res;
+	int rfd;
+
+	rfd = kpatch_send_fd_remote(pctx, fd);
+	if (rfd < 0) {
+		kperr("can't pass file to the patient\n");
+		return 0;
+	}
+
+	res = kpatch_mmap_remote(pctx, addr, length, prot, flags, rfd, offset);
+	if (res == 0)
+		kplogerror("patient can't map file at 0x%lx\n", addr);
+
+	kpatch_close_remote(pctx, rfd);
+	return res;
+}
+
+/*
+ * Find the mapping at `addr` in the patient, or the first one of the file
+ * `dev`:`ino` if `addr` is 0. Fills `range` with its "start-end" as named
+ * in /proc/pid/map_files, `dev`, `ino` and `name` with the basename of
+ * its file. Returns 0 if found, -1 if not.
+ */
+static int
+process_find_mapping(kpatch_process_t *proc,
+		     unsigned long addr,
+		     char *range,
+		     dev_t *dev,
+		     ino_t *ino,
+		     char *name)
+{
+	char path[64], line[1024], name_[256];
+	unsigned long start, end, inode;
+	unsigned int maj, min;
+	int ret = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/maps", proc->pid);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		kplogerror("can't open %s\n", path);
 		return -1;
 	}
 
-	o->kpta = addr;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx-%lx %*s %*x %x:%x %lu %255s",
+			   &start, &end, &maj, &min, &inode, name_) != 6)
+			continue;
+
+		if (addr ? addr < start || addr >= end :
+		    makedev(maj, min) != *dev || inode != *ino)
+			continue;
+
+		sprintf(range, "%lx-%lx", start, end);
+		*dev = makedev(maj, min);
+		*ino = inode;
+		if (name != NULL)
+			strcpy(name, basename(name_));
+		ret = 0;
+		break;
+	}
+
+	fclose(f);
+	return ret;
+}
+
+/*
+ * Open the file `o` is mapped from as the patient sees it. Returns the fd
+ * or -1.
+ */
+int
+kpatch_object_open_file(struct object_file *o)
+{
+	char range[64], path[128];
+	dev_t dev = o->dev;
+	ino_t ino = o->inode;
+	int fd;
+
+	if (process_find_mapping(o->proc, 0, range, &dev, &ino, NULL) < 0)
+		return -1;
+
+	snprintf(path, sizeof(path), "/proc/%d/map_files/%s",
+		 o->proc->pid, range);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		kplogerror("can't open %s\n", path);
+	return fd;
+}
+
+/* Returns 1 if any process maps the file `dev`:`ino` */
+static int
+shared_file_mapped(dev_t dev, ino_t ino)
+{
+	char path[300], line[1024];
+	unsigned long inode;
+	unsigned int maj, min;
+	struct dirent *de;
+	int found = 0;
+	DIR *dir;
+	FILE *f;
+
+	dir = opendir("/proc");
+	if (dir == NULL)
+		return 1;
+
+	while (!found && (de = readdir(dir)) != NULL) {
+		if (!isdigit(de->d_name[0]))
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/%s/maps", de->d_name);
+		f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "%*x-%*x %*s %*x %x:%x %lu",
+				   &maj, &min, &inode) == 3 &&
+			    inode == ino && makedev(maj, min) == dev) {
+				found = 1;
+				break;
+			}
+		}
+		fclose(f);
+	}
+
+	closedir(dir);
+	return found;
+}
+
+/*
+ * Get the name in /dev/shm and the identity of the shared file mapped at
+ * `addr` in the patient, to release it once the mapping is gone.
+ */
+int
+kpatch_process_shared_file(kpatch_process_t *proc,
+			   unsigned long addr,
+			   struct kpatch_shared_file *sf)
+{
+	char range[64];
+
+	sf->name[0] = '/';
+	if (process_find_mapping(proc, addr, range, &sf->dev, &sf->ino,
+				 sf->name + 1) < 0)
+		return -1;
+
+	if (strncmp(sf->name + 1, KPATCH_SHARED_TEXT_PREFIX,
+		    strlen(KPATCH_SHARED_TEXT_PREFIX)) &&
+	    strncmp(sf->name + 1, KPATCH_PATCH_FILE_PREFIX,
+		    strlen(KPATCH_PATCH_FILE_PREFIX)))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Remove the shared file `sf` from /dev/shm unless some process still maps
+ * it. The processes sharing it are patched by different runs of the
+ * doctor, their mappings are the only count of its users there is.
+ */
+void
+kpatch_release_shared_file(struct kpatch_shared_file *sf)
+{
+	struct stat st;
+	int fd;
+
+	fd = shm_open(sf->name, O_RDONLY, 0);
+	if (fd < 0)
+		return;
+
+	/* The name could have been given to another file since */
+	if (fstat(fd, &st) < 0 || st.st_ino != sf->ino ||
+	    st.st_uid != geteuid() || shared_file_mapped(sf->dev, sf->ino)) {
+		close(fd);
+		return;
+	}
+	close(fd);
+
+	if (shm_unlink(sf->name) == 0)
+		kpinfo("removed /dev/shm%s, no process maps it\n", sf->name);
+}
+
+struct obj_vm_area *
+kpatch_object_find_vma(struct object_file *o,
+		       unsigned long start,
+		       unsigned long end)
+{
+	struct obj_vm_area *ovma;
+
+	list_for_each_entry(ovma, &o->vma, list)
+		if (ovma->inmem.start <= start && end <= ovma->inmem.end)
+			return ovma;
+
+	return NULL;
+}
+
+/*
+ * Bring the private copy of the shared text of `o` back before writing
+ * there, otherwise the write would go to every process sharing it and
+ * ptrace can't write to it at all. The copy is made aside: the object's
+ * file is mapped privately, the current content is written over it and it
+ * is moved over the shared range by mremap. The text at the range is the
+ * same at every moment, so threads may run meanwhile. The shared file is
+ * removed once no process maps it.
+ */
+int
+kpatch_object_unshare_text(struct object_file *o)
+{
+	struct kpatch_ptrace_ctx *pctx = proc2pctx(o->proc);
+	struct obj_vm_area *shared, *tmp, *ovma;
+	struct kpatch_shared_file sf;
+	unsigned char *buf;
+	unsigned long addr;
+	size_t len;
+	int prot, fd = -1, named, ret = -1;
+
+	if (!list_empty(&o->shared_text)) {
+		fd = kpatch_object_open_file(o);
+		if (fd < 0)
+			kpwarn("can't open the file of %s, its text is put on "
+			       "anonymous pages\n", o->name);
+	}
+
+	list_for_each_entry_safe(shared, tmp, &o->shared_text, list) {
+		len = shared->inmem.end - shared->inmem.start;
+		ovma = kpatch_object_find_vma(o, shared->inmem.start,
+					      shared->inmem.end);
+		prot = ovma ? ovma->inmem.prot : PROT_READ | PROT_EXEC;
+
+		buf = malloc(len);
+		if (buf == NULL)
+			goto out;
+
+		if (kpatch_process_mem_read(o->proc, shared->inmem.start,
+					    buf, len) < 0) {
+			free(buf);
+			goto out;
+		}
+
+		named = kpatch_process_shared_file(o->proc,
+						   shared->inmem.start,
+						   &sf) == 0;
+
+		if (fd >= 0 && ovma != NULL && ovma->ondisk.end != 0)
+			addr = kpatch_process_map_file(o->proc, fd, 0, len,
+					prot, MAP_PRIVATE,
+					ovma->ondisk.start +
+					shared->inmem.start - ovma->inmem.start);
+		else
+			addr = kpatch_mmap_remote(pctx, 0, len, prot,
+						  MAP_PRIVATE | MAP_ANONYMOUS,
+						  -1, 0);
+		if (addr == 0 ||
+		    kpatch_process_mem_write(o->proc, buf, addr, len) < 0 ||
+		    kpatch_mremap_remote(pctx, addr, len,
+					 shared->inmem.start) < 0) {
+			kplogerror("can't unshare text of %s at 0x%lx\n",
+				   o->name, shared->inmem.start);
+			if (addr != 0)
+				kpatch_munmap_remote(pctx, addr, len);
+			free(buf);
+			goto out;
+		}
+		free(buf);
+
+		kpinfo("%s: text 0x%lx-0x%lx is private again\n",
+		       o->name, shared->inmem.start, shared->inmem.end);
+
+		if (named)
+			kpatch_release_shared_file(&sf);
+
+		list_del(&shared->list);
+		free(shared);
+	}
+
+	ret = 0;
+out:
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+/*
+ * Unshare the text of the object `addr` is in the shared text of, if
+ * any, e.g. before a breakpoint is put there.
+ */
+int
+kpatch_process_unshare_text_at(kpatch_process_t *proc,
+			       unsigned long addr)
+{
+	struct obj_vm_area *shared;
+	struct object_file *o;
+
+	list_for_each_entry(o, &proc->objs, list)
+		list_for_each_entry(shared, &o->shared_text, list)
+			if (addr >= shared->inmem.start &&
+			    addr < shared->inmem.end)
+				return kpatch_object_unshare_text(o);
+
+	return 0;
+}
+
+/*
+ * Ask the kernel to put the huge page arenas onto huge pages right away
+ * now the patches are written there, in case it didn't fault them in as
+ * such. Failure is not fatal: patches work on small pages too.
+ */
+void
+kpatch_process_collapse_arenas(kpatch_process_t *proc)
+{
+	struct kpatch_arena *arena;
+
+	list_for_each_entry(arena, &proc->arenas, list) {
+		if (!arena->huge)
+			continue;
+
+		if (kpatch_madvise_remote(proc2pctx(proc), arena->start,
+					  arena->end - arena->start,
+					  MADV_COLLAPSE) < 0)
+			kpwarn("can't collapse arena at 0x%lx: %s\n",
+			       arena->start, strerror(errno));
+	}
+}
+
+/*
+ * Allocate `sz` bytes for the patch of `o` within (-2GiB, +2GiB) range
+ * from it. Arenas mapped for other objects are used if they are in
+ * reach, so patches of the objects laying close share the mapping.
+ */
+int
+kpatch_object_allocate_patch(struct object_file *o,
+			     size_t sz)
+{
+	struct kpatch_arena *arena;
+	struct obj_vm_area *sovma;
+	unsigned long obj_start, obj_end, align, off = 0;
+	int nslot = -1;
+
+	sovma = list_first_entry(&o->vma, struct obj_vm_area, list);
+	obj_start = sovma->inmem.start;
+	sovma = list_entry(o->vma.prev, struct obj_vm_area, list);
+	obj_end = sovma->inmem.end;
+
+	/* Arenas are page aligned, so is the rest of the patient's memory */
+	align = kpatch_elf_max_alignment(o);
+	if (align < KPATCH_ARENA_ALIGN)
+		align = KPATCH_ARENA_ALIGN;
+	if (align > PAGE_SIZE || o->proc->map_patches)
+		align = PAGE_SIZE;
+
+	sz = ROUND_UP(sz, o->proc->map_patches ? PAGE_SIZE :
+			  KPATCH_ARENA_ALIGN);
+
+	list_for_each_entry(arena, &o->proc->arenas, list) {
+		if (!arena_in_reach(arena, obj_start, obj_end))
+			continue;
+
+		off = arena_find_space(arena, sz, align, &nslot);
+		if (off)
+			break;
+	}
+
+	if (off == 0) {
+		arena = object_new_arena(o, sz);
+		if (arena == NULL)
+			return -1;
+
+		off = arena_find_space(arena, sz, align, &nslot);
+	}
+
+	arena->hdr.slots[nslot].offset = off;
+	arena->hdr.slots[nslot].size = sz;
+	if (arena_write_hdr(o->proc, arena) < 0) {
+		kplogerror("can't update arena at 0x%lx\n", arena->start);
+		arena->hdr.slots[nslot].offset = 0;
+		arena->hdr.slots[nslot].size = 0;
+		return -1;
+	}
+
+	o->kpta = arena->start + off;
+	o->kpta_size = sz;
 
 	kpinfo("allocated 0x%lx bytes at 0x%lx for '%s' patch\n",
 	       sz, o->kpta, o->name);
 
-	kpdebug("Marking this space as busy\n");
-	return vm_hole_split(hole, addr, addr + sz);
+	return 0;
+}
+
+struct kpatch_arena *
+kpatch_process_find_arena(kpatch_process_t *proc,
+			  unsigned long addr)
+{
+	struct kpatch_arena *arena;
+
+	list_for_each_entry(arena, &proc->arenas, list)
+		if (addr >= arena->start && addr < arena->end)
+			return arena;
+
+	return NULL;
+}
+
+/*
+ * Protection of [addr, addr + size) in the patient as we have seen its
+ * mappings, or -1 if the range is not within a single known mapping.
+ */
+int
+kpatch_process_addr_prot(kpatch_process_t *proc,
+			 unsigned long addr,
+			 size_t size)
+{
+	struct kpatch_arena *arena;
+	struct obj_vm_area *ovma;
+	struct object_file *o;
+
+	arena = kpatch_process_find_arena(proc, addr);
+	if (arena != NULL)
+		return addr + size <= arena->end ?
+		       PROT_READ | PROT_WRITE | PROT_EXEC : -1;
+
+	list_for_each_entry(o, &proc->objs, list)
+		list_for_each_entry(ovma, &o->vma, list)
+			if (addr >= ovma->inmem.start &&
+			    addr + size <= ovma->inmem.end)
+				return ovma->inmem.prot;
+
+	return -1;
+}
+
+static void
+vm_hole_replace(kpatch_process_t *proc,
+		struct vm_hole *old,
+		struct vm_hole *new)
+{
+	struct object_file *o;
+
+	list_for_each_entry(o, &proc->objs, list)
+		if (o->previous_hole == old)
+			o->previous_hole = new;
+
+	list_del(&old->list);
+	free(old);
+}
+
+/*
+ * Return the region allocated by `vm_hole_split` to the list of holes,
+ * merging it with the neighbours so the patch window doesn't fragment.
+ * Holes are sorted by address.
+ */
+static int
+vm_hole_join(kpatch_process_t *proc,
+	     unsigned long start,
+	     unsigned long end)
+{
+	struct list_head *head = &proc->vmaholes;
+	struct vm_hole *hole, *left = NULL, *right = NULL;
+
+	list_for_each_entry(hole, head, list) {
+		if (hole->start >= end) {
+			right = hole;
+			break;
+		}
+		left = hole;
+	}
+
+	/* Keep guard pages unless there is a hole right behind them */
+	if (left && left->end == start - PAGE_SIZE)
+		start = left->start;
+	else
+		start += PAGE_SIZE;
+
+	if (right && right->start == end + PAGE_SIZE)
+		end = right->end;
+	else
+		end -= PAGE_SIZE;
+
+	if (left && left->start == start) {
+		left->end = end;
+		if (right && right->end == end)
+			vm_hole_replace(proc, right, left);
+		return 0;
+	}
+
+	if (right && right->end == end) {
+		right->start = start;
+		return 0;
+	}
+
+	if (start >= end)
+		return 0;
+
+	hole = malloc(sizeof(*hole));
+	if (hole == NULL)
+		return -1;
+
+	hole->start = start;
+	hole->end = end;
+
+	/* Insert before the right one, or as the last */
+	list_add(&hole->list, right ? &right->list : head);
+
+	return 0;
+}
+
+/*
+ * Give the patch's slot back to its arena. The arena is unmapped once it
+ * holds no patches.
+ */
+static int
+arena_free_patch(kpatch_process_t *proc,
+		 struct kpatch_arena *arena,
+		 unsigned long addr)
+{
+	unsigned long off = addr - arena->start, size = 0;
+	struct kpatch_shared_file sf;
+	int i, used = 0, named, ret;
+
+	for (i = 0; i < KPATCH_ARENA_NSLOTS; i++) {
+		if (arena->hdr.slots[i].offset == off) {
+			size = arena->hdr.slots[i].size;
+			arena->hdr.slots[i].offset = 0;
+			arena->hdr.slots[i].size = 0;
+			off = 0;
+		} else if (arena->hdr.slots[i].offset != 0)
+			used++;
+	}
+
+	if (off != 0) {
+		kperr("no patch at 0x%lx in arena 0x%lx\n",
+		      addr, arena->start);
+		return -1;
+	}
+
+	kpinfo("freed patch at 0x%lx\n", addr);
+
+	/* The patch might have been mapped from a file, drop it */
+	named = kpatch_process_shared_file(proc, addr, &sf) == 0;
+	if (used && !(addr & (PAGE_SIZE - 1)) && !(size & (PAGE_SIZE - 1)) &&
+	    kpatch_mmap_remote(proc2pctx(proc), addr, size,
+			       PROT_READ | PROT_WRITE | PROT_EXEC,
+			       MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS,
+			       -1, 0) == 0) {
+		kplogerror("can't drop patch pages at 0x%lx\n", addr);
+		named = 0;
+	}
+
+	if (used) {
+		if (named)
+			kpatch_release_shared_file(&sf);
+		return arena_write_hdr(proc, arena);
+	}
+
+	ret = kpatch_munmap_remote(proc2pctx(proc), arena->start,
+				   arena->end - arena->start);
+	if (ret < 0) {
+		kplogerror("can't unmap arena at 0x%lx\n", arena->start);
+		return ret;
+	}
+
+	kpinfo("freed 0x%lx bytes arena at 0x%lx\n",
+	       arena->end - arena->start, arena->start);
+
+	if (named)
+		kpatch_release_shared_file(&sf);
+
+	ret = vm_hole_join(proc, arena->start, arena->end);
+
+	list_del(&arena->list);
+	free(arena);
+
+	return ret;
+}
+
+int
+kpatch_process_free_patch(kpatch_process_t *proc,
+			  unsigned long addr,
+			  size_t sz)
+{
+	struct kpatch_arena *arena;
+	int ret;
+
+	arena = kpatch_process_find_arena(proc, addr);
+	if (arena != NULL)
+		return arena_free_patch(proc, arena, addr);
+
+	ret = kpatch_munmap_remote(proc2pctx(proc), addr, sz);
+	if (ret < 0) {
+		kplogerror("can't unmap patch region at 0x%lx\n", addr);
+		return ret;
+	}
+
+	kpinfo("freed 0x%lx bytes at 0x%lx\n", sz, addr);
+
+	return vm_hole_join(proc, addr, addr + ROUND_UP(sz, PAGE_SIZE));
 }
 
 int
@@ -1070,6 +2080,7 @@ kpatch_process_init(kpatch_process_t *proc,
 	list_init(&proc->ptrace.pctxs);
 	list_init(&proc->objs);
 	list_init(&proc->vmaholes);
+	list_init(&proc->arenas);
 	proc->num_objs = 0;
 
 	if (process_get_comm(proc))
@@ -1109,8 +2120,14 @@ kpatch_process_free(kpatch_process_t *proc)
 		free(hole);
 	}
 
+	process_free_arenas(proc);
+
 	kpatch_free_coroutines(proc);
 
+	free(proc->scope);
+	proc->scope = NULL;
+	proc->nscope = 0;
+
 	process_detach(proc);
 	process_destroy_object_files(proc);
 }
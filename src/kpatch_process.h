@@ -25,6 +25,52 @@ struct vm_hole {
 	struct list_head list;
 };
 
+/*
+ * Patches of the objects laying close to each other are packed into a
+ * shared anonymous region, an arena. The header below is stored at the
+ * start of the arena in the patient's memory and lists the patches
+ * allocated in it so they can be found by the next doctor run.
+ */
+#define KPATCH_ARENA_MAGIC	"KPARENA"
+#define KPATCH_ARENA_NSLOTS	62
+#define KPATCH_ARENA_HDR_SIZE	1024
+#define KPATCH_ARENA_ALIGN	64
+#define KPATCH_ARENA_SIZE	(1024 * 1024)
+#define KPATCH_HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+
+struct kpatch_arena_hdr {
+	char magic[8];
+	uint64_t size;
+	uint64_t pad;
+	struct {
+		uint64_t offset;	/* 0 if the slot is free */
+		uint64_t size;
+	} slots[KPATCH_ARENA_NSLOTS];
+};
+
+struct kpatch_arena {
+	unsigned long start;
+	unsigned long end;
+
+	/* Copy of the header in the patient's memory */
+	struct kpatch_arena_hdr hdr;
+
+	/* Is it backed by the transparent huge pages? */
+	int huge;
+
+	struct list_head list;
+};
+
+/*
+ * Patched text pages can be shared by the processes running the same
+ * object. The pages are put into a file in /dev/shm named after the
+ * object's Build-ID and the pages' content and mapped over the text.
+ */
+#define KPATCH_SHARED_TEXT_PREFIX	"libcare-text-"
+
+/* Patch images mapped from files are named the same way */
+#define KPATCH_PATCH_FILE_PREFIX	"libcare-patch-"
+
 struct obj_vm_area {
 	struct vm_area inmem;
 	struct vm_area inelf;
@@ -37,9 +83,10 @@ struct object_file {
 	kpatch_process_t *proc;
 
 	/**
-	 * This is a pointer to storage's kpfile, readonly.
+	 * This is a pointer to storage's kpfile. The patch is readonly,
+	 * its relocation template is made once the patch is needed.
 	 */
-	const struct kp_file *skpfile;
+	struct kp_file *skpfile;
 
 	/**
 	 * This is filled with kpatch information if is_patch = 1
@@ -53,6 +100,12 @@ struct object_file {
 	/* Address of the patch in target's process address space */
 	unsigned long kpta;
 
+	/* Size of the region allocated for the patch at kpta */
+	size_t kpta_size;
+
+	/* Huge pages backing the object before it was patched, kB */
+	long text_huge_kb;
+
 	/* Device the object resides on */
 	dev_t dev;
 	ino_t inode;
@@ -63,6 +116,12 @@ struct object_file {
 	/* List of object's VM areas */
 	struct list_head vma;
 
+	/*
+	 * Parts of the VM areas above mapped from KPATCH_SHARED_TEXT_PREFIX
+	 * files, as a list of obj_vm_area with `inmem` set only.
+	 */
+	struct list_head shared_text;
+
 	/* Object's Build-ID */
 	char buildid[41];
 
@@ -86,6 +145,20 @@ struct object_file {
 
 	char **dynsymnames;
 
+	/* Dynamic section and tables as found in the patient's memory */
+	unsigned long dynamic;
+	unsigned long dynsymtab;
+	unsigned long dynstrtab;
+	size_t dynstrsz;
+	unsigned long gnu_hash;
+	unsigned long sysv_hash;
+	unsigned long versym;
+	unsigned long verdef;
+	size_t verdefnum;
+
+	/* Value of DT_DEBUG, i.e. address of the r_debug */
+	unsigned long r_debug;
+
 	/* Pointer to the previous hole in the patient's mapping */
 	struct vm_hole *previous_hole;
 
@@ -138,9 +211,35 @@ struct kpatch_process {
 	/* List of free VMA areas */
 	struct list_head vmaholes;
 
+	/* List of arenas patches are allocated from */
+	struct list_head arenas;
+
 	/* libc's base address to use as a worksheet */
 	unsigned long libc_base;
 
+	/* In-process agent driven through a shared ring, if injected */
+	struct kpatch_agent *agent;
+
+	/*
+	 * Objects in the dynamic linker's lookup order along with their
+	 * l_addr as found in link_map. nscope is -1 if there is none.
+	 */
+	struct {
+		struct object_file *obj;
+		unsigned long l_addr;
+	} *scope;
+	int nscope;
+
+	/*
+	 * Processes forked while PTRACE_O_TRACEFORK was set. They are
+	 * traced by us and kept stopped until released.
+	 */
+	struct kpatch_child {
+		int pid;
+		int stopped;
+	} *children;
+	int nchildren;
+
 	/*
 	 * Is client have been stopped right before the `execve`
 	 * and awaiting our response via this fd?
@@ -152,6 +251,18 @@ struct kpatch_process {
 
 	/* Is it an ld-linux trampoline? */
 	unsigned int is_ld_linux:1;
+
+	/* Allocate huge page backed arenas for the patches? */
+	unsigned int huge_arenas:1;
+
+	/* Share the patched text pages with other processes? */
+	unsigned int share_text:1;
+
+	/* Map patch images from files instead of writing them? */
+	unsigned int map_patches:1;
+
+	/* Point direct calls of the patched functions to the new code? */
+	unsigned int redirect_calls:1;
 };
 
 void
@@ -160,6 +271,61 @@ kpatch_object_dump(struct object_file *o);
 int
 kpatch_object_allocate_patch(struct object_file *obj,
 			     size_t sz);
+int
+kpatch_object_add_shared_text(struct object_file *obj,
+			      unsigned long start,
+			      unsigned long end);
+int
+kpatch_process_free_patch(kpatch_process_t *proc,
+			  unsigned long addr,
+			  size_t sz);
+struct kpatch_arena *
+kpatch_process_find_arena(kpatch_process_t *proc,
+			  unsigned long addr);
+int
+kpatch_process_addr_prot(kpatch_process_t *proc,
+			 unsigned long addr,
+			 size_t size);
+void
+kpatch_process_collapse_arenas(kpatch_process_t *proc);
+long
+kpatch_process_huge_pages_kb(kpatch_process_t *proc,
+			     unsigned long start,
+			     unsigned long end);
+unsigned long
+kpatch_process_map_file(kpatch_process_t *proc,
+			int fd,
+			unsigned long addr,
+			size_t length,
+			int prot,
+			int flags,
+			off_t offset);
+int
+kpatch_object_open_file(struct object_file *o);
+
+/* A file in /dev/shm mapped by patients, see kpatch_release_shared_file */
+struct kpatch_shared_file {
+	char name[257];
+	dev_t dev;
+	ino_t ino;
+};
+
+int
+kpatch_process_shared_file(kpatch_process_t *proc,
+			   unsigned long addr,
+			   struct kpatch_shared_file *sf);
+void
+kpatch_release_shared_file(struct kpatch_shared_file *sf);
+
+struct obj_vm_area *
+kpatch_object_find_vma(struct object_file *o,
+		       unsigned long start,
+		       unsigned long end);
+int
+kpatch_object_unshare_text(struct object_file *o);
+int
+kpatch_process_unshare_text_at(kpatch_process_t *proc,
+			       unsigned long addr);
 
 int
 kpatch_process_associate_patches(kpatch_process_t *proc);
@@ -168,6 +334,8 @@ kpatch_process_parse_proc_maps(kpatch_process_t *proc);
 int
 kpatch_process_map_object_files(kpatch_process_t *proc);
 int
+kpatch_process_remap_object_files(kpatch_process_t *proc);
+int
 kpatch_process_attach(kpatch_process_t *proc);
 int
 kpatch_process_load_libraries(kpatch_process_t *proc);
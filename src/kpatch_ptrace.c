@@ -18,6 +18,7 @@
 #include "kpatch_process.h"
 #include "kpatch_common.h"
 #include "kpatch_ptrace.h"
+#include "kpatch_agent.h"
 #include "kpatch_log.h"
 
 #include <gelf.h>
@@ -227,6 +228,152 @@ kpatch_ptrace_find_thread(kpatch_process_t *proc,
 	return NULL;
 }
 
+static struct kpatch_ptrace_ctx *
+kpatch_ptrace_ctx_alloc(kpatch_process_t *proc);
+
+/*
+ * Thread `tid` was created by the `parent` and is traced automatically
+ * due to PTRACE_O_TRACECLONE, remember it. It is running from now on
+ * and breaks where its parent does. Returns 1 if the thread is new.
+ */
+static int
+kpatch_ptrace_add_new_thread(kpatch_process_t *proc,
+			     int tid,
+			     struct kpatch_ptrace_ctx *parent)
+{
+	struct kpatch_ptrace_ctx *pctx;
+	int ret = 0;
+
+	pctx = kpatch_ptrace_find_thread(proc, tid, 0UL);
+	if (pctx == NULL) {
+		pctx = kpatch_ptrace_ctx_alloc(proc);
+		if (pctx == NULL) {
+			kperr("Can't alloc kpatch_ptrace_ctx");
+			return -1;
+		}
+		pctx->pid = tid;
+		pctx->initial_stop = 1;
+		kpdebug("New thread %d\n", tid);
+		ret = 1;
+	}
+
+	if (parent != NULL && pctx->execute_until == 0UL)
+		pctx->execute_until = parent->execute_until;
+
+	return ret;
+}
+
+static struct kpatch_child *
+kpatch_ptrace_find_child(kpatch_process_t *proc, int pid)
+{
+	int i;
+
+	for (i = 0; i < proc->nchildren; i++)
+		if (proc->children[i].pid == pid)
+			return &proc->children[i];
+
+	return NULL;
+}
+
+static struct kpatch_child *
+kpatch_ptrace_add_child(kpatch_process_t *proc, int pid)
+{
+	struct kpatch_child *child;
+
+	child = kpatch_ptrace_find_child(proc, pid);
+	if (child != NULL)
+		return child;
+
+	child = realloc(proc->children,
+			(proc->nchildren + 1) * sizeof(*child));
+	if (child == NULL) {
+		kperr("Can't alloc kpatch_child");
+		return NULL;
+	}
+	proc->children = child;
+
+	child = &proc->children[proc->nchildren++];
+	child->pid = pid;
+	child->stopped = 0;
+	kpdebug("New child %d\n", pid);
+
+	return child;
+}
+
+static int
+process_get_tgid(int pid)
+{
+	char path[128], line[256];
+	int tgid = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "Tgid: %d", &tgid) == 1)
+			break;
+	}
+
+	fclose(f);
+	return tgid;
+}
+
+/*
+ * Detach the forked child `pid` passing it `sig`, waiting for it to
+ * stop first if it didn't yet.
+ */
+int kpatch_ptrace_release_child(kpatch_process_t *proc, int pid, int sig)
+{
+	struct kpatch_child *child;
+	int ret = 0, status;
+
+	child = kpatch_ptrace_find_child(proc, pid);
+	if (child == NULL)
+		return -1;
+
+	while (!child->stopped) {
+		ret = waitpid(pid, &status, __WALL);
+		if (ret < 0) {
+			kplogerror("can't wait for child %d\n", pid);
+			goto out;
+		}
+		if (WIFSTOPPED(status))
+			child->stopped = 1;
+		else if (WIFEXITED(status) || WIFSIGNALED(status))
+			goto out;
+	}
+
+	ret = ptrace(PTRACE_DETACH, pid, NULL, (void *)(uintptr_t)sig);
+	if (ret < 0)
+		kplogerror("can't detach child %d\n", pid);
+
+out:
+	*child = proc->children[--proc->nchildren];
+	return ret < 0 ? -1 : 0;
+}
+
+static int
+kpatch_ptrace_is_breakpoint(kpatch_process_t *proc, unsigned long rip)
+{
+	struct kpatch_ptrace_ctx *pctx;
+
+	for_each_thread(proc, pctx)
+		if (pctx->execute_until != 0UL &&
+		    rip == pctx->execute_until + BREAK_INSN_LENGTH)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Returns 1 if a thread hit its breakpoint, 2 if a thread exited or was
+ * stopped by a signal, 3 if a
+ * new thread appeared, 4 if a forked child stopped and 0 if there is
+ * nothing interesting yet.
+ */
 static inline int
 kpatch_ptrace_waitpid(kpatch_process_t *proc,
 		      struct timespec *timeout,
@@ -254,6 +401,13 @@ kpatch_ptrace_waitpid(kpatch_process_t *proc,
 			return -1;
 		}
 
+		/* We were asked to stop waiting */
+		if (ret > 0 && ret != SIGCHLD) {
+			kpinfo("got signal %d, stop waiting\n", ret);
+			errno = EINTR;
+			return -1;
+		}
+
 		if (ret == -1 && errno == EINVAL) {
 			kperr("invalid timeout\n");
 			return -1;
@@ -299,8 +453,112 @@ kpatch_ptrace_waitpid(kpatch_process_t *proc,
 		} else {
 			/* It's dead */
 			pctx->pid = pctx->running = 0;
+			if (pctx->released) {
+				pctx->released = 0;
+				return 0;
+			}
+		}
+		return 2;
+	}
+
+	if (status >> 16 == PTRACE_EVENT_CLONE) {
+		unsigned long tid;
+
+		ret = ptrace(PTRACE_GETEVENTMSG, pid, NULL, &tid);
+		if (ret < 0) {
+			kplogerror("can't get new thread id - %d\n", pid);
+			return -1;
+		}
+
+		pctx = kpatch_ptrace_find_thread(proc, pid, 0UL);
+		ret = kpatch_ptrace_add_new_thread(proc, tid, pctx);
+		if (ret < 0)
+			return -1;
+
+		if (ptrace(PTRACE_CONT, pid, NULL, NULL) < 0) {
+			kplogerror("can't start tracee %d\n", pid);
+			return -1;
+		}
+		return ret ? 3 : 0;
+	}
+
+	if (status >> 16 == PTRACE_EVENT_FORK) {
+		unsigned long child;
+
+		ret = ptrace(PTRACE_GETEVENTMSG, pid, NULL, &child);
+		if (ret < 0) {
+			kplogerror("can't get forked child id - %d\n", pid);
+			return -1;
+		}
+
+		if (kpatch_ptrace_add_child(proc, child) == NULL)
+			return -1;
+
+		if (ptrace(PTRACE_CONT, pid, NULL, NULL) < 0) {
+			kplogerror("can't start tracee %d\n", pid);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (WSTOPSIG(status) != SIGTRAP) {
+		int sig = WSTOPSIG(status), new = 0;
+		siginfo_t si;
+
+		/*
+		 * A new thread or forked child stopped for the first time.
+		 * Its clone or fork event might not have been reported yet.
+		 * Children are kept stopped until released.
+		 */
+		pctx = kpatch_ptrace_find_thread(proc, pid, 0UL);
+		if (sig == SIGSTOP && pctx == NULL) {
+			struct kpatch_child *child;
+
+			child = kpatch_ptrace_find_child(proc, pid);
+			if (child == NULL && process_get_tgid(pid) != proc->pid)
+				child = kpatch_ptrace_add_child(proc, pid);
+			if (child != NULL) {
+				child->stopped = 1;
+				return 4;
+			}
+
+			new = kpatch_ptrace_add_new_thread(proc, pid, NULL);
+			if (new < 0)
+				return -1;
+			pctx = kpatch_ptrace_find_thread(proc, pid, 0UL);
+		}
+
+		/*
+		 * The patient is being stopped by someone else: a SIGSTOP
+		 * we've delivered has turned into a group-stop. Leave the
+		 * thread stopped, it won't hit anything now.
+		 */
+		if (ptrace(PTRACE_GETSIGINFO, pid, NULL, &si) < 0) {
+			kpdebug("Thread %d is stopped, leaving it so\n", pid);
+			if (pctx != NULL)
+				pctx->running = 0;
+			return 2;
 		}
-		return 1;
+
+		/*
+		 * Only the SIGSTOPs the threads are attached with and the
+		 * ones we've sent are ours, all the rest is delivered.
+		 */
+		if (sig == SIGSTOP && pctx != NULL && pctx->initial_stop) {
+			pctx->initial_stop = 0;
+			sig = 0;
+		} else if (sig == SIGSTOP && si.si_code == SI_TKILL &&
+			   si.si_pid == getpid()) {
+			sig = 0;
+		}
+
+		kpdebug("Thread %d got signal %d, continuing\n", pid, sig);
+		ret = ptrace(PTRACE_CONT, pid, NULL, (void *)(uintptr_t)sig);
+		if (ret < 0) {
+			kplogerror("can't start tracee %d\n", pid);
+			return -1;
+		}
+		return new ? 3 : 0;
 	}
 
 	ret = ptrace(PTRACE_GETREGS, pid, NULL, &regs);
@@ -311,6 +569,27 @@ kpatch_ptrace_waitpid(kpatch_process_t *proc,
 
 	pctx = kpatch_ptrace_find_thread(proc, pid, regs.rip);
 
+	/*
+	 * A released thread hit a breakpoint meant for another one. Hold it
+	 * there, it is out of the function we were waiting for to return.
+	 */
+	if (pctx == NULL && kpatch_ptrace_is_breakpoint(proc, regs.rip)) {
+		pctx = kpatch_ptrace_find_thread(proc, pid, 0UL);
+		if (pctx != NULL && pctx->released) {
+			kpdebug("Holding released thread %d at %llx\n", pid,
+				regs.rip - BREAK_INSN_LENGTH);
+			regs.rip -= BREAK_INSN_LENGTH;
+			ret = ptrace(PTRACE_SETREGS, pid, NULL, &regs);
+			if (ret < 0) {
+				kplogerror("can't set regs - %d\n", pid);
+				return -1;
+			}
+			pctx->running = pctx->released = 0;
+			return 0;
+		}
+		pctx = NULL;
+	}
+
 	if (pctx == NULL) {
 		/* We either don't know anything about this thread or
 		 * even worse -- we stopped it in the wrong place.
@@ -345,6 +624,112 @@ kpatch_ptrace_waitpid(kpatch_process_t *proc,
 	return 1;
 }
 
+/* Stop running threads, released ones stay marked so */
+static void
+kpatch_ptrace_stop_running(kpatch_process_t *proc)
+{
+	struct kpatch_ptrace_ctx *pctx;
+	int ret;
+
+	for_each_thread(proc, pctx) {
+		int status;
+
+		if (!pctx->running)
+			continue;
+
+		errno = 0;
+		if (syscall(SYS_tgkill, proc->pid, pctx->pid, SIGSTOP) < 0)
+			kplogerror("can't tkill %d\n", pctx->pid);
+
+		while (errno != ESRCH && errno != ECHILD) {
+			ret = waitpid(pctx->pid, &status, __WALL);
+			if (ret < 0)
+				kplogerror("can't wait for %d\n",
+					   pctx->pid);
+
+			if (WIFSTOPPED(status) || WIFEXITED(status) ||
+			    errno == ECHILD)
+				break;
+
+			status = WTERMSIG(status);
+			ret = ptrace(PTRACE_CONT, pctx->pid, NULL,
+				     (void *)(uintptr_t)status);
+			if (ret < 0)
+				kplogerror("Can't continue thread %d\n",
+					   pctx->pid);
+		}
+
+		/* Released thread might have run into a breakpoint */
+		if (pctx->released && WIFSTOPPED(status) &&
+		    WSTOPSIG(status) == SIGTRAP) {
+			struct user_regs_struct regs;
+
+			if (ptrace(PTRACE_GETREGS, pctx->pid, NULL, &regs) == 0 &&
+			    kpatch_ptrace_is_breakpoint(proc, regs.rip)) {
+				regs.rip -= BREAK_INSN_LENGTH;
+				if (ptrace(PTRACE_SETREGS, pctx->pid,
+					   NULL, &regs) < 0)
+					kplogerror("can't set regs - %d\n",
+						   pctx->pid);
+			}
+		}
+
+		pctx->running = 0;
+	}
+}
+
+/* Stop all the threads we have let run, released ones included */
+void kpatch_ptrace_stop_threads(kpatch_process_t *proc)
+{
+	struct kpatch_ptrace_ctx *pctx;
+
+	kpatch_ptrace_stop_running(proc);
+
+	for_each_thread(proc, pctx)
+		pctx->released = 0;
+}
+
+/* Let all the threads run, see kpatch_ptrace_stop_threads */
+int kpatch_ptrace_continue_threads(kpatch_process_t *proc)
+{
+	struct kpatch_ptrace_ctx *pctx;
+	int ret;
+
+	for_each_thread(proc, pctx) {
+		if (pctx->pid == 0 || pctx->running)
+			continue;
+
+		ret = ptrace(PTRACE_CONT, pctx->pid, NULL, NULL);
+		if (ret < 0) {
+			kplogerror("can't start tracee - %d\n", pctx->pid);
+			kpatch_ptrace_stop_threads(proc);
+			return -1;
+		}
+		pctx->running = 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Let the thread run on its own while we deal with others. It is stopped
+ * again by kpatch_ptrace_stop_threads.
+ */
+int kpatch_ptrace_release_thread(struct kpatch_ptrace_ctx *pctx)
+{
+	int ret;
+
+	ret = ptrace(PTRACE_CONT, pctx->pid, NULL, NULL);
+	if (ret < 0) {
+		kplogerror("can't start tracee - %d\n", pctx->pid);
+		return -1;
+	}
+
+	pctx->running = 1;
+	pctx->released = 1;
+	return 0;
+}
+
 struct breakpoint {
 	unsigned long addr;
 	unsigned char orig_code[BREAK_INSN_LENGTH];
@@ -361,8 +746,10 @@ kpatch_ptrace_execute_until(kpatch_process_t *proc,
 	char break_code[] = BREAK_INSN;
 	struct breakpoint *bkpts;
 	size_t has_target, running, to_be_stopped, bkpt_installed, i;
+	size_t caught = 0;
 	sigset_t sigset, oldsigset;
 	struct timespec timeout, start, current;
+	int forever = timeout_msec < 0;
 
 	struct kpatch_ptrace_ctx *pctx;
 
@@ -371,10 +758,10 @@ kpatch_ptrace_execute_until(kpatch_process_t *proc,
 		if (pctx->execute_until != 0UL)
 			has_target++;
 
-	if (has_target == 0)
+	if (has_target == 0 && !(flags & EXECUTE_UNTIL_FORK))
 		return 0;
 
-	bkpts = calloc(has_target, sizeof(*bkpts));
+	bkpts = calloc(has_target ? has_target : 1, sizeof(*bkpts));
 	if (bkpts == NULL)
 		return -1;
 
@@ -397,6 +784,12 @@ kpatch_ptrace_execute_until(kpatch_process_t *proc,
 
 		bkpts[bkpt_installed].addr = pctx->execute_until;
 
+		/* ptrace can't write to the shared text of another object */
+		ret = kpatch_process_unshare_text_at(proc,
+						     pctx->execute_until);
+		if (ret < 0)
+			goto poke_back;
+
 		kpdebug("Installing break at %lx...\n",
 			bkpts[bkpt_installed].addr);
 
@@ -424,6 +817,11 @@ kpatch_ptrace_execute_until(kpatch_process_t *proc,
 	/* Block the SIGCHLD so we can use sigtimedwait */
 	sigemptyset(&sigset);
 	sigaddset(&sigset, SIGCHLD);
+	if (forever) {
+		/* Don't leave breakpoints behind if we are killed */
+		sigaddset(&sigset, SIGINT);
+		sigaddset(&sigset, SIGTERM);
+	}
 	if (sigprocmask(SIG_BLOCK, &sigset, &oldsigset) < 0)
 		goto poke_back;
 
@@ -434,6 +832,10 @@ kpatch_ptrace_execute_until(kpatch_process_t *proc,
 		if (!(flags & EXECUTE_ALL_THREADS) && pctx->execute_until == 0UL)
 			continue;
 
+		/* It's dead or running on its own */
+		if (pctx->pid == 0 || pctx->released)
+			continue;
+
 		ret = ptrace(PTRACE_CONT, pctx->pid, NULL, NULL);
 		if (ret < 0) {
 			kplogerror("can't start tracee - %d\n", pctx->pid);
@@ -443,8 +845,10 @@ kpatch_ptrace_execute_until(kpatch_process_t *proc,
 		running++;
 	}
 
-	to_be_stopped = has_target;
-	while (running != 0 && to_be_stopped != 0 && timeout_msec >= 0) {
+	to_be_stopped = (flags & (EXECUTE_UNTIL_FIRST | EXECUTE_UNTIL_FORK)) ?
+			1 : has_target;
+	while (running != 0 && to_be_stopped != 0 &&
+	       (forever || timeout_msec >= 0)) {
 		int rv, dt;
 
 		timeout.tv_sec = timeout_msec / SEC_TO_MSEC;
@@ -455,7 +859,8 @@ kpatch_ptrace_execute_until(kpatch_process_t *proc,
 			break;
 		}
 
-		rv = kpatch_ptrace_waitpid(proc, &timeout, &sigset);
+		rv = kpatch_ptrace_waitpid(proc, forever ? NULL : &timeout,
+					   &sigset);
 		if (rv < 0)
 			break;
 
@@ -467,8 +872,27 @@ kpatch_ptrace_execute_until(kpatch_process_t *proc,
 		if (rv == 1) {
 			to_be_stopped--;
 			running--;
+			caught++;
 		}
 
+		if (rv == 2) {
+			/* A dead thread can't be the first to hit */
+			if (!(flags & EXECUTE_UNTIL_FIRST))
+				to_be_stopped--;
+			running--;
+		}
+
+		if (rv == 3)
+			running++;
+
+		if (rv == 4 && (flags & EXECUTE_UNTIL_FORK)) {
+			to_be_stopped--;
+			caught++;
+		}
+
+		if (forever)
+			continue;
+
 		dt = (current.tv_sec - start.tv_sec) * SEC_TO_MSEC +
 		     (current.tv_nsec - start.tv_nsec) / MSEC_TO_NSEC;
 
@@ -489,36 +913,8 @@ restore_signals:
 poke_back:
 	errno_save = errno;
 
-	i = 0;
-	for_each_thread(proc, pctx) {
-		int status;
-
-		if (!pctx->running)
-			continue;
-
-		if (syscall(SYS_tgkill, proc->pid, pctx->pid, SIGSTOP) < 0)
-			kplogerror("can't tkill %d\n", pctx->pid);
-
-		while (errno != ESRCH && errno != ECHILD) {
-			ret = waitpid(pctx->pid, &status, __WALL);
-			if (ret < 0)
-				kplogerror("can't wait for %d\n",
-					   pctx->pid);
-
-			if (WIFSTOPPED(status) || WIFEXITED(status) ||
-			    errno == ECHILD)
-				break;
-
-			status = WTERMSIG(status);
-			ret = ptrace(PTRACE_CONT, pctx->pid, NULL,
-				     (void *)(uintptr_t)status);
-			if (ret < 0)
-				kplogerror("Can't continue thread %d\n",
-					   pctx->pid);
-		}
-
-		pctx->running = 0;
-	}
+	/* Released threads must not run into breakpoints being removed */
+	kpatch_ptrace_stop_running(proc);
 
 	for (i = 0; i < bkpt_installed; i++) {
 		ret = kpatch_process_mem_write(
@@ -541,6 +937,10 @@ poke_back:
 		if (pctx->execute_until != 0UL)
 			kpwarn("thread %d still wants to break at 0x%lx\n",
 			       pctx->pid, pctx->execute_until);
+
+		if (pctx->released && pctx->pid != 0 &&
+		    kpatch_ptrace_release_thread(pctx) < 0)
+			pctx->released = 0;
 	}
 
 	free(bkpts);
@@ -550,9 +950,95 @@ poke_back:
 
 	errno = errno_save;
 
+	if ((flags & (EXECUTE_UNTIL_FIRST | EXECUTE_UNTIL_FORK)) && ret == 0)
+		ret = caught != 0;
+
 	return ret;
 }
 
+/*
+ * Make the threads stopped at `addr` execute the original instruction
+ * there, so they don't run into a breakpoint put at `addr` again right
+ * away. The breakpoint must be removed.
+ */
+int kpatch_ptrace_step_over(kpatch_process_t *proc, unsigned long addr)
+{
+	struct kpatch_ptrace_ctx *pctx;
+	struct user_regs_struct regs;
+	int ret, status, sig;
+	siginfo_t si;
+
+	for_each_thread(proc, pctx) {
+		if (pctx->pid == 0 || pctx->running)
+			continue;
+
+		ret = ptrace(PTRACE_GETREGS, pctx->pid, NULL, &regs);
+		if (ret < 0) {
+			kplogerror("can't get regs - %d\n", pctx->pid);
+			return -1;
+		}
+		if (regs.rip != addr)
+			continue;
+
+		kpdebug("Stepping thread %d over %lx\n", pctx->pid, addr);
+		sig = 0;
+		do {
+			ret = ptrace(PTRACE_SINGLESTEP, pctx->pid, NULL,
+				     (void *)(uintptr_t)sig);
+			if (ret < 0) {
+				kplogerror("can't step tracee - %d\n",
+					   pctx->pid);
+				return -1;
+			}
+
+			ret = waitpid(pctx->pid, &status, __WALL);
+			if (ret < 0) {
+				kplogerror("can't wait tracee - %d\n",
+					   pctx->pid);
+				return -1;
+			}
+
+			if (!WIFSTOPPED(status)) {
+				pctx->pid = 0;
+				break;
+			}
+
+			/* Group-stop, it will step once continued */
+			if (ptrace(PTRACE_GETSIGINFO, pctx->pid, NULL, &si) < 0)
+				break;
+
+			/* A signal came in between, deliver it on the step */
+			sig = WSTOPSIG(status);
+			if (sig == SIGSTOP && si.si_code == SI_TKILL &&
+			    si.si_pid == getpid())
+				sig = 0;
+		} while (sig != SIGTRAP);
+	}
+
+	return 0;
+}
+
+int kpatch_ptrace_set_options(kpatch_process_t *proc, int options)
+{
+	struct kpatch_ptrace_ctx *pctx;
+	int ret;
+
+	for_each_thread(proc, pctx) {
+		if (pctx->pid == 0)
+			continue;
+
+		ret = ptrace(PTRACE_SETOPTIONS, pctx->pid, NULL,
+			     (void *)(uintptr_t)options);
+		if (ret < 0) {
+			kplogerror("can't set ptrace options - %d\n",
+				   pctx->pid);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 static void copy_regs(struct user_regs_struct *dst,
 		      struct user_regs_struct *src)
 {
@@ -575,6 +1061,62 @@ static void copy_regs(struct user_regs_struct *dst,
 #undef COPY_REG
 }
 
+/*
+ * Set registers up to `pregs` and `rip`, let `func` drive the execution
+ * and restore the original registers afterwards. The registers the code
+ * stopped with are returned in `pregs`.
+ */
+static int
+execute_remote_regs(struct kpatch_ptrace_ctx *pctx,
+		    unsigned long rip,
+		    struct user_regs_struct *pregs,
+		    int (*func)(struct kpatch_ptrace_ctx *pctx,
+				void *data),
+		    void *data)
+{
+	struct user_regs_struct orig_regs, regs;
+	int ret;
+
+	ret = ptrace(PTRACE_GETREGS, pctx->pid, NULL, &orig_regs);
+	if (ret < 0) {
+		kplogerror("can't get regs - %d\n", pctx->pid);
+		return -1;
+	}
+
+	regs = orig_regs;
+	regs.rip = rip;
+
+	copy_regs(&regs, pregs);
+
+	ret = ptrace(PTRACE_SETREGS, pctx->pid, NULL, &regs);
+	if (ret < 0) {
+		kplogerror("can't set regs - %d\n", pctx->pid);
+		return -1;
+	}
+
+	ret = func(pctx, data);
+	if (ret < 0) {
+		kplogerror("failed call to func\n");
+		goto restore;
+	}
+
+	ret = ptrace(PTRACE_GETREGS, pctx->pid, NULL, &regs);
+	if (ret < 0) {
+		kplogerror("can't get updated regs - %d\n", pctx->pid);
+		goto restore;
+	}
+
+	*pregs = regs;
+
+restore:
+	if (ptrace(PTRACE_SETREGS, pctx->pid, NULL, &orig_regs) < 0) {
+		kplogerror("can't restore regs - %d\n", pctx->pid);
+		ret = -1;
+	}
+
+	return ret;
+}
+
 static
 int
 kpatch_execute_remote_func(struct kpatch_ptrace_ctx *pctx,
@@ -585,17 +1127,11 @@ kpatch_execute_remote_func(struct kpatch_ptrace_ctx *pctx,
 				       void *data),
 			   void *data)
 {
-	struct user_regs_struct orig_regs, regs;
 	unsigned char orig_code[codelen];
 	int ret;
 	kpatch_process_t *proc = pctx->proc;
 	unsigned long libc_base = proc->libc_base;
 
-	ret = ptrace(PTRACE_GETREGS, pctx->pid, NULL, &orig_regs);
-	if (ret < 0) {
-		kplogerror("can't get regs - %d\n", pctx->pid);
-		return -1;
-	}
 	ret = kpatch_process_mem_read(
 			      proc,
 			      libc_base,
@@ -615,36 +1151,7 @@ kpatch_execute_remote_func(struct kpatch_ptrace_ctx *pctx,
 		goto poke_back;
 	}
 
-	regs = orig_regs;
-	regs.rip = libc_base;
-
-	copy_regs(&regs, pregs);
-
-	ret = ptrace(PTRACE_SETREGS, pctx->pid, NULL, &regs);
-	if (ret < 0) {
-		kplogerror("can't set regs - %d\n", pctx->pid);
-		goto poke_back;
-	}
-
-	ret = func(pctx, data);
-	if (ret < 0) {
-		kplogerror("failed call to func\n");
-		goto poke_back;
-	}
-
-	ret = ptrace(PTRACE_GETREGS, pctx->pid, NULL, &regs);
-	if (ret < 0) {
-		kplogerror("can't get updated regs - %d\n", pctx->pid);
-		goto poke_back;
-	}
-
-	ret = ptrace(PTRACE_SETREGS, pctx->pid, NULL, &orig_regs);
-	if (ret < 0) {
-		kplogerror("can't restore regs - %d\n", pctx->pid);
-		goto poke_back;
-	}
-
-	*pregs = regs;
+	ret = execute_remote_regs(pctx, libc_base, pregs, func, data);
 
 poke_back:
 	kpatch_process_mem_write(
@@ -763,6 +1270,67 @@ kpatch_execute_remote(struct kpatch_ptrace_ctx *pctx,
 					  NULL);
 }
 
+/*
+ * Same as wait_for_stop but never delivers a fault caused by the code
+ * we are executing: the patient would die otherwise.
+ */
+static int
+wait_for_stop_nofault(struct kpatch_ptrace_ctx *pctx,
+		      void *data)
+{
+	int ret, status = 0;
+	(void) data;
+	kpdebug("wait_for_stop_nofault(pid=%d)\n", pctx->pid);
+
+	while (1) {
+		ret = ptrace(PTRACE_CONT, pctx->pid, NULL,
+			     (void *)(uintptr_t)status);
+		if (ret < 0) {
+			kplogerror("can't start tracee - %d\n", pctx->pid);
+			return -1;
+		}
+
+		ret = waitpid(pctx->pid, &status, __WALL);
+		if (ret < 0) {
+			kplogerror("can't wait tracee - %d\n", pctx->pid);
+			return -1;
+		}
+
+		if (WIFSTOPPED(status))  {
+			switch (WSTOPSIG(status)) {
+			case SIGSTOP:
+			case SIGTRAP:
+				return 0;
+			case SIGSEGV:
+			case SIGBUS:
+			case SIGILL:
+			case SIGFPE:
+				kperr("remote code got signal %d - %d\n",
+				      WSTOPSIG(status), pctx->pid);
+				return -1;
+			}
+			status = WSTOPSIG(status);
+			continue;
+		}
+
+		kperr("tracee %d is gone\n", pctx->pid);
+		return -1;
+	}
+}
+
+/*
+ * Execute code that is already in the patient's memory at `rip`.
+ * The code must stop itself with an int3.
+ */
+int
+kpatch_execute_remote_at(struct kpatch_ptrace_ctx *pctx,
+			 unsigned long rip,
+			 struct user_regs_struct *pregs)
+{
+	return execute_remote_regs(pctx, rip, pregs,
+				   wait_for_stop_nofault, NULL);
+}
+
 int
 kpatch_ptrace_kickstart_execve_wrapper(struct kpatch_ptrace_ctx *pctx,
 				       int send_fd)
@@ -837,6 +1405,10 @@ static int kpatch_syscall_remote(struct kpatch_ptrace_ctx *pctx, int nr,
 	};
 	int ret;
 
+	if (pctx->proc->agent)
+		return kpatch_agent_syscall(pctx, nr, arg1, arg2, arg3,
+					    arg4, arg5, arg6, res);
+
 	kpdebug("Executing syscall %d (pid %d)...\n", nr, pctx->pid);
 	regs.rax = (unsigned long)nr;
 	regs.rdi = arg1;
@@ -874,6 +1446,62 @@ int kpatch_ptrace_resolve_ifunc(struct kpatch_ptrace_ctx *pctx,
 	return ret;
 }
 
+/*
+ * Call `n` IFUNC resolvers at once. Resolvers addresses are stored into
+ * the remote `scratch` buffer, the trampoline below calls each of them
+ * storing the result back into the buffer which is then read at once.
+ */
+int kpatch_ptrace_resolve_ifuncs(struct kpatch_ptrace_ctx *pctx,
+				 unsigned long scratch,
+				 unsigned long *addrs,
+				 size_t n)
+{
+	struct user_regs_struct regs;
+
+	unsigned char callloop[] = {
+		0x4d, 0x85, 0xe4, /* 1: test %r12, %r12 */
+		0x74, 0x11, /* je 2f */
+		0x48, 0x8b, 0x03, /* mov (%rbx), %rax */
+		0xff, 0xd0, /* call *%rax */
+		0x48, 0x89, 0x03, /* mov %rax, (%rbx) */
+		0x48, 0x83, 0xc3, 0x08, /* add $8, %rbx */
+		0x49, 0xff, 0xcc, /* dec %r12 */
+		0xeb, 0xea, /* jmp 1b */
+		0xcc, /* 2: int3 */
+	};
+	size_t i;
+	int ret;
+
+	if (pctx->proc->agent) {
+		for (i = 0; i < n; i++) {
+			ret = kpatch_agent_call(pctx->proc, addrs[i],
+						&addrs[i]);
+			if (ret < 0)
+				return ret;
+		}
+		return kpatch_agent_flush(pctx);
+	}
+
+	kpdebug("Executing %ld IFUNC resolvers at %lx (pid %d)\n",
+		n, scratch, pctx->pid);
+
+	ret = kpatch_process_mem_write(pctx->proc, addrs, scratch,
+				       n * sizeof(*addrs));
+	if (ret < 0)
+		return ret;
+
+	/* rbx and r12 are callee-saved so resolvers won't clobber them */
+	regs.rbx = scratch;
+	regs.r12 = n;
+
+	ret = kpatch_execute_remote(pctx, callloop, sizeof(callloop), &regs);
+	if (ret < 0)
+		return ret;
+
+	return kpatch_process_mem_read(pctx->proc, scratch, addrs,
+				       n * sizeof(*addrs));
+}
+
 #define MAX_ERRNO	4095
 unsigned long
 kpatch_mmap_remote(struct kpatch_ptrace_ctx *pctx,
@@ -900,6 +1528,49 @@ kpatch_mmap_remote(struct kpatch_ptrace_ctx *pctx,
 	return res;
 }
 
+/* Move `length` bytes mapped at `old_addr` over whatever is at `new_addr` */
+int kpatch_mremap_remote(struct kpatch_ptrace_ctx *pctx,
+			 unsigned long old_addr,
+			 size_t length,
+			 unsigned long new_addr)
+{
+	int ret;
+	unsigned long res;
+
+	kpdebug("mremap_remote: 0x%lx+%lx -> 0x%lx\n", old_addr, length,
+		new_addr);
+	ret = kpatch_syscall_remote(pctx, __NR_mremap, old_addr, length,
+				    length, MREMAP_MAYMOVE | MREMAP_FIXED,
+				    new_addr, 0, &res);
+	if (ret < 0)
+		return -1;
+	if (ret == 0 && res >= (unsigned long)-MAX_ERRNO) {
+		errno = -(long)res;
+		return -1;
+	}
+	return 0;
+}
+
+int kpatch_madvise_remote(struct kpatch_ptrace_ctx *pctx,
+			  unsigned long addr,
+			  size_t length,
+			  int advice)
+{
+	int ret;
+	unsigned long res;
+
+	kpdebug("madvise_remote: 0x%lx+%lx, %d\n", addr, length, advice);
+	ret = kpatch_syscall_remote(pctx, __NR_madvise, (unsigned long)addr,
+				    length, advice, 0, 0, 0, &res);
+	if (ret < 0)
+		return -1;
+	if (ret == 0 && res >= (unsigned long)-MAX_ERRNO) {
+		errno = -(long)res;
+		return -1;
+	}
+	return 0;
+}
+
 int kpatch_munmap_remote(struct kpatch_ptrace_ctx *pctx,
 			 unsigned long addr,
 			 size_t length)
@@ -919,6 +1590,191 @@ int kpatch_munmap_remote(struct kpatch_ptrace_ctx *pctx,
 	return 0;
 }
 
+int kpatch_open_remote(struct kpatch_ptrace_ctx *pctx,
+		       unsigned long path,
+		       int flags)
+{
+	int ret;
+	unsigned long res;
+
+	kpdebug("open_remote: 0x%lx, %x\n", path, flags);
+	ret = kpatch_syscall_remote(pctx, __NR_open, path, flags,
+				    0, 0, 0, 0, &res);
+	if (ret < 0)
+		return -1;
+	if (ret == 0 && res >= (unsigned long)-MAX_ERRNO) {
+		errno = -(long)res;
+		return -1;
+	}
+	return (int)res;
+}
+
+int kpatch_close_remote(struct kpatch_ptrace_ctx *pctx,
+			int fd)
+{
+	int ret;
+	unsigned long res;
+
+	kpdebug("close_remote: %d\n", fd);
+	ret = kpatch_syscall_remote(pctx, __NR_close, fd,
+				    0, 0, 0, 0, 0, &res);
+	if (ret < 0)
+		return -1;
+	if (ret == 0 && res >= (unsigned long)-MAX_ERRNO) {
+		errno = -(long)res;
+		return -1;
+	}
+	return 0;
+}
+
+/* Layout of the scratch page used by kpatch_send_fd_remote */
+struct send_fd_scratch {
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	int sv[2];
+	char data;
+};
+
+/* Borrow the patient's `rfd` via pidfd_getfd(2) */
+static int
+getfd_remote(int pid, int rfd)
+{
+	int pidfd, fd;
+
+	pidfd = syscall(__NR_pidfd_open, pid, 0);
+	if (pidfd < 0)
+		return -1;
+
+	fd = syscall(__NR_pidfd_getfd, pidfd, rfd, 0);
+	close(pidfd);
+	return fd;
+}
+
+/*
+ * Install the doctor's `fd` into the patient and return its number
+ * there. The patient is given the very file the doctor has checked
+ * rather than a path it would resolve in its own mount namespace: the
+ * patient creates a socket pair, the doctor borrows one end and sends
+ * the fd over it with SCM_RIGHTS.
+ */
+int kpatch_send_fd_remote(struct kpatch_ptrace_ctx *pctx, int fd)
+{
+	struct send_fd_scratch sfs;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	unsigned long scratch, res;
+	int lfd = -1, rfd = -1, ret;
+	char data = 0;
+
+	scratch = kpatch_mmap_remote(pctx, 0, PAGE_SIZE,
+				     PROT_READ | PROT_WRITE,
+				     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (scratch == 0) {
+		kplogerror("can't allocate scratch page\n");
+		return -1;
+	}
+
+	memset(&sfs, 0, sizeof(sfs));
+	sfs.sv[0] = sfs.sv[1] = -1;
+	ret = kpatch_syscall_remote(pctx, __NR_socketpair, AF_UNIX,
+				    SOCK_DGRAM | SOCK_CLOEXEC, 0,
+				    scratch + offsetof(struct send_fd_scratch, sv),
+				    0, 0, &res);
+	if (ret != 0 || res >= (unsigned long)-MAX_ERRNO) {
+		kperr("patient can't create socket pair\n");
+		goto out;
+	}
+
+	if (kpatch_process_mem_read(pctx->proc,
+				    scratch + offsetof(struct send_fd_scratch, sv),
+				    sfs.sv, sizeof(sfs.sv)) < 0) {
+		kplogerror("can't read patient's socket pair\n");
+		sfs.sv[0] = sfs.sv[1] = -1;
+		goto out;
+	}
+
+	lfd = getfd_remote(pctx->proc->pid, sfs.sv[0]);
+	if (lfd < 0) {
+		kplogerror("can't get patient's socket\n");
+		goto out;
+	}
+
+	iov.iov_base = &data;
+	iov.iov_len = sizeof(data);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	if (sendmsg(lfd, &msg, 0) < 0) {
+		kplogerror("can't send fd to patient\n");
+		goto out;
+	}
+
+	/* Same message as seen by the patient */
+	sfs.iov.iov_base = (void *)(scratch +
+		offsetof(struct send_fd_scratch, data));
+	sfs.iov.iov_len = sizeof(sfs.data);
+	sfs.msg.msg_iov = (void *)(scratch +
+		offsetof(struct send_fd_scratch, iov));
+	sfs.msg.msg_iovlen = 1;
+	sfs.msg.msg_control = (void *)(scratch +
+		offsetof(struct send_fd_scratch, ctl));
+	sfs.msg.msg_controllen = sizeof(sfs.ctl.buf);
+
+	if (kpatch_process_mem_write(pctx->proc, &sfs, scratch,
+				     sizeof(sfs)) < 0) {
+		kplogerror("can't write message header\n");
+		goto out;
+	}
+
+	ret = kpatch_syscall_remote(pctx, __NR_recvmsg, sfs.sv[1], scratch,
+				    MSG_CMSG_CLOEXEC, 0, 0, 0, &res);
+	if (ret != 0 || res >= (unsigned long)-MAX_ERRNO ||
+	    kpatch_process_mem_read(pctx->proc, scratch, &sfs,
+				    sizeof(sfs)) < 0) {
+		kperr("patient can't receive fd\n");
+		goto out;
+	}
+
+	/* Point the header to our copy of the control data to parse it */
+	sfs.msg.msg_control = sfs.ctl.buf;
+	cmsg = CMSG_FIRSTHDR(&sfs.msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+		kperr("patient got no fd\n");
+		goto out;
+	}
+	memcpy(&rfd, CMSG_DATA(cmsg), sizeof(int));
+
+out:
+	if (lfd >= 0)
+		close(lfd);
+	if (sfs.sv[0] >= 0)
+		kpatch_close_remote(pctx, sfs.sv[0]);
+	if (sfs.sv[1] >= 0)
+		kpatch_close_remote(pctx, sfs.sv[1]);
+	if (kpatch_munmap_remote(pctx, scratch, PAGE_SIZE) < 0)
+		kplogerror("can't unmap scratch page\n");
+	return rfd;
+}
+
 int kpatch_arch_prctl_remote(struct kpatch_ptrace_ctx *pctx, int code, unsigned long *addr)
 {
 	struct user_regs_struct regs;
@@ -2,12 +2,17 @@
 #define __KPATCH_PTRACE_H__
 
 #include <sys/user.h>
+#include <sys/mman.h>
 
 #include "list.h"
 
 struct kpatch_ptrace_ctx {
 	int pid;
 	int running;
+	/* Let run on its own, kpatch_ptrace_execute_until leaves it alone */
+	int released;
+	/* Attached by PTRACE_O_TRACECLONE, its first SIGSTOP isn't a real one */
+	int initial_stop;
 	unsigned long execute_until;
 	kpatch_process_t *proc;
 	struct list_head list;
@@ -62,17 +67,37 @@ int kpatch_ptrace_get_entry_point(struct kpatch_ptrace_ctx *pctx,
 
 #define EXECUTE_ALL_THREADS	(1 << 0) /* execute all threads not just these
 					    having non-zero execute_until */
+#define EXECUTE_UNTIL_FIRST	(1 << 1) /* stop all threads once any of them
+					    hits its execute_until, return 1
+					    if any did */
+#define EXECUTE_UNTIL_FORK	(1 << 2) /* stop all threads once a forked child
+					    stops, return 1 if any did */
+/* Negative timeout_msec means wait until SIGINT/SIGTERM */
 int kpatch_ptrace_execute_until(kpatch_process_t *proc,
 				int timeout_msec,
 				int flags);
 
+int kpatch_ptrace_set_options(kpatch_process_t *proc, int options);
+int kpatch_ptrace_step_over(kpatch_process_t *proc, unsigned long addr);
+int kpatch_ptrace_continue_threads(kpatch_process_t *proc);
+int kpatch_ptrace_release_thread(struct kpatch_ptrace_ctx *pctx);
+void kpatch_ptrace_stop_threads(kpatch_process_t *proc);
+int kpatch_ptrace_release_child(kpatch_process_t *proc, int pid, int sig);
+
 int kpatch_execute_remote(struct kpatch_ptrace_ctx *pctx,
 			  const unsigned char *code,
 			  size_t codelen,
 			  struct user_regs_struct *pregs);
+int kpatch_execute_remote_at(struct kpatch_ptrace_ctx *pctx,
+			     unsigned long rip,
+			     struct user_regs_struct *pregs);
 
 int kpatch_ptrace_resolve_ifunc(struct kpatch_ptrace_ctx *pctx,
 				unsigned long *addr);
+int kpatch_ptrace_resolve_ifuncs(struct kpatch_ptrace_ctx *pctx,
+				 unsigned long scratch,
+				 unsigned long *addrs,
+				 size_t n);
 unsigned long
 kpatch_mmap_remote(struct kpatch_ptrace_ctx *pctx,
 		   unsigned long addr,
@@ -85,6 +110,26 @@ int
 kpatch_munmap_remote(struct kpatch_ptrace_ctx *pctx,
 		     unsigned long addr,
 		     size_t length);
+int
+kpatch_mremap_remote(struct kpatch_ptrace_ctx *pctx,
+		     unsigned long old_addr,
+		     size_t length,
+		     unsigned long new_addr);
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE	25
+#endif
+
+int
+kpatch_madvise_remote(struct kpatch_ptrace_ctx *pctx,
+		      unsigned long addr,
+		      size_t length,
+		      int advice);
+int kpatch_open_remote(struct kpatch_ptrace_ctx *pctx,
+		       unsigned long path,
+		       int flags);
+int kpatch_close_remote(struct kpatch_ptrace_ctx *pctx,
+			int fd);
+int kpatch_send_fd_remote(struct kpatch_ptrace_ctx *pctx, int fd);
 int kpatch_arch_prctl_remote(struct kpatch_ptrace_ctx *pctx, int code, unsigned long *addr);
 
 int
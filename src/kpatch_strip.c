@@ -7,6 +7,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <getopt.h>
+#include <stddef.h>
 #include "kpatch_file.h"
 #include "kpatch_common.h"
 
@@ -23,6 +24,9 @@
 #define MODE_REL_FIXUP 4
 #define MODE_UNDO_LINK 5
 
+/* Keep references to the original object indirect, see usage() */
+static int pic;
+
 int need_section(char *name)
 {
 	if (strstr(name, "kpatch"))
@@ -95,8 +99,218 @@ static size_t process_kpatch_info(Elf_Scn *scnout, GElf_Shdr *hdr)
 	return KPATCH_INFO_LAST_SIZE;
 }
 
+#define CALL_INSN	0xe8
+#define CALLS_SECTION	".kpatch.calls"
+
+static int is_patched_func(unsigned long *daddrs, size_t ndaddrs,
+			   unsigned long addr)
+{
+	size_t i;
+
+	for (i = 0; i < ndaddrs; i++)
+		if (daddrs[i] == addr)
+			return 1;
+	return 0;
+}
+
+/*
+ * Addresses of the functions being patched. The `daddr` fields of
+ * `.kpatch.info` are relocated against them, the relocations are kept
+ * because of `-q`.
+ */
+static unsigned long *
+kpatch_find_patched_funcs(Elf *elfin, size_t shstridx, size_t *pndaddrs)
+{
+	unsigned long *daddrs = NULL;
+	Elf_Scn *scn = NULL, *tscn, *symscn;
+	Elf_Data *data, *symdata;
+	GElf_Shdr sh, tsh;
+	size_t ndaddrs = 0, i;
+
+	while ((scn = elf_nextscn(elfin, scn)) != NULL) {
+		if (!gelf_getshdr(scn, &sh))
+			kpfatalerror("gelf_getshdr");
+		if (sh.sh_type != SHT_RELA)
+			continue;
+
+		tscn = elf_getscn(elfin, sh.sh_info);
+		if (tscn == NULL || !gelf_getshdr(tscn, &tsh))
+			kpfatalerror("gelf_getshdr target");
+		if (strcmp(elf_strptr(elfin, shstridx, tsh.sh_name),
+			   ".kpatch.info"))
+			continue;
+
+		symscn = elf_getscn(elfin, sh.sh_link);
+		data = elf_getdata(scn, NULL);
+		symdata = symscn ? elf_getdata(symscn, NULL) : NULL;
+		if (data == NULL || symdata == NULL)
+			kpfatalerror("elf_getdata/info");
+
+		for (i = 0; i < sh.sh_size / sh.sh_entsize; i++) {
+			GElf_Rela rela;
+			GElf_Sym sym;
+
+			if (!gelf_getrela(data, i, &rela))
+				kpfatalerror("gelf_getrela");
+			if (GELF_R_TYPE(rela.r_info) != R_X86_64_64 ||
+			    (rela.r_offset - tsh.sh_addr) %
+			    sizeof(struct kpatch_info) !=
+			    offsetof(struct kpatch_info, daddr))
+				continue;
+			if (!gelf_getsym(symdata, GELF_R_SYM(rela.r_info), &sym))
+				kpfatalerror("gelf_getsym");
+
+			daddrs = realloc(daddrs, (ndaddrs + 1) * sizeof(*daddrs));
+			if (daddrs == NULL)
+				kpfatalerror("realloc");
+			daddrs[ndaddrs++] = sym.st_value + rela.r_addend;
+		}
+	}
+
+	*pndaddrs = ndaddrs;
+	return daddrs;
+}
+
+/*
+ * Find direct calls to the functions being patched in the original code.
+ * The patched binary is linked with `-q`, so its relocations tell which
+ * `e8` bytes are the call instructions indeed. The original code is laid
+ * out the same way in it, so the addresses are the original's ones.
+ */
+static struct kpatch_call_site *
+kpatch_find_call_sites(Elf *elfin, size_t shstridx, size_t *pncalls)
+{
+	struct kpatch_call_site *calls = NULL;
+	unsigned long *daddrs;
+	Elf_Scn *scn = NULL, *tscn;
+	Elf_Data *data, *tdata;
+	GElf_Shdr sh, tsh;
+	size_t ndaddrs, ncalls = 0, i;
+
+	daddrs = kpatch_find_patched_funcs(elfin, shstridx, &ndaddrs);
+	if (ndaddrs == 0)
+		goto out;
+
+	while ((scn = elf_nextscn(elfin, scn)) != NULL) {
+		if (!gelf_getshdr(scn, &sh))
+			kpfatalerror("gelf_getshdr");
+		if (sh.sh_type != SHT_RELA)
+			continue;
+
+		tscn = elf_getscn(elfin, sh.sh_info);
+		if (tscn == NULL || !gelf_getshdr(tscn, &tsh))
+			kpfatalerror("gelf_getshdr target");
+		if (!(tsh.sh_flags & SHF_EXECINSTR) || tsh.sh_type != SHT_PROGBITS ||
+		    strstr(elf_strptr(elfin, shstridx, tsh.sh_name), "kpatch"))
+			continue;
+
+		data = elf_getdata(scn, NULL);
+		tdata = elf_getdata(tscn, NULL);
+		if (data == NULL || tdata == NULL)
+			kpfatalerror("elf_getdata");
+
+		for (i = 0; i < sh.sh_size / sh.sh_entsize; i++) {
+			unsigned char *loc;
+			unsigned long off, target;
+			GElf_Rela rela;
+
+			if (!gelf_getrela(data, i, &rela))
+				kpfatalerror("gelf_getrela");
+			if (GELF_R_TYPE(rela.r_info) != R_X86_64_PC32 &&
+			    GELF_R_TYPE(rela.r_info) != R_X86_64_PLT32)
+				continue;
+
+			off = rela.r_offset - tsh.sh_addr;
+			if (off < 1 || off + sizeof(int) > tdata->d_size)
+				continue;
+			loc = tdata->d_buf + off;
+			if (loc[-1] != CALL_INSN)
+				continue;
+
+			/* The linked displacement, PLT stubs don't match */
+			target = rela.r_offset + sizeof(int) + *(int *)loc;
+			if (!is_patched_func(daddrs, ndaddrs, target))
+				continue;
+
+			calls = realloc(calls, (ncalls + 1) * sizeof(*calls));
+			if (calls == NULL)
+				kpfatalerror("realloc");
+			calls[ncalls].site = rela.r_offset - 1;
+			calls[ncalls].daddr = target;
+			ncalls++;
+		}
+	}
+
+	kpinfo("%ld direct calls to the patched functions\n", ncalls);
+out:
+	free(daddrs);
+	*pncalls = ncalls;
+	return calls;
+}
+
+static size_t add_section_name(Elf_Scn *scnout, GElf_Shdr *hdr,
+			       const char *name)
+{
+	Elf_Data *data = elf_newdata(scnout);
+
+	if (!data)
+		kpfatalerror("elf_newdata/shstrtab");
+
+	data->d_align = 1;
+	data->d_buf = (void *)name;
+	data->d_off = hdr->sh_size;
+	data->d_size = strlen(name) + 1;
+	data->d_type = ELF_T_BYTE;
+	data->d_version = EV_CURRENT;
+
+	hdr->sh_size += data->d_size;
+
+	return data->d_size;
+}
+
+static Elf64_Off
+add_calls_section(Elf *elfout, size_t name, Elf64_Off off,
+		  struct kpatch_call_site *calls, size_t ncalls)
+{
+	Elf_Scn *scnout;
+	Elf_Data *data;
+	GElf_Shdr shout;
+
+	scnout = elf_newscn(elfout);
+	if (!scnout)
+		kpfatalerror("elf_newscn");
+	if (!gelf_getshdr(scnout, &shout))
+		kpfatalerror("gelf_getshdr out");
+
+	data = elf_newdata(scnout);
+	if (!data)
+		kpfatalerror("elf_newdata/calls");
+	data->d_align = 8;
+	data->d_buf = calls;
+	data->d_off = 0;
+	data->d_size = ncalls * sizeof(*calls);
+	data->d_type = ELF_T_BYTE;
+	data->d_version = EV_CURRENT;
+
+	memset(&shout, 0, sizeof(shout));
+	shout.sh_name = name;
+	shout.sh_type = SHT_PROGBITS;
+	shout.sh_addralign = 8;
+	shout.sh_entsize = sizeof(*calls);
+	shout.sh_offset = ALIGN(off, 8);
+	shout.sh_size = data->d_size;
+	if (!gelf_update_shdr(scnout, &shout))
+		kpfatalerror("gelf_update_shdr calls");
+	if (!elf_flagscn(scnout, ELF_C_SET, ELF_F_DIRTY))
+		kpfatalerror("elf_flagscn");
+
+	return shout.sh_offset + shout.sh_size;
+}
+
 static int kpatch_strip(Elf *elfin, Elf *elfout)
 {
+	struct kpatch_call_site *calls;
+	size_t ncalls, calls_name = 0;
 	GElf_Ehdr ehin, ehout;
 	Elf_Scn *scnin = NULL, *scnout = NULL;
 	Elf_Data *dataout;
@@ -123,6 +337,7 @@ static int kpatch_strip(Elf *elfin, Elf *elfout)
 
 	if (_elf_getshdrstrndx(elfin, &shstridx))
 		kpfatalerror("elf_getshdrstrndx");
+	calls = kpatch_find_call_sites(elfin, shstridx, &ncalls);
 	while ((scnin = elf_nextscn(elfin, scnin)) != NULL) {
 		scnout = elf_newscn(elfout);
 		if (!scnout)
@@ -150,6 +365,11 @@ static int kpatch_strip(Elf *elfin, Elf *elfout)
 			off += shin.sh_size;
 			if (!strcmp(scnname, ".kpatch.info"))
 				off += process_kpatch_info(scnout, &shout);
+			if (elf_ndxscn(scnin) == shstridx && ncalls) {
+				calls_name = shout.sh_size;
+				off += add_section_name(scnout, &shout,
+							CALLS_SECTION);
+			}
 		} else {
 			kpinfo("don't need it\n");
 			shout.sh_type = SHT_NOBITS;
@@ -159,6 +379,9 @@ static int kpatch_strip(Elf *elfin, Elf *elfout)
 		if (!elf_flagscn(scnout, ELF_C_SET, ELF_F_DIRTY))
 			kpfatalerror("elf_flagscn");
 	}
+	if (ncalls)
+		off = add_calls_section(elfout, calls_name, off,
+					calls, ncalls);
 	off = ALIGN(off, 8);
 	ehout.e_shoff = off;
 
@@ -170,6 +393,7 @@ static int kpatch_strip(Elf *elfin, Elf *elfout)
 		kpfatalerror("elf_update");
 	if (elf_end(elfout))
 		kpfatalerror("elf_end");
+	free(calls);
 	return 0;
 }
 
@@ -553,11 +777,13 @@ kpatch_fixup_rela_one(kpatch_objinfo *origbin,
 	 *	lea	symbol@GOTPCREL(%rip), %reg
 	 *	mov	(%reg), %reg
 	 *
+	 * Unless the patch is position-independent: the code must not depend
+	 * on the distance to original then and the doctor fills a GOT entry.
 	 */
 #define	MOV_INSN	0x8b
 #define	LEA_INSN	0x8d
 
-	if (sym->st_shndx != SHN_UNDEF) {
+	if (sym->st_shndx != SHN_UNDEF && !pic) {
 		unsigned long off;
 		switch (GELF_R_TYPE(rel->r_info)) {
 		case R_X86_64_GOTPCREL:
@@ -931,6 +1157,9 @@ int usage(void)
 	fprintf(stderr, "  kpatch_strip [options] -s/--strip <src.ko> <dst.ko>\n");
 	fprintf(stderr, "  kpatch_strip [options] -r/--rel-fixup <orig-bin> <patch.o>\n");
 	fprintf(stderr, "  kpatch_strip [options] -u/--undo-link <patch.o>\n");
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, "  -p/--pic  don't turn GOT loads of the original's symbols into direct\n");
+	fprintf(stderr, "            references, for patches made with `kpatch_gensrc --pic`\n");
 	return -1;
 }
 
@@ -942,6 +1171,7 @@ struct option long_opts[] = {
 	{"strip", 0, NULL, 's'},
 	{"rel-fixup", 0, NULL, 'r'},
 	{"undo-link", 0, NULL, 'u'},
+	{"pic", 0, NULL, 'p'},
 	{NULL, 0, NULL, 0}
 };
 
@@ -958,7 +1188,7 @@ int main(int argc, char *argv[])
 	Elf *elf1 = NULL, *elf2 = NULL;
 	int ch, mode = 0;
 
-	while ((ch = getopt_long(argc, argv, "+o:sru", long_opts, 0)) != -1) {
+	while ((ch = getopt_long(argc, argv, "+o:srup", long_opts, 0)) != -1) {
 		switch (ch) {
 		case 's':
 			SET_MODE(MODE_STRIP);
@@ -969,6 +1199,9 @@ int main(int argc, char *argv[])
 		case 'u':
 			SET_MODE(MODE_UNDO_LINK);
 			break;
+		case 'p':
+			pic = 1;
+			break;
 		default:
 			return usage();
 		}
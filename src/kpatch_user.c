@@ -6,10 +6,14 @@
 #include <string.h>
 #include <dirent.h>
 #include <regex.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/fcntl.h>
 #include <sys/mman.h>
 #include <sys/vfs.h>
 #include <sys/stat.h>
+#include <sys/ptrace.h>
+#include <link.h>
 
 #include <gelf.h>
 #include <libunwind.h>
@@ -20,7 +24,9 @@
 #include "kpatch_file.h"
 #include "kpatch_common.h"
 #include "kpatch_elf.h"
+#include "kpatch_crc32c.h"
 #include "kpatch_ptrace.h"
+#include "kpatch_agent.h"
 #include "list.h"
 #include "kpatch_log.h"
 
@@ -66,6 +72,28 @@ patch_file_verify(struct kp_file *kpfile)
 		      k->modulename);
 		return -1;
 	}
+	if (k->version >= KPATCH_FILE_VERSION2) {
+		GElf_Shdr *shdr = (void *)hdr + hdr->e_shoff;
+		uint32_t csum;
+
+		csum = kpatch_crc32c(0, hdr, k->total_size - k->kpatch_offset);
+		if (csum != k->csum) {
+			kperr("'%s' patch is invalid: Checksum mismatch: %08x/%08x\n",
+			      k->modulename, csum, k->csum);
+			return -1;
+		}
+		if (hdr->e_shoff + hdr->e_shnum * sizeof(*shdr) >
+		    k->total_size - k->kpatch_offset ||
+		    k->sec_info >= hdr->e_shnum ||
+		    k->sec_text >= hdr->e_shnum ||
+		    k->sec_symtab >= hdr->e_shnum ||
+		    k->sec_calls >= hdr->e_shnum ||
+		    shdr[k->sec_symtab].sh_type != SHT_SYMTAB) {
+			kperr("'%s' patch is invalid: Wrong section directory\n",
+			      k->modulename);
+			return -1;
+		}
+	}
 	kpdebug("OK\n");
 	return 1;
 }
@@ -100,6 +128,8 @@ storage_init(kpatch_storage_t *storage,
 			goto out_close;
 
 		ret = patch_file_verify(&storage->kpfile);
+		if (ret >= 0)
+			ret = kpatch_elf_compact_patch(&storage->kpfile);
 		if (ret < 0) {
 			kpatch_close_file(&storage->kpfile);
 			goto out_close;
@@ -123,6 +153,7 @@ free_storage_patch_cb(struct rb_node *node)
 	struct kpatch_storage_patch *patch;
 
 	patch = rb_entry(node, struct kpatch_storage_patch, node);
+	kpatch_reloc_tmpl_free(patch->kpfile.tmpl);
 	kpatch_close_file(&patch->kpfile);
 
 	free(patch);
@@ -134,6 +165,8 @@ storage_free(kpatch_storage_t *storage)
 	close(storage->patch_fd);
 	if (storage->is_patch_dir)
 		rb_destroy(&storage->tree, free_storage_patch_cb);
+	else
+		kpatch_reloc_tmpl_free(storage->kpfile.tmpl);
 	free(storage->path);
 }
 
@@ -196,6 +229,8 @@ storage_open_patch(kpatch_storage_t *storage,
 		rv = kpatch_openat_file(storage->patch_fd, fname, &patch->kpfile);
 		if (rv == 0) {
 			rv = patch_file_verify(&patch->kpfile);
+			if (rv >= 0)
+				rv = kpatch_elf_compact_patch(&patch->kpfile);
 
 			if (rv < 0)
 				kpatch_close_file(&patch->kpfile);
@@ -483,6 +518,12 @@ patch_verify_safety(struct object_file *o,
 	list_for_each_entry(p, &o->proc->ptrace.pctxs, list) {
 		void *upt;
 
+		/* Released threads were found safe and can't be unwound */
+		if (p->released) {
+			nr++;
+			continue;
+		}
+
 		kpdebug("Verifying safety for pid %d...", p->pid);
 		upt = _UPT_create(p->pid);
 		if (!upt) {
@@ -575,6 +616,66 @@ patch_ensure_safety(struct object_file *o,
 	return ret ? -1 : 0;
 }
 
+/*
+ * Same as patch_ensure_safety for KPATCH_SAFETY_METHOD_FREEZE_CONFLICT.
+ * Threads not executing functions to be patched are released right after
+ * the check so only the conflicting ones are held and continued until
+ * they are out. Main thread is always held, we execute code with it.
+ *
+ * Released threads keep running until kpatch_ptrace_stop_threads.
+ */
+static int
+patch_ensure_safety_conflict(struct object_file *o)
+{
+	struct kpatch_ptrace_ctx *p, *main = proc2pctx(o->proc);
+	unsigned long ret, *retips;
+	size_t nr = 0, nreleased = 0, i;
+
+	list_for_each_entry(p, &o->proc->ptrace.pctxs, list)
+		nr++;
+	retips = calloc(nr, sizeof(unsigned long));
+	if (retips == NULL)
+		return -1;
+
+	ret = patch_verify_safety(o, retips, ACTION_APPLY_PATCH);
+	if (ret == (unsigned long)-1 || (ret & KPATCH_CORO_STACK_UNSAFE))
+		goto out;
+
+	i = 0;
+	list_for_each_entry(p, &o->proc->ptrace.pctxs, list) {
+		p->execute_until = retips[i++];
+		if (p == main || p->execute_until != 0UL)
+			continue;
+
+		if (kpatch_ptrace_release_thread(p) < 0) {
+			ret = -1;
+			goto out;
+		}
+		nreleased++;
+	}
+
+	kpinfo("%s: %lu of %zu thread(s) conflict with the patch\n",
+	       o->name, ret, nr);
+	kpdebug("%zu thread(s) released\n", nreleased);
+
+	if (ret) {
+		ret = kpatch_ptrace_execute_until(o->proc, 3000, 0);
+
+		/* OK, at this point we may have new threads, discover them */
+		if (ret == 0)
+			ret = kpatch_process_attach(o->proc);
+		if (ret == 0)
+			ret = patch_verify_safety(o, NULL, ACTION_APPLY_PATCH);
+	}
+
+out:
+	free(retips);
+	if (ret)
+		kpatch_ptrace_stop_threads(o->proc);
+
+	return ret ? -1 : 0;
+}
+
 /*****************************************************************************
  * Patch application subroutines and cmd_patch_user
  ****************************************************************************/
@@ -586,32 +687,47 @@ patch_ensure_safety(struct object_file *o,
 
 #define HUNK_SIZE 5
 
+static int
+patch_stash_hunk(struct object_file *o, size_t nhunk)
+{
+	struct kpatch_info *info = &o->info[nhunk];
+	unsigned long pundo;
+
+	pundo = o->kpta + o->kpfile.patch->user_undo + nhunk * HUNK_SIZE;
+	kpinfo("%s origcode from 0x%lx+0x%x to 0x%lx\n",
+	       o->name, info->daddr, HUNK_SIZE, pundo);
+	return kpatch_agent_memcpy(o->proc, pundo,
+				   info->daddr, HUNK_SIZE);
+}
+
+static inline void
+patch_hunk_code(struct kpatch_info *info, char *code)
+{
+	code[0] = 0xe9; /* jmp IMM */
+	*(unsigned int *)(code + 1) = (unsigned int)(info->saddr - info->daddr - 5);
+}
+
 static int
 patch_apply_hunk(struct object_file *o, size_t nhunk)
 {
 	int ret;
-	char code[HUNK_SIZE] = {0xe9, 0x00, 0x00, 0x00, 0x00}; /* jmp IMM */
+	char code[HUNK_SIZE];
 	struct kpatch_info *info = &o->info[nhunk];
-	unsigned long pundo;
 
 	if (is_new_func(info))
 		return 0;
 
-	pundo = o->kpta + o->kpfile.patch->user_undo + nhunk * HUNK_SIZE;
-	kpinfo("%s origcode from 0x%lx+0x%x to 0x%lx\n",
-	       o->name, info->daddr, HUNK_SIZE, pundo);
-	ret = kpatch_process_memcpy(o->proc, pundo,
-				    info->daddr, HUNK_SIZE);
+	ret = patch_stash_hunk(o, nhunk);
 	if (ret < 0)
 		return ret;
 
 	kpinfo("%s hunk 0x%lx+0x%x -> 0x%lx+0x%x\n",
 	       o->name, info->daddr, info->dlen, info->saddr, info->slen);
-	*(unsigned int *)(code + 1) = (unsigned int)(info->saddr - info->daddr - 5);
-	ret = kpatch_process_mem_write(o->proc,
-				       code,
-				       info->daddr,
-				       sizeof(code));
+	patch_hunk_code(info, code);
+	ret = kpatch_agent_write(o->proc,
+				 code,
+				 info->daddr,
+				 sizeof(code));
 	/*
 	 * NOTE(pboldin): This is only stored locally, as information have
 	 * been copied to patient's memory already.
@@ -620,187 +736,1634 @@ patch_apply_hunk(struct object_file *o, size_t nhunk)
 	return ret ? -1 : 0;
 }
 
+/*
+ * Mark hunks of `o` not applied yet whose functions are on the stack
+ * `cur` as `busy`. If `retip` is given, the address the innermost of
+ * these functions returns to is stored there.
+ */
 static int
-duplicate_kp_file(struct object_file *o)
+object_find_busy_hunks_single(struct object_file *o,
+			      unw_cursor_t *cur,
+			      char *busy,
+			      unsigned long *retip)
 {
-	struct kpatch_file *patch;
+	unw_word_t ip;
+	struct kpatch_info *info = o->info;
+	size_t i, ninfo = o->ninfo;
+	int prev = 0, found = 0;
 
-	patch = malloc(o->skpfile->size);
-	if (patch == NULL)
-		return -1;
+	if (retip)
+		*retip = 0;
 
-	memcpy(patch, o->skpfile->patch, o->skpfile->size);
-	o->kpfile.patch = patch;
-	o->kpfile.size = o->skpfile->size;
+	do {
+		unw_get_reg(cur, UNW_REG_IP, &ip);
 
-	return 0;
+		for (i = 0; i < ninfo; i++) {
+			if (is_new_func(&info[i]) ||
+			    (info[i].flags & PATCH_APPLIED))
+				continue;
+
+			if (is_addr_in_info((long)ip, &info[i],
+					    ACTION_APPLY_PATCH))
+				break;
+		}
+
+		if (i != ninfo) {
+			busy[i] = 1;
+			found = 1;
+			prev = 1;
+			continue;
+		}
+
+		if (prev && retip && *retip == 0)
+			*retip = ip;
+		prev = 0;
+	} while (unw_step(cur) > 0);
+
+	return found;
 }
 
+/*
+ * Same as patch_verify_safety but per hunk: marks hunks being executed by
+ * any thread or coroutine as `busy`. Returns number of the threads and
+ * coroutines the hunks are busy with or -1 on error.
+ */
 static int
-object_apply_patch(struct object_file *o)
+patch_find_busy_hunks(struct object_file *o,
+		      char *busy,
+		      unsigned long *retips)
 {
-	struct kpatch_file *kp;
-	size_t sz, i;
-	int undef, ret;
+	struct kpatch_ptrace_ctx *p;
+	struct kpatch_coro *c;
+	unw_cursor_t cur;
+	size_t nr = 0;
+	int ret, found = 0;
 
-	if (o->skpfile == NULL || o->is_patch)
-		return 0;
+	list_for_each_entry(c, &o->proc->coro.coros, list) {
+		void *ucoro;
 
-	if (o->applied_patch) {
-		kpinfo("Object '%s' already have a patch, not patching\n",
-		       o->name);
-		return 0;
-	}
+		ucoro = _UCORO_create(c, proc2pctx(o->proc)->pid);
+		if (!ucoro) {
+			kplogerror("can't create unwind coro context\n");
+			return -1;
+		}
 
-	ret = duplicate_kp_file(o);
-	if (ret < 0) {
-		kplogerror("can't duplicate kp_file\n");
-		return -1;
+		ret = unw_init_remote(&cur, o->proc->coro.unwd, ucoro);
+		if (ret) {
+			kplogerror("can't create unwind remote context\n");
+			_UCORO_destroy(ucoro);
+			return -1;
+		}
+
+		found += object_find_busy_hunks_single(o, &cur, busy, NULL);
+		_UCORO_destroy(ucoro);
 	}
 
-	ret = kpatch_elf_load_kpatch_info(o);
-	if (ret < 0)
-		return ret;
+	list_for_each_entry(p, &o->proc->ptrace.pctxs, list) {
+		void *upt;
 
-	kp = o->kpfile.patch;
+		upt = _UPT_create(p->pid);
+		if (!upt) {
+			kplogerror("can't create unwind ptrace context\n");
+			return -1;
+		}
 
-	sz = ROUND_UP(kp->total_size, 8);
-	undef = kpatch_count_undefined(o);
-	if (undef) {
-		o->jmp_table = kpatch_new_jmp_table(undef);
-		kp->jmp_offset = sz;
-		kpinfo("Jump table %d bytes for %d syms at offset 0x%x\n",
-		       o->jmp_table->size, undef, kp->jmp_offset);
-		sz = ROUND_UP(sz + o->jmp_table->size, 128);
+		ret = unw_init_remote(&cur, o->proc->ptrace.unwd, upt);
+		if (ret) {
+			kplogerror("can't create unwind remote context\n");
+			_UPT_destroy(upt);
+			return -1;
+		}
+
+		found += object_find_busy_hunks_single(o, &cur, busy,
+						       &retips[nr]);
+		_UPT_destroy(upt);
+		nr++;
 	}
 
-	kp->user_info = (unsigned long)o->info -
-			(unsigned long)o->kpfile.patch;
-	kp->user_undo = sz;
-	sz = ROUND_UP(sz + HUNK_SIZE * o->ninfo, 16);
+	return found;
+}
 
-	sz = ROUND_UP(sz, 4096);
+#define LAZY_DEADLINE_MSEC	3000
 
-	/*
-	 * Map patch as close to the original code as possible.
-	 * Otherwise we can't use 32-bit jumps.
-	 */
-	ret = kpatch_object_allocate_patch(o, sz);
-	if (ret < 0)
-		return ret;
-	ret = kpatch_resolve(o);
-	if (ret < 0)
-		return ret;
-	ret = kpatch_relocate(o);
-	if (ret < 0)
-		return ret;
-	ret = kpatch_process_mem_write(o->proc,
-				       kp,
-				       o->kpta,
-				       kp->total_size);
-	if (ret < 0)
+/*
+ * Apply hunks of `o` one by one as soon as their functions are not
+ * executed by anyone. Free hunks are applied right away, then threads
+ * executing busy ones are continued until the first of them returns from
+ * such a function and the remaining hunks are checked again. Everything
+ * must be applied within LAZY_DEADLINE_MSEC.
+ */
+static int
+patch_apply_hunks_lazy(struct object_file *o)
+{
+	struct kpatch_ptrace_ctx *p;
+	struct timespec start, now;
+	unsigned long *retips = NULL;
+	char *busy = NULL;
+	size_t nr, i;
+	int ret = -1, nbusy, elapsed, waiting;
+
+	busy = malloc(o->ninfo);
+	if (busy == NULL)
 		return -1;
-	if (o->jmp_table) {
-		ret = kpatch_process_mem_write(o->proc,
-					       o->jmp_table,
-					       o->kpta + kp->jmp_offset,
-					       o->jmp_table->size);
-		if (ret < 0)
-			return ret;
-	}
 
-	ret = patch_ensure_safety(o, ACTION_APPLY_PATCH);
-	if (ret < 0)
-		return ret;
+	if (clock_gettime(CLOCK_MONOTONIC, &start) < 0)
+		goto out;
 
-	for (i = 0; i < o->ninfo; i++) {
-		ret = patch_apply_hunk(o, i);
-		if (ret < 0)
-			return ret;
-	}
+	while (1) {
+		/* There might be new threads after the previous round */
+		nr = 0;
+		list_for_each_entry(p, &o->proc->ptrace.pctxs, list)
+			nr++;
+		free(retips);
+		retips = calloc(nr, sizeof(*retips));
+		if (retips == NULL)
+			goto out;
+
+		memset(busy, 0, o->ninfo);
+		nbusy = patch_find_busy_hunks(o, busy, retips);
+		if (nbusy < 0)
+			goto out;
+
+		for (i = 0; i < o->ninfo; i++) {
+			if (busy[i] || (o->info[i].flags & PATCH_APPLIED))
+				continue;
 
-	return 1;
-}
+			if (patch_apply_hunk(o, i) < 0)
+				goto out;
+		}
 
-static int
-object_unapply_patch(struct object_file *o, int check_flag);
+		if (kpatch_agent_flush(proc2pctx(o->proc)) < 0)
+			goto out;
 
-static int
-object_unapply_old_patch(struct object_file *o)
-{
-	struct kpatch_file *kpatch_applied, *kpatch_storage;
-	int ret;
+		if (nbusy == 0)
+			break;
 
-	if (o->skpfile == NULL || o->is_patch || o->applied_patch == NULL)
-		return 0;
+		i = 0;
+		waiting = 0;
+		list_for_each_entry(p, &o->proc->ptrace.pctxs, list) {
+			p->execute_until = retips[i++];
+			if (p->execute_until)
+				waiting++;
+		}
 
-	kpatch_applied = o->applied_patch->kpfile.patch;
-	kpatch_storage = o->skpfile->patch;
+		if (waiting == 0) {
+			kperr("%s: hunks are busy with coroutines\n", o->name);
+			goto out;
+		}
 
-	if (kpatch_applied->user_level >= kpatch_storage->user_level) {
-		kpinfo("'%s' applied patch level is %d (storage has %d\n)\n",
-		       o->name,
-		       kpatch_applied->user_level,
-		       kpatch_storage->user_level);
-		return 1;
-	}
+		if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+			goto out;
 
-	printf("%s: replacing patch level %d with level %d\n",
-	       o->name,
-	       kpatch_applied->user_level,
-	       kpatch_storage->user_level);
-	ret = object_unapply_patch(o, /* check_flag */ 0);
-	if (ret < 0)
-		kperr("can't unapply patch for %s\n", o->name);
-	else {
-		/* TODO(pboldin): handle joining the holes here */
-		o->applied_patch = NULL;
-		o->info = NULL;
-		o->ninfo = 0;
+		elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+			  (now.tv_nsec - start.tv_nsec) / 1000000;
+		if (elapsed >= LAZY_DEADLINE_MSEC)
+			goto timeout;
+
+		kpinfo("%s: %d thread(s) are in patched functions, waiting\n",
+		       o->name, waiting);
+
+		ret = kpatch_ptrace_execute_until(o->proc,
+						  LAZY_DEADLINE_MSEC - elapsed,
+						  EXECUTE_UNTIL_FIRST);
+		if (ret < 0)
+			goto out;
+		if (ret == 0)
+			goto timeout;
+
+		/* OK, at this point we may have new threads, discover them */
+		ret = -1;
+		if (kpatch_process_attach(o->proc) < 0)
+			goto out;
 	}
 
+	ret = 0;
+	goto out;
+
+timeout:
+	ret = -1;
+	kperr("%s: some functions are still busy after %d msecs\n",
+	      o->name, LAZY_DEADLINE_MSEC);
+out:
+	free(retips);
+	free(busy);
 	return ret;
 }
 
+/*
+ * Hunk `jmp` must fit into a single aligned word to be written at once.
+ */
+#define HUNK_WORD_FITS(addr)	(((addr) & 7) + HUNK_SIZE <= 8)
+
 static int
-kpatch_apply_patches(kpatch_process_t *proc)
+object_can_patch_nofreeze(struct object_file *o)
 {
-	struct object_file *o;
-	int applied = 0, ret;
-
-	list_for_each_entry(o, &proc->objs, list) {
+	size_t i;
 
-		ret = object_unapply_old_patch(o);
-		if (ret < 0)
-			break;
+	for (i = 0; i < o->ninfo; i++) {
+		if (is_new_func(&o->info[i]))
+			continue;
 
-		ret = object_apply_patch(o);
-		if (ret < 0)
-			goto unpatch;
-		if (ret)
-			applied++;
+		if (!HUNK_WORD_FITS(o->info[i].daddr)) {
+			kpwarn("%s: hunk at 0x%lx crosses a word boundary\n",
+			       o->name, o->info[i].daddr);
+			return 0;
+		}
 	}
-	return applied;
 
-unpatch:
-	kperr("Patching %s failed, unapplying partially applied patch\n", o->name);
-	/*
-	 * TODO(pboldin): close the holes so the state is the same
-	 * after unpatch
-	 */
-	ret = object_unapply_patch(o, /* check_flag */ 1);
-	if (ret < 0) {
-		kperr("Can't unapply patch for %s\n", o->name);
-	}
-	return -1;
+	return 1;
 }
 
-struct patch_data {
+/*
+ * Install hunks of a patch marked with KPATCH_SAFETY_METHOD_FREEZE_NONE.
+ * The original code is stashed while the patient is stopped, then its
+ * threads are let run and each `jmp` is written along with the bytes
+ * following it in the same aligned word by a single 8-byte write to
+ * /proc/pid/mem, so threads see either the old or the new entry.
+ */
+static int
+patch_apply_hunks_nofreeze(struct object_file *o)
+{
+	struct kpatch_info *info;
+	unsigned long word;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < o->ninfo; i++) {
+		if (is_new_func(&o->info[i]))
+			continue;
+
+		ret = patch_stash_hunk(o, i);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = kpatch_agent_flush(proc2pctx(o->proc));
+	if (ret < 0)
+		return ret;
+
+	ret = kpatch_ptrace_continue_threads(o->proc);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < o->ninfo; i++) {
+		info = &o->info[i];
+		if (is_new_func(info))
+			continue;
+
+		ret = kpatch_process_mem_read(o->proc,
+					      ROUND_DOWN(info->daddr, 8),
+					      &word, sizeof(word));
+		if (ret < 0)
+			break;
+
+		kpinfo("%s hunk 0x%lx+0x%x -> 0x%lx+0x%x (atomic)\n",
+		       o->name, info->daddr, info->dlen,
+		       info->saddr, info->slen);
+		patch_hunk_code(info, (char *)&word + (info->daddr & 7));
+		ret = kpatch_process_mem_write(o->proc, &word,
+					       ROUND_DOWN(info->daddr, 8),
+					       sizeof(word));
+		if (ret < 0)
+			break;
+
+		info->flags |= PATCH_APPLIED;
+	}
+
+	kpatch_ptrace_stop_threads(o->proc);
+
+	return ret < 0 ? -1 : 0;
+}
+
+static int
+duplicate_kp_file(struct object_file *o)
+{
+	struct kpatch_file *patch;
+
+	patch = malloc(o->skpfile->size);
+	if (patch == NULL)
+		return -1;
+
+	memcpy(patch, o->skpfile->patch, o->skpfile->size);
+	o->kpfile.patch = patch;
+	o->kpfile.size = o->skpfile->size;
+
+	return 0;
+}
+
+static unsigned long
+content_hash(const unsigned char *buf, size_t len)
+{
+	unsigned long h = 0xcbf29ce484222325UL;
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < len; i++) {
+		h ^= buf[i];
+		h *= 0x100000001b3UL;
+	}
+
+	return h;
+}
+
+/* Read the first `len` bytes of the shared file `fd` */
+static unsigned char *
+shared_file_read(int fd, size_t len)
+{
+	unsigned char *cur;
+
+	cur = malloc(len);
+	if (cur != NULL && pread(fd, cur, len, 0) != (ssize_t)len) {
+		free(cur);
+		cur = NULL;
+	}
+
+	return cur;
+}
+
+/*
+ * The shared files end up in the patients' code, so only the ones nobody
+ * but us could have written are used.
+ */
+static int
+shared_file_trusted(int fd, size_t len)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) < 0)
+		return 0;
+
+	return S_ISREG(st.st_mode) && st.st_uid == geteuid() &&
+	       !(st.st_mode & (S_IWGRP | S_IWOTH)) &&
+	       (size_t)st.st_size == len;
+}
+
+/*
+ * Create the file `name` in /dev/shm with `len` bytes of `buf` in it or
+ * open the existing one if its first `cmp` bytes are the same. Files are
+ * named after their content, so the patients needing the same bytes map
+ * the same file. A file we don't own or others can write is replaced.
+ * Returns 1 with the file open read-only in `pfd`, 0 if the existing
+ * file differs and -1 on error.
+ */
+static int
+shared_file_prepare(const char *name,
+		    unsigned char *buf,
+		    size_t len,
+		    size_t cmp,
+		    int *pfd)
+{
+	char path[64];
+	unsigned char *cur;
+	int fd, rfd, ret, retry;
+
+	for (retry = 0; retry < 2; retry++) {
+		/* Patients get it as an fd, nobody else needs to open it */
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0) {
+			if (write(fd, buf, len) != (ssize_t)len) {
+				kplogerror("can't write %s\n", name);
+				shm_unlink(name);
+				close(fd);
+				return -1;
+			}
+
+			/* Nobody gets it writable, reopen this very file */
+			snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+			rfd = open(path, O_RDONLY);
+			close(fd);
+			fd = rfd;
+			break;
+		}
+
+		if (errno != EEXIST) {
+			kplogerror("can't create %s\n", name);
+			return -1;
+		}
+
+		fd = shm_open(name, O_RDONLY, 0);
+		if (fd >= 0 && shared_file_trusted(fd, len))
+			break;
+
+		kpwarn("%s is not ours, replacing it\n", name);
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+		if (shm_unlink(name) < 0 && errno != ENOENT) {
+			kplogerror("can't remove %s\n", name);
+			return -1;
+		}
+	}
+
+	if (fd < 0) {
+		kperr("can't open %s\n", name);
+		return -1;
+	}
+
+	cur = shared_file_read(fd, cmp);
+	ret = cur != NULL && !memcmp(cur, buf, cmp);
+	free(cur);
+	if (ret == 0) {
+		close(fd);
+		return 0;
+	}
+
+	*pfd = fd;
+	return 1;
+}
+
+/* Remove the shared file `name` we failed to map unless others map it */
+static void
+shared_file_drop(const char *name, int fd)
+{
+	struct kpatch_shared_file sf;
+	struct stat st;
+
+	if (fstat(fd, &st) < 0)
+		return;
+
+	snprintf(sf.name, sizeof(sf.name), "%s", name);
+	sf.dev = st.st_dev;
+	sf.ino = st.st_ino;
+	kpatch_release_shared_file(&sf);
+}
+
+/*
+ * Put the patch image prepared for `o` into a file named after its
+ * code and map it to the patient privately instead of writing the image
+ * into the patient's memory. The code of position-independent patches is
+ * the same in all the patients, only the pages with their GOT, data and
+ * symbols differ from the file. These are written after mapping, pages
+ * left untouched are shared with the page cache and other patients.
+ * Returns 1 if the image is to be written the usual way instead.
+ */
+static int
+object_map_patch_image(struct object_file *o)
+{
+	struct kpatch_file *kp = o->kpfile.patch;
+	char name[128], path[sizeof(name) + 16];
+	unsigned char *buf, *cur = NULL;
+	size_t off, n, len = o->kpta_size;
+	int ret = -1, npages = 0, fd = -1;
+
+	buf = calloc(1, len);
+	if (buf == NULL)
+		return -1;
+
+	memcpy(buf, kp, kp->user_size);
+	if (o->jmp_table)
+		memcpy(buf + kp->jmp_offset, o->jmp_table,
+		       o->jmp_table->size);
+
+	snprintf(name, sizeof(name), "/" KPATCH_PATCH_FILE_PREFIX "%s-%lx-%016lx",
+		 kpatch_get_buildid(o), len,
+		 content_hash(buf, kpatch_elf_text_end(o)));
+	snprintf(path, sizeof(path), "/dev/shm%s", name);
+
+	/* Only the code is hashed, it must be the same to map the file */
+	ret = shared_file_prepare(name, buf, len, kpatch_elf_text_end(o), &fd);
+	if (ret == 0) {
+		kpwarn("%s doesn't match the patch for %s, writing it\n",
+		       path, o->name);
+		ret = 1;
+		goto out;
+	}
+	if (ret < 0)
+		goto out;
+
+	cur = shared_file_read(fd, len);
+	if (cur == NULL) {
+		kplogerror("can't read %s\n", path);
+		ret = -1;
+		goto out;
+	}
+
+	if (kpatch_process_map_file(o->proc, fd, o->kpta, len,
+				    PROT_READ | PROT_WRITE | PROT_EXEC,
+				    MAP_PRIVATE | MAP_FIXED, 0) == 0) {
+		shared_file_drop(name, fd);
+		ret = -1;
+		goto out;
+	}
+
+	for (off = 0; off < len; off += n) {
+		n = len - off < PAGE_SIZE ? len - off : PAGE_SIZE;
+		if (!memcmp(cur + off, buf + off, n))
+			continue;
+		ret = kpatch_agent_write(o->proc, buf + off, o->kpta + off, n);
+		if (ret < 0)
+			goto out;
+		npages++;
+	}
+	if (npages) {
+		ret = kpatch_agent_flush(proc2pctx(o->proc));
+		if (ret < 0)
+			goto out;
+	}
+
+	kpinfo("%s: patch is mapped from %s, %d pages are private\n",
+	       o->name, path, npages);
+	ret = 0;
+out:
+	if (fd >= 0)
+		close(fd);
+	free(cur);
+	free(buf);
+	return ret;
+}
+
+/*
+ * Prepare patch from storage for the object file `o` and write it into
+ * the newly allocated region in patient's memory. No hunks are applied.
+ */
+static int
+object_upload_patch(struct object_file *o)
+{
+	struct kpatch_reloc_tmpl *tmpl;
+	struct kpatch_file *kp;
+	size_t sz;
+	int undef, ret;
+
+	ret = duplicate_kp_file(o);
+	if (ret < 0) {
+		kplogerror("can't duplicate kp_file\n");
+		return -1;
+	}
+
+	ret = kpatch_elf_load_kpatch_info(o);
+	if (ret < 0)
+		return ret;
+
+	kp = o->kpfile.patch;
+
+	/*
+	 * Only the runtime part of the image goes to the patient, see
+	 * kpatch_elf_compact_patch. Keep the code apart from the data
+	 * written for each patient.
+	 */
+	sz = ROUND_UP(kp->user_size, o->proc->map_patches ? PAGE_SIZE : 8);
+
+	/*
+	 * Patients running the same object have the patch relocated the
+	 * same way, up to the bases. Walk the patch's ELF once for all.
+	 */
+	if (o->skpfile->tmpl == NULL)
+		o->skpfile->tmpl = kpatch_reloc_tmpl_new(o->skpfile, sz);
+	tmpl = o->skpfile->tmpl;
+	if (tmpl != NULL && !kpatch_reloc_tmpl_usable(tmpl, sz))
+		tmpl = NULL;
+
+	if (tmpl != NULL)
+		undef = kpatch_reloc_tmpl_entries(tmpl);
+	else
+		undef = kpatch_count_undefined(o) + kpatch_count_got_entries(o);
+	if (undef) {
+		o->jmp_table = kpatch_new_jmp_table(undef);
+		kp->jmp_offset = sz;
+		kpinfo("Jump table %d bytes for %d syms at offset 0x%x\n",
+		       o->jmp_table->size, undef, kp->jmp_offset);
+		sz = ROUND_UP(sz + o->jmp_table->size, 128);
+	}
+
+	kp->user_info = (unsigned long)o->info -
+			(unsigned long)o->kpfile.patch;
+	kp->user_undo = sz;
+	sz = ROUND_UP(sz + HUNK_SIZE * o->ninfo, 16);
+
+	/* Room to remember the call sites pointed to the new code */
+	kp->user_calls = 0;
+	if (o->proc->redirect_calls) {
+		size_t ncalls;
+
+		if (kpatch_elf_call_sites(o, &ncalls) != NULL && ncalls) {
+			kp->user_calls = sz;
+			sz = ROUND_UP(sz + sizeof(unsigned long) +
+				      ncalls * sizeof(struct kpatch_call_site),
+				      16);
+		}
+	}
+
+	/*
+	 * Map patch as close to the original code as possible.
+	 * Otherwise we can't use 32-bit jumps.
+	 */
+	ret = kpatch_object_allocate_patch(o, sz);
+	if (ret < 0)
+		return ret;
+	if (tmpl != NULL) {
+		ret = kpatch_reloc_tmpl_apply(o, tmpl);
+		if (ret < 0)
+			return ret;
+	} else {
+		ret = kpatch_resolve(o);
+		if (ret < 0)
+			return ret;
+		ret = kpatch_relocate(o);
+		if (ret < 0)
+			return ret;
+	}
+	if (o->proc->map_patches) {
+		ret = object_map_patch_image(o);
+		if (ret <= 0)
+			return ret;
+	}
+	ret = kpatch_agent_write(o->proc,
+				 kp,
+				 o->kpta,
+				 kp->user_size);
+	if (ret < 0)
+		return -1;
+	if (o->jmp_table) {
+		ret = kpatch_agent_write(o->proc,
+					 o->jmp_table,
+					 o->kpta + kp->jmp_offset,
+					 o->jmp_table->size);
+		if (ret < 0)
+			return ret;
+	}
+	return kpatch_agent_flush(proc2pctx(o->proc));
+}
+
+static int
+object_redirect_calls(struct object_file *o);
+
+static int
+object_apply_patch(struct object_file *o, int lazy)
+{
+	struct kpatch_file *kp;
+	size_t i;
+	int ret;
+
+	if (o->skpfile == NULL || o->is_patch)
+		return 0;
+
+	if (o->applied_patch) {
+		kpinfo("Object '%s' already have a patch, not patching\n",
+		       o->name);
+		return 0;
+	}
+
+	ret = object_upload_patch(o);
+	if (ret < 0)
+		return ret;
+
+	kp = o->kpfile.patch;
+
+	if (kp->safety_method == KPATCH_SAFETY_METHOD_FREEZE_NONE &&
+	    object_can_patch_nofreeze(o)) {
+		ret = patch_apply_hunks_nofreeze(o);
+		if (ret < 0)
+			return ret;
+		goto redirect;
+	}
+
+	/*
+	 * Released threads run while hunks are written, so they must be
+	 * written atomically as well.
+	 */
+	if (kp->safety_method == KPATCH_SAFETY_METHOD_FREEZE_CONFLICT &&
+	    object_can_patch_nofreeze(o)) {
+		ret = patch_ensure_safety_conflict(o);
+		if (ret < 0)
+			return ret;
+		ret = patch_apply_hunks_nofreeze(o);
+		if (ret < 0)
+			return ret;
+		goto redirect;
+	}
+
+	if (lazy) {
+		ret = patch_apply_hunks_lazy(o);
+		if (ret < 0)
+			return ret;
+		goto redirect;
+	}
+
+	ret = patch_ensure_safety(o, ACTION_APPLY_PATCH);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < o->ninfo; i++) {
+		ret = patch_apply_hunk(o, i);
+		if (ret < 0)
+			return ret;
+	}
+	ret = kpatch_agent_flush(proc2pctx(o->proc));
+	if (ret < 0)
+		return ret;
+
+	/* All the threads are stopped again by now whatever the way above */
+redirect:
+	ret = object_redirect_calls(o);
+	if (ret < 0)
+		return ret;
+
+	return 1;
+}
+
+static int
+object_unapply_patch(struct object_file *o, int check_flag);
+static int
+object_find_applied_patch_info(struct object_file *o);
+
+/*
+ * Patched text pages are private copies in each process. With
+ * `share_text` set they are put into a file named after the object's
+ * Build-ID and the pages' content, so the processes running the same
+ * object with the same patch placed the same way map the same pages.
+ */
+static int
+object_share_text_range(struct object_file *o,
+			unsigned long start,
+			unsigned long end,
+			int prot)
+{
+	char name[128], path[sizeof(name) + 16];
+	unsigned char *buf;
+	size_t len = end - start;
+	int ret = -1, fd = -1;
+
+	buf = malloc(len);
+	if (buf == NULL)
+		return -1;
+
+	if (kpatch_process_mem_read(o->proc, start, buf, len) < 0)
+		goto out;
+
+	snprintf(name, sizeof(name), "/" KPATCH_SHARED_TEXT_PREFIX "%s-%lx-%016lx",
+		 kpatch_get_buildid(o), len, content_hash(buf, len));
+	snprintf(path, sizeof(path), "/dev/shm%s", name);
+
+	ret = shared_file_prepare(name, buf, len, len, &fd);
+	if (ret <= 0) {
+		if (ret == 0)
+			kpwarn("%s doesn't match the text of %s, not sharing\n",
+			       path, o->name);
+		goto out;
+	}
+
+	/* Same content, so it doesn't matter if threads are running */
+	if (kpatch_process_map_file(o->proc, fd, start, len, prot,
+				    MAP_SHARED | MAP_FIXED, 0) == 0) {
+		kpwarn("can't share text of %s, keeping private copy\n",
+		       o->name);
+		shared_file_drop(name, fd);
+		ret = 0;
+		goto out;
+	}
+
+	ret = kpatch_object_add_shared_text(o, start, end);
+	if (ret == 0)
+		kpinfo("%s: text 0x%lx-0x%lx is shared via %s\n",
+		       o->name, start, end, path);
+out:
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	return ret;
+}
+
+static int
+compare_ulong(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Map the text pages `o`'s hunks are in from the shared files */
+static int
+object_share_text(struct object_file *o)
+{
+	struct obj_vm_area *ovma;
+	unsigned long *pages, start, end;
+	size_t i, n = 0;
+	int ret = 0;
+
+	if (!o->proc->share_text || o->info == NULL ||
+	    !list_empty(&o->shared_text))
+		return 0;
+
+	pages = malloc(2 * o->ninfo * sizeof(*pages));
+	if (pages == NULL)
+		return -1;
+
+	for (i = 0; i < o->ninfo; i++) {
+		if (!(o->info[i].flags & PATCH_APPLIED))
+			continue;
+
+		start = ROUND_DOWN(o->info[i].daddr, PAGE_SIZE);
+		end = ROUND_DOWN(o->info[i].daddr + HUNK_SIZE - 1, PAGE_SIZE);
+		pages[n++] = start;
+		if (end != start)
+			pages[n++] = end;
+	}
+
+	qsort(pages, n, sizeof(*pages), compare_ulong);
+
+	/* Contiguous pages are shared as a single range */
+	for (i = 0; i < n && ret >= 0; ) {
+		start = pages[i];
+		end = start + PAGE_SIZE;
+		for (i++; i < n && pages[i] <= end; i++)
+			end = pages[i] + PAGE_SIZE;
+
+		ovma = kpatch_object_find_vma(o, start, end);
+		if (ovma == NULL)
+			continue;
+
+		ret = object_share_text_range(o, start, end,
+					      ovma->inmem.prot);
+	}
+
+	free(pages);
+	return ret;
+}
+
+/* Returns 1 if storage has a newer patch than the one applied to `o` */
+static int
+object_should_upgrade_patch(struct object_file *o)
+{
+	struct kpatch_file *kpatch_applied, *kpatch_storage;
+
+	if (o->skpfile == NULL || o->is_patch || o->applied_patch == NULL)
+		return 0;
+
+	kpatch_applied = o->applied_patch->kpfile.patch;
+	kpatch_storage = o->skpfile->patch;
+
+	if (kpatch_applied->user_level >= kpatch_storage->user_level) {
+		kpinfo("'%s' applied patch level is %d (storage has %d\n)\n",
+		       o->name,
+		       kpatch_applied->user_level,
+		       kpatch_storage->user_level);
+		return 0;
+	}
+
+	return 1;
+}
+
+static struct kpatch_info *
+find_info_by_daddr(struct kpatch_info *info, size_t ninfo,
+		   unsigned long daddr, size_t *pi)
+{
+	size_t i;
+
+	for (i = 0; i < ninfo; i++) {
+		if (!is_new_func(&info[i]) && info[i].daddr == daddr) {
+			*pi = i;
+			return &info[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Point the direct calls of the patched functions found by kpatch_strip
+ * straight to the new code, so that they don't go through the jump at
+ * the function's entry. The calls are remembered in the patch region,
+ * see object_restore_calls. Patient must be stopped with none of its
+ * threads in the patched functions, the call sites are only rewritten
+ * once the hunks are in.
+ */
+static int
+object_redirect_calls(struct object_file *o)
+{
+	struct kpatch_call_site *calls, *c, rec;
+	struct kpatch_info *info;
+	struct kpatch_file *kp = o->kpfile.patch;
+	unsigned char code[HUNK_SIZE];
+	unsigned long rcalls, n = 0;
+	long rel;
+	size_t ncalls, i, j;
+	int ret;
+
+	if (!o->proc->redirect_calls || kp->user_calls == 0)
+		return 0;
+
+	calls = kpatch_elf_call_sites(o, &ncalls);
+	rcalls = o->kpta + kp->user_calls;
+
+	for (i = 0; i < ncalls; i++) {
+		c = &calls[i];
+		rec.site = c->site + o->load_offset;
+		rec.daddr = c->daddr + o->load_offset;
+
+		info = find_info_by_daddr(o->info, o->ninfo, rec.daddr, &j);
+		if (info == NULL || !(info->flags & PATCH_APPLIED))
+			continue;
+
+		/* The code must still be the call we've seen in the object */
+		if (kpatch_process_mem_read(o->proc, rec.site,
+					    code, sizeof(code)) < 0)
+			return -1;
+		rel = *(int32_t *)(code + 1);
+		if (code[0] != 0xe8 || rec.site + 5 + rel != rec.daddr) {
+			kpdebug("%s: no call of 0x%lx at 0x%lx, skipping\n",
+				o->name, rec.daddr, rec.site);
+			continue;
+		}
+
+		rel = info->saddr - (rec.site + 5);
+		if (rel != (int32_t)rel) {
+			kpdebug("%s: 0x%lx is out of reach of 0x%lx, skipping\n",
+				o->name, info->saddr, rec.site);
+			continue;
+		}
+
+		/* Record goes first, so that it's there to restore the call */
+		ret = kpatch_agent_write(o->proc, &rec,
+					 rcalls + sizeof(n) + n * sizeof(rec),
+					 sizeof(rec));
+		if (ret < 0)
+			return -1;
+		n++;
+		ret = kpatch_agent_write(o->proc, &n, rcalls, sizeof(n));
+		if (ret < 0)
+			return -1;
+
+		*(int32_t *)(code + 1) = rel;
+		ret = kpatch_agent_write(o->proc, code + 1, rec.site + 1, 4);
+		if (ret < 0)
+			return -1;
+	}
+
+	ret = kpatch_agent_flush(proc2pctx(o->proc));
+	if (ret < 0)
+		return ret;
+
+	kpinfo("%s: %ld of %ld calls point to the new code\n",
+	       o->name, n, ncalls);
+	return 0;
+}
+
+/*
+ * Make the calls redirected by object_redirect_calls go to the original
+ * function's entry again. `kp` is the header of the patch at `kpta`.
+ */
+static int
+object_restore_calls(struct object_file *o,
+		     unsigned long kpta,
+		     struct kpatch_file *kp)
+{
+	struct kpatch_call_site rec;
+	unsigned long rcalls, n, i;
+	int32_t rel;
+	int ret;
+
+	if (kp->user_calls == 0)
+		return 0;
+
+	rcalls = kpta + kp->user_calls;
+	if (kpatch_process_mem_read(o->proc, rcalls, &n, sizeof(n)) < 0)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		if (kpatch_process_mem_read(o->proc,
+					    rcalls + sizeof(n) + i * sizeof(rec),
+					    &rec, sizeof(rec)) < 0)
+			return -1;
+
+		rel = rec.daddr - (rec.site + 5);
+		ret = kpatch_agent_write(o->proc, &rel, rec.site + 1,
+					 sizeof(rel));
+		if (ret < 0)
+			return -1;
+	}
+
+	if (n)
+		kpinfo("%s: %ld calls point to the original code again\n",
+		       o->name, n);
+	return 0;
+}
+
+/*
+ * Replace the patch applied to `o` with the newer one from storage in
+ * one go. The new patch is uploaded next to the old one, then safety is
+ * checked once against both the original functions being patched and
+ * the old patch's code, and the hunks are retargeted straight from the
+ * old code to the new one in a single write batch. Original code is
+ * never run in between.
+ */
+static int
+object_upgrade_patch(struct object_file *o)
+{
+	struct kpatch_info *old_info, *info, *both;
+	struct kpatch_jmp_table *old_jmp_table;
+	struct object_file *old_patch = o->applied_patch;
+	struct kpatch_file *old_kp;
+	struct kp_file old_kpfile;
+	unsigned long old_kpta, old_undo, undo, src;
+	size_t old_ninfo, old_size, i, j;
+	char code[HUNK_SIZE];
+	int ret;
+
+	printf("%s: replacing patch level %d with level %d\n",
+	       o->name,
+	       o->applied_patch->kpfile.patch->user_level,
+	       o->skpfile->patch->user_level);
+
+	ret = object_find_applied_patch_info(o);
+	if (ret < 0)
+		return ret;
+
+	/* Before the safety wait, it puts breakpoints into the text */
+	ret = kpatch_object_unshare_text(o);
+	if (ret < 0)
+		return ret;
+
+	old_info = o->info;
+	old_ninfo = o->ninfo;
+	old_kpfile = o->kpfile;
+	old_kp = o->kpfile.patch;
+	old_kpta = o->kpta;
+	old_undo = o->kpta + o->kpfile.patch->user_undo;
+	old_size = o->kpta_size;
+	old_jmp_table = o->jmp_table;
+
+	o->info = NULL;
+	o->ninfo = 0;
+	o->jmp_table = NULL;
+	ret = object_upload_patch(o);
+	if (ret < 0)
+		goto restore;
+
+	/*
+	 * Threads must be neither in the functions we patch nor in the
+	 * code of the old patch we are about to unmap.
+	 */
+	both = malloc((o->ninfo + old_ninfo) * sizeof(*both));
+	if (both == NULL)
+		goto restore;
+
+	memcpy(both, o->info, o->ninfo * sizeof(*both));
+	for (i = 0; i < old_ninfo; i++) {
+		both[o->ninfo + i] = old_info[i];
+		both[o->ninfo + i].daddr = old_info[i].saddr;
+		both[o->ninfo + i].dlen = old_info[i].slen;
+	}
+
+	info = o->info;
+	o->info = both;
+	o->ninfo += old_ninfo;
+	ret = patch_ensure_safety(o, ACTION_APPLY_PATCH);
+	o->ninfo -= old_ninfo;
+	o->info = info;
+	free(both);
+	if (ret < 0)
+		goto restore;
+
+	/* Calls into the old code are made again by the new patch */
+	ret = object_restore_calls(o, old_kpta, old_kp);
+	if (ret < 0)
+		goto restore;
+
+	/*
+	 * From here on hunks may point to the new patch already, so it
+	 * is kept on errors.
+	 */
+
+	undo = o->kpta + o->kpfile.patch->user_undo;
+	for (i = 0; i < o->ninfo; i++) {
+		info = &o->info[i];
+		if (is_new_func(info))
+			continue;
+
+		/* Stash the original code, old patch has it if it's hooked */
+		src = info->daddr;
+		if (find_info_by_daddr(old_info, old_ninfo, info->daddr, &j))
+			src = old_undo + j * HUNK_SIZE;
+
+		ret = kpatch_agent_memcpy(o->proc, undo + i * HUNK_SIZE,
+					  src, HUNK_SIZE);
+		if (ret < 0)
+			return ret;
+
+		kpinfo("%s hunk 0x%lx+0x%x -> 0x%lx+0x%x\n",
+		       o->name, info->daddr, info->dlen,
+		       info->saddr, info->slen);
+		patch_hunk_code(info, code);
+		ret = kpatch_agent_write(o->proc, code,
+					 info->daddr, sizeof(code));
+		if (ret < 0)
+			return ret;
+
+		info->flags |= PATCH_APPLIED;
+	}
+
+	/* Functions the new patch doesn't touch anymore get their code back */
+	for (j = 0; j < old_ninfo; j++) {
+		if (is_new_func(&old_info[j]) ||
+		    find_info_by_daddr(o->info, o->ninfo,
+				       old_info[j].daddr, &i))
+			continue;
+
+		ret = kpatch_agent_memcpy(o->proc, old_info[j].daddr,
+					  old_undo + j * HUNK_SIZE,
+					  HUNK_SIZE);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = kpatch_agent_flush(proc2pctx(o->proc));
+	if (ret < 0)
+		return ret;
+
+	ret = object_redirect_calls(o);
+	if (ret < 0)
+		return ret;
+
+	o->applied_patch = NULL;
+	ret = kpatch_process_free_patch(o->proc, old_kpta, old_size);
+	if (ret < 0)
+		kperr("can't free old patch for %s\n", o->name);
+
+	/* The old patch object owns these, it is gone from the patient */
+	old_patch->info = NULL;
+	old_patch->ninfo = 0;
+	old_patch->kpfile.patch = NULL;
+	free(old_info);
+	free(old_kp);
+	free(old_jmp_table);
+
+	return 1;
+
+restore:
+	/* Nothing points to the new patch yet, put the old one back */
+	if (o->kpta != old_kpta &&
+	    kpatch_process_free_patch(o->proc, o->kpta, o->kpta_size) < 0)
+		kperr("can't free new patch for %s\n", o->name);
+	if (o->kpfile.patch != old_kp)
+		free(o->kpfile.patch);
+	free(o->jmp_table);
+
+	o->kpfile = old_kpfile;
+	o->info = old_info;
+	o->ninfo = old_ninfo;
+	o->kpta = old_kpta;
+	o->kpta_size = old_size;
+	o->jmp_table = old_jmp_table;
+	return -1;
+}
+
+static void
+object_get_range(struct object_file *o,
+		 unsigned long *start,
+		 unsigned long *end)
+{
+	struct obj_vm_area *ovma;
+
+	ovma = list_first_entry(&o->vma, struct obj_vm_area, list);
+	*start = ovma->inmem.start;
+	ovma = list_entry(o->vma.prev, struct obj_vm_area, list);
+	*end = ovma->inmem.end;
+}
+
+/*
+ * Writing a hunk into text mapped by a huge page splits that page into
+ * small ones. Ask the kernel to collapse each huge page we have written
+ * to back, once all the hunks are there.
+ */
+static void
+object_collapse_text(struct object_file *o)
+{
+	unsigned long start, end, hpage;
+	size_t i, j;
+	long after;
+
+	if (o->text_huge_kb <= 0 || o->info == NULL)
+		return;
+
+	for (i = 0; i < o->ninfo; i++) {
+		if (!(o->info[i].flags & PATCH_APPLIED))
+			continue;
+
+		hpage = ROUND_DOWN(o->info[i].daddr, KPATCH_HUGE_PAGE_SIZE);
+		for (j = 0; j < i; j++)
+			if ((o->info[j].flags & PATCH_APPLIED) &&
+			    ROUND_DOWN(o->info[j].daddr,
+				       KPATCH_HUGE_PAGE_SIZE) == hpage)
+				break;
+		if (j != i)
+			continue;
+
+		if (!kpatch_object_find_vma(o, hpage,
+					    hpage + KPATCH_HUGE_PAGE_SIZE))
+			continue;
+
+		if (kpatch_madvise_remote(proc2pctx(o->proc), hpage,
+					  KPATCH_HUGE_PAGE_SIZE,
+					  MADV_COLLAPSE) < 0)
+			kpwarn("can't collapse %s text at 0x%lx: %s\n",
+			       o->name, hpage, strerror(errno));
+	}
+
+	object_get_range(o, &start, &end);
+	after = kpatch_process_huge_pages_kb(o->proc, start, end);
+	kpinfo("%s is on huge pages for %ld kB before patching, %ld kB after\n",
+	       o->name, o->text_huge_kb, after);
+}
+
+static int
+kpatch_apply_patches(kpatch_process_t *proc, int lazy)
+{
+	struct object_file *o;
+	unsigned long start, end;
+	int applied = 0, ret;
+
+	list_for_each_entry(o, &proc->objs, list) {
+		if (o->skpfile == NULL || o->is_patch)
+			continue;
+
+		object_get_range(o, &start, &end);
+		o->text_huge_kb = kpatch_process_huge_pages_kb(proc,
+							       start, end);
+	}
+
+	list_for_each_entry(o, &proc->objs, list) {
+
+		if (object_should_upgrade_patch(o))
+			ret = object_upgrade_patch(o);
+		else
+			ret = object_apply_patch(o, lazy);
+		if (ret < 0)
+			goto unpatch;
+		if (ret)
+			applied++;
+	}
+
+	if (applied) {
+		kpatch_process_collapse_arenas(proc);
+		list_for_each_entry(o, &proc->objs, list) {
+			if (object_share_text(o) < 0)
+				kperr("can't share text of %s\n", o->name);
+			object_collapse_text(o);
+		}
+	}
+
+	return applied;
+
+unpatch:
+	kperr("Patching %s failed, unapplying partially applied patch\n", o->name);
+	ret = object_unapply_patch(o, /* check_flag */ 1);
+	if (ret < 0) {
+		kperr("Can't unapply patch for %s\n", o->name);
+	}
+	return -1;
+}
+
+/* Forget threads that have exited, returns number of the alive ones */
+static int
+process_prune_threads(kpatch_process_t *proc)
+{
+	struct kpatch_ptrace_ctx *pctx, *ptmp;
+	int n = 0;
+
+	list_for_each_entry_safe(pctx, ptmp, &proc->ptrace.pctxs, list) {
+		if (pctx->pid == 0)
+			kpatch_ptrace_ctx_destroy(pctx);
+		else
+			n++;
+	}
+
+	return n;
+}
+
+/*
+ * Wait for the patient to load new objects and patch them as they come.
+ * The dynamic linker calls `r_debug.r_brk` (aka `_dl_debug_state`) before
+ * and after it changes the list of loaded objects, so we break there and
+ * look for the new patches once the list is consistent again.
+ *
+ * Returns number of hunks applied or -1 on error. Stops on SIGINT/SIGTERM
+ * or when the patient exits.
+ */
+static int
+process_watch_dlopen(kpatch_storage_t *storage, kpatch_process_t *proc,
+		     int lazy)
+{
+	struct kpatch_ptrace_ctx *pctx;
+	struct r_debug r_debug;
+	unsigned long r_debug_addr;
+	int applied = 0, ret;
+
+	r_debug_addr = kpatch_elf_find_r_debug(proc);
+	if (r_debug_addr == 0) {
+		kperr("no r_debug in the patient, can't watch it\n");
+		return -1;
+	}
+
+	ret = kpatch_process_mem_read(proc, r_debug_addr,
+				      &r_debug, sizeof(r_debug));
+	if (ret < 0 || r_debug.r_brk == 0) {
+		kperr("can't read r_debug of the patient\n");
+		return -1;
+	}
+
+	/* Threads created meanwhile must not run into our breakpoint alone */
+	ret = kpatch_ptrace_set_options(proc, PTRACE_O_TRACECLONE);
+	if (ret < 0)
+		return -1;
+
+	printf("Watching PID '%d' for new objects, interrupt to stop\n",
+	       proc->pid);
+
+	while (1) {
+		if (process_prune_threads(proc) == 0)
+			break;
+
+		list_for_each_entry(pctx, &proc->ptrace.pctxs, list)
+			pctx->execute_until = r_debug.r_brk;
+
+		ret = kpatch_ptrace_execute_until(proc, -1,
+						  EXECUTE_ALL_THREADS |
+						  EXECUTE_UNTIL_FIRST);
+		if (ret <= 0)
+			break;
+
+		/* The thread caught would hit the breakpoint again at once */
+		ret = kpatch_ptrace_step_over(proc, r_debug.r_brk);
+		if (ret < 0)
+			return -1;
+
+		ret = kpatch_process_mem_read(proc, r_debug_addr,
+					      &r_debug, sizeof(r_debug));
+		if (ret < 0)
+			return -1;
+
+		/* The list is being changed, wait for the second call */
+		if (r_debug.r_state != RT_CONSISTENT)
+			continue;
+
+		kpdebug("Objects list of PID %d changed\n", proc->pid);
+
+		ret = kpatch_process_remap_object_files(proc);
+		if (ret < 0)
+			return -1;
+
+		ret = storage_lookup_patches(storage, proc);
+		if (ret <= 0)
+			continue;
+
+		ret = kpatch_apply_patches(proc, lazy);
+		if (ret < 0)
+			return -1;
+
+		if (ret) {
+			printf("%d patch hunk(s) have been successfully applied to PID '%d'\n",
+			       ret, proc->pid);
+			applied += ret;
+		}
+	}
+
+	return applied;
+}
+
+struct patch_data {
 	kpatch_storage_t *storage;
 	int is_just_started;
 	int send_fd;
+	int use_agent;
+	int watch;
+	int follow_forks;
+	int lazy;
+	int huge_arenas;
+	int share_text;
+	int map_patches;
+	int redirect_calls;
 };
 
+static int process_patch(int pid, void *_data);
+
+/*
+ * Check the only thread of the child `pid` of `o`'s process doesn't run
+ * the functions of `o` to be patched. Returns 0 if it doesn't, 1 if it
+ * does and -1 on error.
+ */
+static int
+child_verify_safety(struct object_file *o, int pid)
+{
+	unw_cursor_t cur;
+	unsigned long ret;
+	void *upt;
+
+	upt = _UPT_create(pid);
+	if (!upt) {
+		kplogerror("can't create unwind ptrace context\n");
+		return -1;
+	}
+
+	/* The child has the very same mappings as its parent */
+	if (unw_init_remote(&cur, o->proc->ptrace.unwd, upt)) {
+		kplogerror("can't create unwind remote context\n");
+		_UPT_destroy(upt);
+		return -1;
+	}
+
+	ret = object_patch_verify_safety_single(o, &cur, NULL, 0,
+						ACTION_APPLY_PATCH);
+	_UPT_destroy(upt);
+	if (ret)
+		kpdebug("child %d is at %lx\n", pid, ret);
+
+	return ret != 0;
+}
+
+/*
+ * Bring patches applied to `proc` during this session to its forked
+ * child `pid`. The child is a copy of `proc` made while it was being
+ * patched, so it has either the patch region with (some of) the hunks
+ * missing or no patch region at all.
+ *
+ * The only thread of the child is a copy of the parent's thread that
+ * called fork(). That thread could have run on since it was checked, or
+ * was never checked at all if it was released, so the child's stack is
+ * checked on its own before the hunks are written.
+ *
+ * Returns 0 if the child is patched now, 1 if it must be patched from
+ * scratch and -1 on error.
+ */
+static int
+child_sync_patches(kpatch_process_t *proc, int pid)
+{
+	struct object_file *o;
+	struct kpatch_info *info;
+	struct kpatch_arena *arena;
+	char path[128], code[HUNK_SIZE], ccode[HUNK_SIZE], c;
+	char *buf = NULL;
+	size_t i, len;
+	int fd, stale, ret = -1;
+
+	snprintf(path, sizeof(path), "/proc/%d/mem", pid);
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		kplogerror("can't open %s\n", path);
+		return -1;
+	}
+
+	list_for_each_entry(o, &proc->objs, list) {
+		if (o->is_patch || o->skpfile == NULL ||
+		    o->applied_patch != NULL || o->info == NULL)
+			continue;
+
+		stale = 0;
+		for (i = 0; i < o->ninfo && !stale; i++) {
+			info = &o->info[i];
+			if (!(info->flags & PATCH_APPLIED))
+				continue;
+
+			if (kpatch_process_mem_read(proc, info->daddr,
+						    code, HUNK_SIZE) < 0)
+				goto out;
+			if (pread(fd, ccode, HUNK_SIZE, info->daddr) != HUNK_SIZE)
+				goto out;
+			stale = memcmp(code, ccode, HUNK_SIZE);
+		}
+
+		if (!stale)
+			continue;
+
+		if (pread(fd, &c, 1, o->kpta) != 1) {
+			kpdebug("child %d has no patch for %s\n", pid, o->name);
+			ret = 1;
+			goto out;
+		}
+
+		ret = child_verify_safety(o, pid);
+		if (ret != 0) {
+			if (ret > 0)
+				kperr("child %d runs functions of %s being "
+				      "patched\n", pid, o->name);
+			ret = -1;
+			goto out;
+		}
+		ret = -1;
+
+		kpinfo("Bringing patch for %s to child %d\n", o->name, pid);
+
+		/* The image, jump table and stash of the original code */
+		len = o->kpfile.patch->user_undo + o->ninfo * HUNK_SIZE;
+		buf = malloc(len);
+		if (buf == NULL)
+			goto out;
+
+		if (kpatch_process_mem_read(proc, o->kpta, buf, len) < 0 ||
+		    pwrite(fd, buf, len, o->kpta) != (ssize_t)len)
+			goto out;
+
+		/* The child must know the patch is there if it is in an arena */
+		arena = kpatch_process_find_arena(proc, o->kpta);
+		if (arena != NULL &&
+		    pwrite(fd, &arena->hdr, sizeof(arena->hdr),
+			   arena->start) != sizeof(arena->hdr))
+			goto out;
+
+		free(buf);
+		buf = NULL;
+
+		for (i = 0; i < o->ninfo; i++) {
+			info = &o->info[i];
+			if (!(info->flags & PATCH_APPLIED))
+				continue;
+
+			if (kpatch_process_mem_read(proc, info->daddr,
+						    code, HUNK_SIZE) < 0 ||
+			    pwrite(fd, code, HUNK_SIZE,
+				   info->daddr) != HUNK_SIZE)
+				goto out;
+		}
+	}
+
+	ret = 0;
+out:
+	if (ret < 0)
+		kplogerror("can't sync patches to child %d\n", pid);
+	free(buf);
+	close(fd);
+	return ret;
+}
+
+/*
+ * Let the children forked by `proc` go, making sure they are patched
+ * the same way first.
+ */
+static int
+process_release_children(struct patch_data *data, kpatch_process_t *proc)
+{
+	struct patch_data cdata = *data;
+	struct kpatch_child *child;
+	int i = 0, pid, ret;
+
+	cdata.is_just_started = 0;
+	cdata.send_fd = -1;
+	cdata.watch = 0;
+	cdata.follow_forks = 0;
+
+	while (i < proc->nchildren) {
+		child = &proc->children[i];
+		if (!child->stopped) {
+			i++;
+			continue;
+		}
+
+		pid = child->pid;
+		ret = child_sync_patches(proc, pid);
+		if (ret <= 0) {
+			if (ret == 0)
+				kpinfo("Child %d is patched\n", pid);
+			else
+				kpwarn("releasing child %d as is\n", pid);
+			kpatch_ptrace_release_child(proc, pid, 0);
+			continue;
+		}
+
+		/* Keep it stopped while we are patching it */
+		if (kpatch_ptrace_release_child(proc, pid, SIGSTOP) < 0)
+			continue;
+
+		process_patch(pid, &cdata);
+
+		if (kill(pid, SIGCONT) < 0)
+			kplogerror("can't continue child %d\n", pid);
+	}
+
+	return 0;
+}
+
+/*
+ * Keep following the patient to make sure all the children it forks
+ * carry the patches. Those forked after we are done inherit them, only
+ * ones forked in the middle of patching need any work.
+ *
+ * Stops on SIGINT/SIGTERM or when the patient exits.
+ */
+static int
+process_follow_forks(struct patch_data *data, kpatch_process_t *proc)
+{
+	int ret;
+
+	printf("Following forks of PID '%d', interrupt to stop\n", proc->pid);
+
+	while (1) {
+		ret = process_release_children(data, proc);
+		if (ret < 0)
+			return -1;
+
+		if (process_prune_threads(proc) == 0)
+			break;
+
+		ret = kpatch_ptrace_execute_until(proc, -1,
+						  EXECUTE_ALL_THREADS |
+						  EXECUTE_UNTIL_FORK);
+		if (ret <= 0)
+			break;
+	}
+
+	return 0;
+}
+
 static int process_patch(int pid, void *_data)
 {
 	int ret;
@@ -817,12 +2380,25 @@ static int process_patch(int pid, void *_data)
 		goto out;
 	}
 
+	proc->huge_arenas = data->huge_arenas;
+	proc->share_text = data->share_text;
+	proc->map_patches = data->map_patches;
+	proc->redirect_calls = data->redirect_calls;
+
 	kpatch_process_print_short(proc);
 
 	ret = kpatch_process_attach(proc);
 	if (ret < 0)
 		goto out_free;
 
+	/* Children forked meanwhile must be caught before they run */
+	if (data->follow_forks) {
+		ret = kpatch_ptrace_set_options(proc, PTRACE_O_TRACEFORK |
+							PTRACE_O_TRACECLONE);
+		if (ret < 0)
+			goto out_free;
+	}
+
 	/*
 	 * In case the process was just started we continue execution up to the
 	 * entry point of a program just to allow ld.so to load up libraries
@@ -846,14 +2422,32 @@ static int process_patch(int pid, void *_data)
 	 * Lookup for patches appicable for proc in storage.
 	 */
 	ret = storage_lookup_patches(storage, proc);
-	if (ret <= 0)
+	if (ret < 0 || (ret == 0 && !data->watch))
 		goto out_free;
 
 	ret = kpatch_find_coroutines(proc);
 	if (ret < 0)
 		goto out_free;
 
-	ret = kpatch_apply_patches(proc);
+	/*
+	 * Agent is optional: we can do everything it does via ptrace,
+	 * just slower.
+	 */
+	if (data->use_agent && kpatch_agent_inject(proc) < 0)
+		kpwarn("can't inject agent, falling back to ptrace\n");
+
+	ret = kpatch_apply_patches(proc, data->lazy);
+
+	if (ret >= 0 && data->watch) {
+		int watched;
+
+		watched = process_watch_dlopen(storage, proc, data->lazy);
+		ret = watched < 0 ? watched : ret + watched;
+	}
+
+	if (ret >= 0 && data->follow_forks &&
+	    process_follow_forks(data, proc) < 0)
+		ret = -1;
 
 out_free:
 	kpatch_process_free(proc);
@@ -874,12 +2468,23 @@ out:
 
 static int
 processes_patch(kpatch_storage_t *storage,
-		int pid, int is_just_started, int send_fd)
+		int pid, int is_just_started, int send_fd,
+		int use_agent, int watch, int follow_forks, int lazy,
+		int huge_arenas, int share_text, int map_patches,
+		int redirect_calls)
 {
 	struct patch_data data = {
 		.storage = storage,
 		.is_just_started = is_just_started,
 		.send_fd = send_fd,
+		.use_agent = use_agent,
+		.watch = watch,
+		.follow_forks = follow_forks,
+		.lazy = lazy,
+		.huge_arenas = huge_arenas,
+		.share_text = share_text,
+		.map_patches = map_patches,
+		.redirect_calls = redirect_calls,
 	};
 
 	return processes_do(pid, process_patch, &data);
@@ -901,6 +2506,14 @@ static int usage_patch(const char *err)
 	fprintf(stderr, "  -s          - process was just executed\n");
 	fprintf(stderr, "  -p <PID>    - target process\n");
 	fprintf(stderr, "  -r fd       - fd used with LD_PRELOAD=execve.so.\n");
+	fprintf(stderr, "  -a          - inject an agent to do the remote work in batches\n");
+	fprintf(stderr, "  -w          - keep patching objects the process loads later\n");
+	fprintf(stderr, "  -F          - keep the process' forked children patched\n");
+	fprintf(stderr, "  -l          - wait for busy functions one by one\n");
+	fprintf(stderr, "  -H          - put patches onto huge pages\n");
+	fprintf(stderr, "  -S          - share patched text with other processes\n");
+	fprintf(stderr, "  -m          - map patches from files in /dev/shm\n");
+	fprintf(stderr, "  -C          - make direct calls of patched functions call the new code\n");
 	return -1;
 }
 
@@ -908,14 +2521,41 @@ int cmd_patch_user(int argc, char *argv[])
 {
 	kpatch_storage_t storage;
 	int opt, pid = -1, is_pid_set = 0, ret, start = 0, send_fd = -1;
+	int use_agent = 0, watch = 0, follow_forks = 0, lazy = 0;
+	int huge_arenas = 0, share_text = 0, map_patches = 0;
+	int redirect_calls = 0;
 
 	if (argc < 4)
 		return usage_patch(NULL);
 
-	while ((opt = getopt(argc, argv, "hsp:r:")) != EOF) {
+	while ((opt = getopt(argc, argv, "hsp:r:awFlHSmC")) != EOF) {
 		switch (opt) {
 		case 'h':
 			return usage_patch(NULL);
+		case 'a':
+			use_agent = 1;
+			break;
+		case 'w':
+			watch = 1;
+			break;
+		case 'F':
+			follow_forks = 1;
+			break;
+		case 'l':
+			lazy = 1;
+			break;
+		case 'H':
+			huge_arenas = 1;
+			break;
+		case 'S':
+			share_text = 1;
+			break;
+		case 'm':
+			map_patches = 1;
+			break;
+		case 'C':
+			redirect_calls = 1;
+			break;
 		case 'p':
 			if (strcmp(optarg, "all"))
 				pid = atoi(optarg);
@@ -938,6 +2578,12 @@ int cmd_patch_user(int argc, char *argv[])
 	if (!is_pid_set)
 		return usage_patch("PID argument is mandatory");
 
+	if ((watch || follow_forks) && pid == -1)
+		return usage_patch("-w and -F require a single PID");
+
+	if (watch && follow_forks)
+		return usage_patch("-w and -F can't be used together");
+
 	if (!kpatch_check_system())
 		goto out_err;
 
@@ -946,7 +2592,9 @@ int cmd_patch_user(int argc, char *argv[])
 		goto out_err;
 
 
-	ret = processes_patch(&storage, pid, start, send_fd);
+	ret = processes_patch(&storage, pid, start, send_fd, use_agent, watch,
+			      follow_forks, lazy, huge_arenas, share_text,
+			      map_patches, redirect_calls);
 
 	storage_free(&storage);
 
@@ -1007,17 +2655,29 @@ object_unapply_patch(struct object_file *o, int check_flag)
 {
 	int ret;
 	size_t i;
-	unsigned long orig_code_addr;
+	unsigned long undo;
 
 	ret = object_find_applied_patch_info(o);
 	if (ret < 0)
 		return ret;
 
+	ret = kpatch_object_unshare_text(o);
+	if (ret < 0)
+		return ret;
+
 	ret = patch_ensure_safety(o, ACTION_UNAPPLY_PATCH);
 	if (ret < 0)
 		return ret;
 
-	orig_code_addr = o->kpta + o->kpfile.patch->user_undo;
+	ret = object_restore_calls(o, o->kpta, o->kpfile.patch);
+	if (ret < 0)
+		return ret;
+	ret = kpatch_agent_flush(proc2pctx(o->proc));
+	if (ret < 0)
+		return ret;
+
+	/* Undo slots are indexed by hunk, see patch_stash_hunk */
+	undo = o->kpta + o->kpfile.patch->user_undo;
 
 	for (i = 0; i < o->ninfo; i++) {
 		if (is_new_func(&o->info[i]))
@@ -1028,21 +2688,23 @@ object_unapply_patch(struct object_file *o, int check_flag)
 
 		ret = kpatch_process_memcpy(o->proc,
 					    o->info[i].daddr,
-					    orig_code_addr,
+					    undo + i * HUNK_SIZE,
 					    HUNK_SIZE);
 		/* XXX(pboldin) We are in deep trouble here, handle it
 		 * by restoring the patch back */
 		if (ret < 0)
 			return ret;
-
-		orig_code_addr += HUNK_SIZE;
 	}
 
-	ret = kpatch_munmap_remote(proc2pctx(o->proc),
-				   o->kpta,
-				   o->kpfile.size);
+	/* No thread can be in the patch code now, give the region back */
+	ret = kpatch_process_free_patch(o->proc, o->kpta, o->kpta_size);
+	if (ret < 0)
+		return ret;
+
+	o->kpta = 0UL;
+	o->kpta_size = 0;
 
-	return ret;
+	return 0;
 }
 
 static int
@@ -0,0 +1,28 @@
+#include <stdio.h>
+#include <unistd.h>
+
+void print_greetings(void)
+{
+	printf("Hello from UNPATCHED inner function\n");
+	sleep(1);
+}
+
+/* Not patched, keeps the patched frames apart */
+void do_inner_work(void)
+{
+	print_greetings();
+}
+
+void do_work(void)
+{
+	do_inner_work();
+	printf("Hello from UNPATCHED outer function\n");
+}
+
+int main()
+{
+	while (1)
+		do_work();
+
+	return 0;
+}
@@ -0,0 +1,20 @@
+#include <unistd.h>
+#include <stdio.h>
+
+extern int get_unpatched(void);
+extern int get_one(void);
+extern int get_two(void);
+
+void print_greetings(void)
+{
+	if (get_unpatched() == 0)
+		printf("Resolved IFUNCs UNPATCHED\n");
+}
+
+int main()
+{
+	while(1) {
+		print_greetings();
+		sleep(1);
+	}
+}
@@ -0,0 +1,27 @@
+int get_unpatched(void)
+{
+	return 0;
+}
+
+static int one(void)
+{
+	return 1;
+}
+
+static int two(void)
+{
+	return 2;
+}
+
+static int (*resolve_one(void))(void)
+{
+	return one;
+}
+
+static int (*resolve_two(void))(void)
+{
+	return two;
+}
+
+int get_one(void) __attribute__ ((ifunc ("resolve_one")));
+int get_two(void) __attribute__ ((ifunc ("resolve_two")));
@@ -0,0 +1,33 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+static volatile unsigned long counter;
+
+void busy_work(void)
+{
+	counter++;
+}
+
+void *busy_thread(void *unused)
+{
+	while (1)
+		busy_work();
+}
+
+void print_greetings(void)
+{
+	printf("Hello from UNPATCHED binary\n");
+}
+
+int main()
+{
+	pthread_t thr;
+
+	pthread_create(&thr, NULL, busy_thread, NULL);
+
+	while (1) {
+		print_greetings();
+		sleep(1);
+	}
+}
@@ -222,7 +222,7 @@ test_patch_dir_fini() {
 
 check_result_startup() {
 	case "$1" in
-		fail_coro|fail_busy_single*|fail_threading)
+		fail_coro|fail_busy_single*|fail_busy_nested|fail_threading)
 			grep -q '\<PATCHED' $2
 			return $?
 			;;
@@ -375,6 +375,47 @@ test_patch_startup_ld_linux_fini() {
 }
 
 
+test_patch_lazy_init() {
+	export LD_PRELOAD=$PWD/fastsleep.so
+	CHECK_RESULT=check_result_lazy
+}
+
+test_patch_lazy() {
+	local testname=$1
+	local outfile=$2
+	local logfile=$3
+
+	local kpatch_file=$testname/$DESTDIR/${testname}.kpatch
+
+	LD_LIBRARY_PATH=$testname/$DESTDIR \
+		stdbuf -o 0 \
+		$PWD/$testname/$DESTDIR/$testname >$outfile 2>&1 & :
+	local pid=$!
+	wait_file $outfile
+
+	$TIME $LIBCARE_DOCTOR -v patch-user -l -p $pid $kpatch_file \
+		>$logfile 2>&1 || :
+
+	sleep 3
+
+	kill_reap $pid
+}
+
+check_result_lazy() {
+	case $1 in
+		fail_busy_nested)
+			grep_tail '\<PATCHED inner' && grep_tail '\<PATCHED outer'
+			return $?
+			;;
+	esac
+	check_result "$@"
+}
+
+test_patch_lazy_fini() {
+	:
+}
+
+
 test_patch_patchlevel_init() {
 	export LD_PRELOAD=$PWD/fastsleep.so
 	CHECK_RESULT=check_result_patchlevel
@@ -422,10 +463,19 @@ check_result_patchlevel() {
 	local testname=$1
 	local outfile=$2
 
-	if test $testname != "patchlevel"; then
-		echo "UNKNOWN test for patchlevel flavor: $testname"
-		return 1
-	fi
+	case $testname in
+		patchlevel)
+			;;
+		patchlevel_busy)
+			grep -q "Hello from SEMIPATCHED binary" $outfile && \
+				grep_tail "Hello from PATCHED binary"
+			return $?
+			;;
+		*)
+			echo "UNKNOWN test for patchlevel flavor: $testname"
+			return 1
+			;;
+	esac
 
 	if ! grep -q "Hello from SEMIPATCHED shared library" $outfile; then
 		return 1
@@ -494,28 +544,47 @@ test_one() {
 
 
 should_skip() {
+	# Only the tests busy in a way just -l copes with
+	if test "$FLAVOR" = "test_patch_lazy"; then
+		test "$1" != "fail_busy_nested"
+		return $?
+	fi
+
 	if test "$FLAVOR" = "test_patch_patchlevel"; then
-		if test "$1" != "patchlevel"; then
-			return 0;
-		fi
+		case "$1" in
+		patchlevel|patchlevel_*)
+			;;
+		*)
+			return 0
+			;;
+		esac
 	else
-		if test "$1" = "patchlevel"; then
+		case "$1" in
+		patchlevel|patchlevel_*)
 			return 0
-		fi
+			;;
+		esac
 	fi
 
 	case "$1" in
-	ifunc)
+	ifunc|ifunc_batch)
 		if grep -q 'release 6' /etc/redhat-release 2>/dev/null; then
 			return 0
 		fi
 		;;
 	fail_busy_threads|fail_busy_single|fail_busy_single_top|fail_coro|\
-	fail_threading)
+	fail_threading|fail_busy_nested)
 		if test "$FLAVOR" = "test_unpatch_files"; then
 			return 0
 		fi
 		;;
+	fail_crc)
+		# Only the regular build damages the patch
+		if test "$FLAVOR" = "test_unpatch_files" ||
+		   test "$DESTDIR" != "build"; then
+			return 0
+		fi
+		;;
 	esac
 	return 1
 }
@@ -564,6 +633,7 @@ main() {
 		test_patch_startup|\
 		test_patch_startup_ld_linux|\
 		test_unpatch_files|\
+		test_patch_lazy|\
 		test_patch_patchlevel)
 			;;
 		*)
@@ -0,0 +1,6 @@
+__thread int lib_tls = 0x1234;
+
+int *lib_tls_addr(void)
+{
+	return &lib_tls;
+}
@@ -0,0 +1,23 @@
+#include <stdio.h>
+#include <unistd.h>
+
+extern __thread int lib_tls;
+extern int *lib_tls_addr(void);
+
+void print_greetings(void)
+{
+	printf("TLS UNPATCHED\n");
+}
+
+int main()
+{
+	/* The patch reads the offset from the GOT entry this makes */
+	if (lib_tls != 0x1234)
+		return 1;
+
+	while (1) {
+		print_greetings();
+		sleep(1);
+	}
+	return 0;
+}